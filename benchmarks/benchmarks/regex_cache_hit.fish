@@ -0,0 +1,7 @@
+# One million `string match -r` calls with the same pattern. After the first
+# call the compiled pattern comes from the regex cache.
+for i in (seq 1000)
+    for j in (seq 1000)
+        string match -qr '^item-(\d+)-(\d+)$' item-$i-$j
+    end
+end
@@ -0,0 +1,7 @@
+# One million `string match -r` calls, each with a pattern that has not been
+# seen before, so every call compiles. Compare with regex_cache_hit.
+for i in (seq 1000)
+    for j in (seq 1000)
+        string match -qr "^item-(\d+)-(\d+)\$|^$i-$j\$" item-$i-$j
+    end
+end
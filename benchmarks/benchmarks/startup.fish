@@ -0,0 +1,6 @@
+# One thousand runs of `fish -c true`, which is mostly the cost of starting
+# fish and reading its configuration. Run fish with -d2 to see how long each
+# startup phase takes.
+for i in (seq 1000)
+    eval $__fish_bin_dir/fish -c true
+end
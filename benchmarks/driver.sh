@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# This is meant to be run by "make benchmark". It runs each script in
+# benchmarks/benchmarks with the given fish and reports the elapsed time. If a
+# second fish is given, each benchmark is run with both so builds can be
+# compared. A benchmark name (without .fish) may be given to run just that one.
+#
+# Usage: driver.sh /path/to/fish [/path/to/other/fish] [benchmark...]
+#
+if [ "$#" -eq 0 ]; then
+    echo "Usage: driver.sh /path/to/fish [/path/to/other/fish] [benchmark...]"
+    exit 1
+fi
+
+FISH_PATHS=$1
+shift
+if [ "$#" -gt 0 ] && [ -x "$1" ] && [ ! -d "$1" ]; then
+    FISH_PATHS="$FISH_PATHS $1"
+    shift
+fi
+
+BENCHMARKS_DIR=$(dirname "$0")/benchmarks
+if [ "$#" -gt 0 ]; then
+    BENCHMARKS=""
+    for name in "$@"; do
+        BENCHMARKS="$BENCHMARKS $BENCHMARKS_DIR/$name.fish"
+    done
+else
+    BENCHMARKS=$(ls "$BENCHMARKS_DIR"/*.fish)
+fi
+
+# Benchmarks must not be affected by the user's configuration.
+BENCH_HOME=$(mktemp -d "${TMPDIR:-/tmp}/fish_bench.XXXXXX") || exit 1
+trap 'rm -rf "$BENCH_HOME"' EXIT INT TERM
+
+status=0
+for benchmark in $BENCHMARKS; do
+    echo "$(basename "$benchmark" .fish)"
+    for fish in $FISH_PATHS; do
+        start=$(date +%s.%N)
+        XDG_CONFIG_HOME=$BENCH_HOME XDG_DATA_HOME=$BENCH_HOME HOME=$BENCH_HOME \
+            "$fish" "$benchmark" > /dev/null || status=1
+        end=$(date +%s.%N)
+        awk "BEGIN { printf \"    %-40s %8.3fs\\n\", \"$fish\", $end - $start }"
+    done
+done
+exit $status
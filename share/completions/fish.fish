@@ -6,3 +6,4 @@ complete -c fish -s i -l interactive --description "Run in interactive mode"
 complete -c fish -s l -l login --description "Run in login mode"
 complete -c fish -s p -l profile --description "Output profiling information to specified file" -f
 complete -c fish -s d -l debug --description "Run with the specified verbosity level"
+complete -c fish -s W -l whole-script --description "Check the whole script for syntax errors before running it"
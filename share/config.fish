@@ -201,8 +201,13 @@ end
 
 # Set the locale if it isn't explicitly set. Allowing the lack of locale env vars to imply the
 # C/POSIX locale causes too many problems. Do this before reading the snippets because they might be
-# in UTF-8 (with non-ASCII characters).
-__fish_set_locale
+# in UTF-8 (with non-ASCII characters). The check here is the one __fish_set_locale starts with, so
+# the common case of an inherited locale doesn't have to autoload it (or the `string` shim).
+if not builtin string length -q -- $LANG $LANGUAGE $LC_CTYPE $LC_NUMERIC $LC_TIME $LC_COLLATE \
+        $LC_MONETARY $LC_MESSAGES $LC_PAPER $LC_NAME $LC_ADDRESS $LC_TELEPHONE $LC_MEASUREMENT \
+        $LC_IDENTIFICATION $LC_ALL
+    __fish_set_locale
+end
 
 # As last part of initialization, source the conf directories
 # Implement precedence (User > Admin > Extra (e.g. vendors) > Fish) by basically doing "basename"
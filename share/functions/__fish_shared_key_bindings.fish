@@ -27,6 +27,8 @@ function __fish_shared_key_bindings -d "Bindings shared between emacs and vi mod
     bind $argv \cv fish_clipboard_paste
 
     bind $argv \e cancel
+    # Terminals in bracketed paste mode wrap pasted text in \e[200~ ... \e[201~.
+    bind $argv \e\[200~ begin-paste
     bind $argv \t complete
     # shift-tab does a tab complete followed by a search.
     bind $argv --key btab complete-and-search
@@ -1807,6 +1807,74 @@ static int builtin_random(parser_t &parser, io_streams_t &streams, wchar_t **arg
     return STATUS_BUILTIN_OK;
 }
 
+/// Number of bytes the read builtin reads at a time from seekable input.
+#define READ_CHUNK_SIZE 512
+
+/// Decodes the bytes of a line for the read builtin.
+class read_line_decoder_t {
+    wcstring *buff;
+    bool split_null;
+    int nchars;
+    mbstate_t state;
+
+   public:
+    read_line_decoder_t(wcstring *b, bool split, int n) : buff(b), split_null(split), nchars(n) {
+        memset(&state, 0, sizeof state);
+    }
+
+    /// Consumes a byte of input. Returns true if that finished the line.
+    bool consume(char b) {
+        wchar_t res = 0;
+        if (MB_CUR_MAX == 1) {  // single-byte locale
+            res = (unsigned char)b;
+        } else {
+            size_t sz = mbrtowc(&res, &b, 1, &state);
+            if (sz == (size_t)-1) {
+                memset(&state, 0, sizeof state);
+                return false;
+            } else if (sz == (size_t)-2) {
+                return false;
+            }
+        }
+
+        if (!split_null && res == L'\n') return true;
+        if (split_null && res == L'\0') return true;
+
+        buff->push_back(res);
+        return 0 < nchars && (size_t)nchars <= buff->size();
+    }
+};
+
+/// Reads a line from a pipe or terminal. We can't put back anything we read past the end of the
+/// line, and whatever reads the fd next must see it, so this reads a byte at a time. Returns true
+/// if we reached the end of the input.
+static bool read_line_one_byte_at_a_time(int fd, read_line_decoder_t *decoder) {
+    char b;
+    for (;;) {
+        if (read_blocked(fd, &b, 1) <= 0) return true;
+        if (decoder->consume(b)) return false;
+    }
+}
+
+/// Reads a line from a seekable fd, such as a redirected file. This reads a chunk at a time, and
+/// seeks back over whatever was read past the end of the line. Returns true if we reached the end
+/// of the input.
+static bool read_line_in_chunks(int fd, read_line_decoder_t *decoder) {
+    char chunk[READ_CHUNK_SIZE];
+    for (;;) {
+        long amt = read_blocked(fd, chunk, sizeof chunk);
+        if (amt <= 0) return true;
+        for (long idx = 0; idx < amt; idx++) {
+            if (decoder->consume(chunk[idx])) {
+                if (idx + 1 < amt && lseek(fd, idx + 1 - amt, SEEK_CUR) == -1) {
+                    wperror(L"lseek");
+                }
+                return false;
+            }
+        }
+    }
+}
+
 /// The read builtin. Reads from stdin and stores the values in environment variables.
 static int builtin_read(parser_t &parser, io_streams_t &streams, wchar_t **argv) {
     wgetopter_t w;
@@ -2008,47 +2076,14 @@ static int builtin_read(parser_t &parser, io_streams_t &streams, wchar_t **argv)
         }
         reader_pop();
     } else {
-        int eof = 0;
-
         buff.clear();
 
-        while (1) {
-            int finished = 0;
-            wchar_t res = 0;
-            mbstate_t state = {};
-
-            while (!finished) {
-                char b;
-                if (read_blocked(streams.stdin_fd, &b, 1) <= 0) {
-                    eof = 1;
-                    break;
-                }
-
-                if (MB_CUR_MAX == 1)  // single-byte locale
-                {
-                    res = (unsigned char)b;
-                    finished = 1;
-                } else {
-                    size_t sz = mbrtowc(&res, &b, 1, &state);
-                    if (sz == (size_t)-1) {
-                        memset(&state, 0, sizeof(state));
-                    } else if (sz != (size_t)-2) {
-                        finished = 1;
-                    }
-                }
-            }
-
-            if (eof) break;
-
-            if (!split_null && res == L'\n') break;
-
-            if (split_null && res == L'\0') break;
-
-            buff.push_back(res);
-
-            if (0 < nchars && (size_t)nchars <= buff.size()) {
-                break;
-            }
+        read_line_decoder_t decoder(&buff, split_null, nchars);
+        bool eof;
+        if (lseek(streams.stdin_fd, 0, SEEK_CUR) != -1) {
+            eof = read_line_in_chunks(streams.stdin_fd, &decoder);
+        } else {
+            eof = read_line_one_byte_at_a_time(streams.stdin_fd, &decoder);
         }
 
         if (buff.empty() && eof) {
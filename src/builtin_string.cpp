@@ -8,6 +8,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -22,6 +23,7 @@
 #include "common.h"
 #include "fallback.h"  // IWYU pragma: keep
 #include "io.h"
+#include "lru.h"
 #include "parse_util.h"
 #include "pcre2.h"
 #include "wgetopt.h"
@@ -339,7 +341,78 @@ static wcstring pcre2_strerror(int err_code) {
     return buf;
 }
 
+/// Compiled patterns are kept in a process-wide LRU cache, keyed by the pattern and the flags it
+/// was compiled with, so that `string match -r` and `string replace -r` in a loop don't recompile
+/// the same regex on every iteration.
+#define REGEX_CACHE_SIZE 64
+
+/// A shared reference to a compiled pattern. Evicting a pattern from the cache does not free it
+/// while an invocation is still using it.
+typedef shared_ptr<pcre2_code> pcre2_code_ref_t;
+
+static void pcre2_code_deleter(pcre2_code *code) { pcre2_code_free(code); }
+
+class regex_cache_node_t : public lru_node_t {
+   public:
+    pcre2_code_ref_t code;
+    /// Whether the pattern has been JIT compiled. Patterns are only JIT compiled once they are
+    /// reused, since for a one-off match the JIT costs more than it saves.
+    bool jit_compiled;
+
+    regex_cache_node_t(const wcstring &key, const pcre2_code_ref_t &code_)
+        : lru_node_t(key), code(code_), jit_compiled(false) {}
+};
+
+class regex_cache_t : public lru_cache_t<regex_cache_node_t> {
+   protected:
+    virtual void node_was_evicted(regex_cache_node_t *node) { delete node; }
+
+   public:
+    regex_cache_t() : lru_cache_t<regex_cache_node_t>(REGEX_CACHE_SIZE) {}
+};
+
+static mutex_lock_t s_regex_cache_lock;
+static regex_cache_t s_regex_cache;
+
+static wcstring regex_cache_key(const wchar_t *pattern, uint32_t options) {
+    wcstring key = format_string(L"%lx:", (unsigned long)options);
+    key.append(pattern);
+    return key;
+}
+
+/// Match data is never shared between threads, but can be reused across patterns as long as its
+/// ovector is large enough. Keep one per thread and grow it as needed.
+static pthread_key_t s_match_data_key;
+static pthread_once_t s_match_data_key_once = PTHREAD_ONCE_INIT;
+
+static void match_data_destroy(void *match) { pcre2_match_data_free((pcre2_match_data *)match); }
+
+static void match_data_key_create() {
+    VOMIT_ON_FAILURE_NO_ERRNO(pthread_key_create(&s_match_data_key, match_data_destroy));
+}
+
+static pcre2_match_data *match_data_for_code(const pcre2_code *code) {
+    VOMIT_ON_FAILURE_NO_ERRNO(pthread_once(&s_match_data_key_once, match_data_key_create));
+
+    uint32_t capture_count = 0;
+    pcre2_pattern_info(code, PCRE2_INFO_CAPTURECOUNT, &capture_count);
+
+    pcre2_match_data *match = (pcre2_match_data *)pthread_getspecific(s_match_data_key);
+    if (match == NULL || pcre2_get_ovector_count(match) < capture_count + 1) {
+        if (match != NULL) {
+            pcre2_match_data_free(match);
+        }
+        match = pcre2_match_data_create(capture_count + 1, 0);
+        if (match == NULL) {
+            DIE_MEM();
+        }
+        VOMIT_ON_FAILURE_NO_ERRNO(pthread_setspecific(s_match_data_key, match));
+    }
+    return match;
+}
+
 struct compiled_regex_t {
+    pcre2_code_ref_t code_ref;
     pcre2_code *code;
     pcre2_match_data *match;
 
@@ -351,34 +424,50 @@ struct compiled_regex_t {
 #if PCRE2_CODE_UNIT_WIDTH < 32
         options |= PCRE2_NEVER_BACKSLASH_C;
 #endif
-
-        int err_code = 0;
-        PCRE2_SIZE err_offset = 0;
-
-        code =
-            pcre2_compile(PCRE2_SPTR(pattern), PCRE2_ZERO_TERMINATED,
-                          options | (ignore_case ? PCRE2_CASELESS : 0), &err_code, &err_offset, 0);
-        if (code == 0) {
-            string_error(streams, _(L"%ls: Regular expression compile error: %ls\n"), argv0,
-                         pcre2_strerror(err_code).c_str());
-            string_error(streams, L"%ls: %ls\n", argv0, pattern);
-            string_error(streams, L"%ls: %*ls\n", argv0, err_offset, L"^");
-            return;
+        if (ignore_case) options |= PCRE2_CASELESS;
+
+        const wcstring key = regex_cache_key(pattern, options);
+        {
+            scoped_lock locker(s_regex_cache_lock);
+            regex_cache_node_t *node = s_regex_cache.get_node(key);
+            if (node != NULL) {
+                code_ref = node->code;
+                if (!node->jit_compiled) {
+                    // JIT compilation is an optimization only. If pcre2 was built without JIT
+                    // support, or the JIT fails for this pattern, pcre2_match() silently falls
+                    // back to the interpreter.
+                    pcre2_jit_compile(code_ref.get(), PCRE2_JIT_COMPLETE);
+                    node->jit_compiled = true;
+                }
+            }
         }
 
-        match = pcre2_match_data_create_from_pattern(code, 0);
-        if (match == 0) {
-            DIE_MEM();
-        }
-    }
+        if (!code_ref) {
+            int err_code = 0;
+            PCRE2_SIZE err_offset = 0;
+
+            pcre2_code *compiled = pcre2_compile(PCRE2_SPTR(pattern), PCRE2_ZERO_TERMINATED,
+                                                 options, &err_code, &err_offset, 0);
+            if (compiled == 0) {
+                string_error(streams, _(L"%ls: Regular expression compile error: %ls\n"), argv0,
+                             pcre2_strerror(err_code).c_str());
+                string_error(streams, L"%ls: %ls\n", argv0, pattern);
+                string_error(streams, L"%ls: %*ls\n", argv0, err_offset, L"^");
+                return;
+            }
 
-    ~compiled_regex_t() {
-        if (match != 0) {
-            pcre2_match_data_free(match);
-        }
-        if (code != 0) {
-            pcre2_code_free(code);
+            code_ref = pcre2_code_ref_t(compiled, pcre2_code_deleter);
+
+            scoped_lock locker(s_regex_cache_lock);
+            regex_cache_node_t *node = new regex_cache_node_t(key, code_ref);
+            if (!s_regex_cache.add_node(node)) {
+                // Another thread beat us to it.
+                delete node;
+            }
         }
+
+        code = code_ref.get();
+        match = match_data_for_code(code);
     }
 };
 
@@ -6,9 +6,14 @@
 #include "config.h"  // IWYU pragma: keep
 
 #include <assert.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <pwd.h>
+#include <signal.h>
 #include <stddef.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <wchar.h>
 #include <wctype.h>
 #include <algorithm>
@@ -34,7 +39,9 @@
 #include "parse_util.h"
 #include "parser.h"
 #include "path.h"
+#include "postfork.h"
 #include "proc.h"
+#include "signal.h"
 #include "util.h"
 #include "wildcard.h"
 #include "wutil.h"  // IWYU pragma: keep
@@ -51,6 +58,11 @@
 /// Description for short variables. The value is concatenated to this description.
 #define COMPLETE_VAR_DESC_VAL _(L"Variable: %ls")
 
+/// The most strings an argument may expand to when computing an autosuggestion. Autosuggestions run
+/// on every keystroke, so give up on arguments like {a,b}{a,b}{a,b}... instead of building every
+/// product; the user can still ask for them with tab.
+#define AUTOSUGGEST_EXPAND_MAX_RESULTS 4096
+
 /// The special cased translation macro for completions. The empty string needs to be special cased,
 /// since it can occur, and should not be translated. (Gettext returns the version information as
 /// the response).
@@ -564,6 +576,290 @@ void completer_t::complete_strings(const wcstring &wc_escaped, const wchar_t *de
     }
 }
 
+// Command descriptions for command name completion. Rather than running apropos for every
+// completion, we build an index of all section 1 and 8 man page descriptions in the background, save
+// it to disk, and load it lazily. The index is keyed by the modification time of the man pages, so
+// it is rebuilt when pages are installed or removed.
+
+/// Name of the file, in the data directory, that holds the description index.
+#define COMMAND_DESC_INDEX_FILE L"command_descriptions"
+
+/// First line of the description index file. Followed by the man page stamp.
+#define COMMAND_DESC_INDEX_HEADER "# fish command descriptions "
+
+/// How often, in seconds, to check whether the man pages have changed.
+#define COMMAND_DESC_CHECK_INTERVAL 60
+
+typedef std::map<wcstring, wcstring> command_desc_map_t;
+
+/// The loaded description index. Only accessed on the main thread.
+static struct {
+    /// Map from command name to description.
+    command_desc_map_t descs;
+    /// Whether descs holds an index that matches the man pages.
+    bool loaded;
+    /// Whether a background rebuild of the index is in progress.
+    bool rebuilding;
+    /// The man page stamp the index was built for.
+    long stamp;
+    /// When we last checked the man page stamp.
+    double last_check;
+} s_command_desc_index = {command_desc_map_t(), false, false, 0, 0.0};
+
+/// State for building the description index on a background thread.
+struct command_desc_build_t {
+    wcstring path;
+    long stamp;
+    /// Read end of the pipe apropos writes to.
+    int apropos_fd;
+    command_desc_map_t descs;
+};
+
+static wcstring command_desc_index_path() {
+    wcstring path;
+    if (!path_get_data(path)) return L"";
+    path.append(L"/" COMMAND_DESC_INDEX_FILE);
+    return path;
+}
+
+/// Returns a stamp for the installed man pages: the latest modification time of the man database
+/// files and the directories holding section 1 and 8 pages, or 0 if there are none.
+static long command_desc_man_stamp() {
+    wcstring_list_t roots;
+    const env_var_t manpath = env_get_string(L"MANPATH");
+    if (!manpath.missing_or_empty()) tokenize_variable_array(manpath, roots);
+
+    // An empty MANPATH element stands for the system default directories.
+    bool use_defaults = roots.empty();
+    for (size_t i = 0; i < roots.size(); i++) {
+        if (roots.at(i).empty()) use_defaults = true;
+    }
+    if (use_defaults) {
+        roots.push_back(L"/usr/share/man");
+        roots.push_back(L"/usr/local/share/man");
+        roots.push_back(L"/usr/local/man");
+        roots.push_back(L"/opt/local/share/man");
+    }
+
+    wcstring_list_t paths;
+    paths.push_back(L"/var/cache/man/index.db");  // man-db
+    for (size_t i = 0; i < roots.size(); i++) {
+        const wcstring &root = roots.at(i);
+        if (root.empty()) continue;
+        paths.push_back(root + L"/man1");
+        paths.push_back(root + L"/man8");
+        paths.push_back(root + L"/whatis");      // BSD and OS X
+        paths.push_back(root + L"/mandoc.db");   // mandoc
+        paths.push_back(root + L"/index.db");    // man-db, per tree
+    }
+
+    long stamp = 0;
+    struct stat buf;
+    for (size_t i = 0; i < paths.size(); i++) {
+        if (wstat(paths.at(i), &buf) == 0) stamp = maxi(stamp, (long)buf.st_mtime);
+    }
+    return stamp;
+}
+
+/// Loads the description index from the given path, if it was built for the given stamp.
+static bool command_desc_index_load(const wcstring &path, long stamp, command_desc_map_t *out) {
+    FILE *f = wfopen(path, "r");
+    if (f == NULL) return false;
+
+    bool ok = false;
+    std::string line;
+    char buf[1024];
+    bool first = true;
+    while (fgets(buf, sizeof buf, f) != NULL) {
+        line.append(buf);
+        if (line.empty() || line.at(line.size() - 1) != '\n') continue;  // partial line
+        line.resize(line.size() - 1);
+
+        if (first) {
+            first = false;
+            char expected[64];
+            snprintf(expected, sizeof expected, COMMAND_DESC_INDEX_HEADER "%ld", stamp);
+            if (line != expected) break;
+            ok = true;
+        } else {
+            size_t tab = line.find('\t');
+            if (tab != std::string::npos) {
+                (*out)[str2wcstring(line.substr(0, tab))] = str2wcstring(line.substr(tab + 1));
+            }
+        }
+        line.clear();
+    }
+    fclose(f);
+    if (!ok) out->clear();
+    return ok;
+}
+
+/// Returns the given range of str with leading and trailing whitespace removed.
+static wcstring command_desc_trimmed(const wcstring &str, size_t start, size_t end) {
+    while (start < end && iswspace(str.at(start))) start++;
+    while (end > start && iswspace(str.at(end - 1))) end--;
+    return wcstring(str, start, end - start);
+}
+
+/// Parses one line of apropos output, such as "getty, agetty (8) - alternative Linux getty", adding
+/// any section 1 or 8 names to the map.
+static void command_desc_parse_apropos_line(const wcstring &line, command_desc_map_t *out) {
+    size_t sep = line.find(L" - ");
+    if (sep == wcstring::npos) return;
+
+    wcstring desc = command_desc_trimmed(line, sep + 3, line.size());
+    if (desc.empty()) return;
+    desc.at(0) = towupper(desc.at(0));
+
+    // The section follows the last name, e.g. "ls (1)" or "ls(1)", possibly followed by the page
+    // name in brackets on some systems.
+    size_t names_end = line.find(L" [");
+    if (names_end == wcstring::npos || names_end > sep) names_end = sep;
+    const wcstring names = command_desc_trimmed(line, 0, names_end);
+    size_t paren = names.rfind(L'(');
+    if (paren == wcstring::npos) return;
+    const wcstring section(names, paren);
+    if (section != L"(1)" && section != L"(8)") return;
+
+    size_t start = 0;
+    while (start < paren) {
+        size_t comma = names.find(L',', start);
+        if (comma == wcstring::npos || comma > paren) comma = paren;
+        const wcstring name = command_desc_trimmed(names, start, comma);
+        if (!name.empty()) out->insert(std::make_pair(name, desc));
+        start = comma + 1;
+    }
+}
+
+/// Starts apropos with its output going to a pipe, and returns the read end of the pipe, or -1.
+/// This runs on the main thread rather than the background thread that reads the output, so that
+/// apropos gets the default signal handlers and an empty signal mask (background threads block all
+/// signals, and that would be inherited). We don't wait for it ourselves: like any other child it is
+/// reaped by job_reap, which would otherwise race with us for its exit status.
+static int command_desc_index_spawn_apropos() {
+    ASSERT_IS_MAIN_THREAD();
+    int pipe_fds[2];
+    if (exec_pipe(pipe_fds) == -1) return -1;
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd == -1) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+    set_cloexec(null_fd);
+
+    pid_t pid = execute_fork(false);
+    if (pid == 0) {
+        // This is the child process. Don't allocate memory here.
+        dup2(null_fd, STDIN_FILENO);
+        dup2(pipe_fds[1], STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        signal_reset_handlers();
+        sigset_t empty_set;
+        sigemptyset(&empty_set);
+        sigprocmask(SIG_SETMASK, &empty_set, NULL);
+        execl("/bin/sh", "sh", "-c", "apropos .", (char *)NULL);
+        _exit(127);
+    }
+
+    close(null_fd);
+    close(pipe_fds[1]);
+    return pipe_fds[0];
+}
+
+/// Builds the description index from the output of apropos and saves it. Runs on a background
+/// thread.
+static int command_desc_index_build(command_desc_build_t *build) {
+    FILE *apropos = fdopen(build->apropos_fd, "r");
+    if (apropos == NULL) {
+        close(build->apropos_fd);
+        return -1;
+    }
+
+    std::string line;
+    char buf[1024];
+    while (fgets(buf, sizeof buf, apropos) != NULL) {
+        line.append(buf);
+        if (line.at(line.size() - 1) != '\n') continue;
+        line.resize(line.size() - 1);
+        command_desc_parse_apropos_line(str2wcstring(line), &build->descs);
+        line.clear();
+    }
+    fclose(apropos);
+    if (build->descs.empty()) return -1;
+
+    // Write to a temporary file and move it into place, so a concurrent reader never sees a
+    // partially written index.
+    const wcstring tmp_path = format_string(L"%ls.%d", build->path.c_str(), (int)getpid());
+    FILE *out = wfopen(tmp_path, "w");
+    if (out == NULL) return -1;
+    fprintf(out, COMMAND_DESC_INDEX_HEADER "%ld\n", build->stamp);
+    for (command_desc_map_t::const_iterator iter = build->descs.begin();
+         iter != build->descs.end(); ++iter) {
+        const std::string name = wcs2string(iter->first);
+        const std::string desc = wcs2string(iter->second);
+        fprintf(out, "%s\t%s\n", name.c_str(), desc.c_str());
+    }
+    bool ok = !ferror(out);
+    if (fclose(out) != 0) ok = false;
+    if (!ok || wrename(tmp_path, build->path) != 0) {
+        wunlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+static void command_desc_index_built(command_desc_build_t *build, int ret) {
+    ASSERT_IS_MAIN_THREAD();
+    s_command_desc_index.rebuilding = false;
+    if (ret == 0 && build->stamp == s_command_desc_index.stamp) {
+        s_command_desc_index.descs.swap(build->descs);
+        s_command_desc_index.loaded = true;
+    }
+    delete build;
+}
+
+/// Returns the command description index, or NULL if it is not available yet. Loads the index
+/// from disk on first use, and kicks off a background rebuild if it is missing or out of date.
+static const command_desc_map_t *command_desc_index_get() {
+    ASSERT_IS_MAIN_THREAD();
+    const double now = timef();
+    if (s_command_desc_index.last_check != 0.0 &&
+        now - s_command_desc_index.last_check < COMMAND_DESC_CHECK_INTERVAL) {
+        return s_command_desc_index.loaded ? &s_command_desc_index.descs : NULL;
+    }
+    s_command_desc_index.last_check = now;
+
+    const long stamp = command_desc_man_stamp();
+    if (s_command_desc_index.loaded && stamp == s_command_desc_index.stamp) {
+        return &s_command_desc_index.descs;
+    }
+
+    const wcstring path = command_desc_index_path();
+    s_command_desc_index.stamp = stamp;
+    s_command_desc_index.descs.clear();
+    s_command_desc_index.loaded = false;
+    if (stamp == 0 || path.empty()) return NULL;  // no man pages, or nowhere to keep the index
+
+    if (command_desc_index_load(path, stamp, &s_command_desc_index.descs)) {
+        s_command_desc_index.loaded = true;
+        return &s_command_desc_index.descs;
+    }
+
+    if (!s_command_desc_index.rebuilding) {
+        int apropos_fd = command_desc_index_spawn_apropos();
+        if (apropos_fd != -1) {
+            s_command_desc_index.rebuilding = true;
+            command_desc_build_t *build = new command_desc_build_t();
+            build->path = path;
+            build->stamp = stamp;
+            build->apropos_fd = apropos_fd;
+            iothread_perform(command_desc_index_build, command_desc_index_built, build);
+        }
+    }
+    return NULL;
+}
+
 /// If command to complete is short enough, substitute the description with the whatis information
 /// for the executable.
 void completer_t::complete_cmd_desc(const wcstring &str) {
@@ -579,14 +875,6 @@ void completer_t::complete_cmd_desc(const wcstring &str) {
     else
         cmd_start = cmd;
 
-    // Using apropos with a single-character search term produces far to many results - require at
-    // least two characters if we don't know the location of the whatis-database.
-    if (wcslen(cmd_start) < 2) return;
-
-    if (wildcard_has(cmd_start, 0)) {
-        return;
-    }
-
     skip = 1;
 
     for (size_t i = 0; i < this->completions.size(); i++) {
@@ -602,6 +890,32 @@ void completer_t::complete_cmd_desc(const wcstring &str) {
         return;
     }
 
+    // Prefer the description index, which does not require running apropos.
+    const command_desc_map_t *index = command_desc_index_get();
+    if (index != NULL) {
+        for (size_t i = 0; i < this->completions.size(); i++) {
+            completion_t &completion = this->completions.at(i);
+            if (completion.completion.empty()) continue;
+
+            wcstring name = completion.completion;
+            if (!(completion.flags & COMPLETE_REPLACES_TOKEN)) name.insert(0, cmd_start);
+            size_t slash = name.rfind(L'/');
+            if (slash != wcstring::npos) name.erase(0, slash + 1);
+
+            command_desc_map_t::const_iterator desc_iter = index->find(name);
+            if (desc_iter != index->end()) completion.description = desc_iter->second;
+        }
+        return;
+    }
+
+    // Using apropos with a single-character search term produces far to many results - require at
+    // least two characters if we don't know the location of the whatis-database.
+    if (wcslen(cmd_start) < 2) return;
+
+    if (wildcard_has(cmd_start, 0)) {
+        return;
+    }
+
     wcstring lookup_cmd(L"__fish_describe_command ");
     lookup_cmd.append(escape_string(cmd_start, 1));
 
@@ -1048,6 +1362,9 @@ void completer_t::complete_param_expand(const wcstring &str, bool do_file,
     // Squelch file descriptions per issue #254.
     if (this->type() == COMPLETE_AUTOSUGGEST || do_file) flags |= EXPAND_NO_DESCRIPTIONS;
 
+    const size_t max_results =
+        this->type() == COMPLETE_AUTOSUGGEST ? AUTOSUGGEST_EXPAND_MAX_RESULTS : 0;
+
     // We have the following cases:
     //
     // --foo=bar => expand just bar
@@ -1062,7 +1379,8 @@ void completer_t::complete_param_expand(const wcstring &str, bool do_file,
     if (complete_from_separator) {
         const wcstring sep_string = wcstring(str, sep_index + 1);
         std::vector<completion_t> local_completions;
-        if (expand_string(sep_string, &local_completions, flags, NULL) == EXPAND_ERROR) {
+        if (expand_string(sep_string, &local_completions, flags, NULL, max_results) ==
+            EXPAND_ERROR) {
             debug(3, L"Error while expanding string '%ls'", sep_string.c_str());
         }
 
@@ -1081,7 +1399,7 @@ void completer_t::complete_param_expand(const wcstring &str, bool do_file,
         // consider relaxing this if there was a preceding double-dash argument.
         if (string_prefixes_string(L"-", str)) flags &= ~EXPAND_FUZZY_MATCH;
 
-        if (expand_string(str, &this->completions, flags, NULL) == EXPAND_ERROR) {
+        if (expand_string(str, &this->completions, flags, NULL, max_results) == EXPAND_ERROR) {
             debug(3, L"Error while expanding string '%ls'", str.c_str());
         }
     }
@@ -1421,7 +1739,7 @@ void complete(const wcstring &cmd_with_subcmds, std::vector<completion_t> *out_c
 
                     // Check to see if we have a preceding double-dash.
                     for (size_t i = 0; i < matching_arg_index; i++) {
-                        if (all_arguments.at(i)->get_source(cmd) == L"--") {
+                        if (all_arguments.at(i)->source_equals(cmd, L"--")) {
                             had_ddash = true;
                             break;
                         }
@@ -124,6 +124,11 @@ static null_terminated_array_t<char> export_array;
 static bool has_changed_exported = true;
 static void mark_changed_exported() { has_changed_exported = true; }
 
+/// Set while env_init imports the environment fish was started with. Those variables are already
+/// in the process environment and no event handlers can exist yet, so env_set need not react to
+/// them one by one.
+static bool s_importing_environment = false;
+
 /// List of all locale environment variable names.
 static const wchar_t *const locale_variable[] = {
     L"LANG",     L"LANGUAGE",          L"LC_ALL",         L"LC_ADDRESS",   L"LC_COLLATE",
@@ -370,11 +375,13 @@ void env_init(const struct config_paths_t *paths /* or NULL */) {
     // Import environment variables. Walk backwards so that the first one out of any duplicates wins
     // (#2784).
     wcstring key, val;
+    bool imported_locale = false;
     const char *const *envp = environ;
     size_t i = 0;
     while (envp && envp[i]) {
         i++;
     }
+    s_importing_environment = true;
     while (i--) {
         const wcstring key_and_val = str2wcstring(envp[i]);  // like foo=bar
         size_t eql = key_and_val.find(L'=');
@@ -385,6 +392,7 @@ void env_init(const struct config_paths_t *paths /* or NULL */) {
         } else {
             key.assign(key_and_val, 0, eql);
             if (is_read_only(key) || is_electric(key)) continue;
+            if (var_is_locale(key)) imported_locale = true;
             val.assign(key_and_val, eql + 1, wcstring::npos);
             if (variable_is_colon_delimited_array(key)) {
                 std::replace(val.begin(), val.end(), L':', ARRAY_SEP);
@@ -393,6 +401,12 @@ void env_init(const struct config_paths_t *paths /* or NULL */) {
             env_set(key, val.c_str(), ENV_EXPORT | ENV_GLOBAL);
         }
     }
+    s_importing_environment = false;
+    // Apply the locale once, rather than once for every locale variable.
+    if (imported_locale) {
+        setlocale(LC_ALL, "");
+        fish_setlocale();
+    }
 
     // Set the given paths in the environment, if we have any.
     if (paths != NULL) {
@@ -642,6 +656,8 @@ int env_set(const wcstring &key, const wchar_t *val, env_mode_flags_t var_mode)
         }
     }
 
+    if (s_importing_environment) return ENV_OK;
+
     event_t ev = event_t::variable_event(key);
     ev.arguments.reserve(3);
     ev.arguments.push_back(L"VARIABLE");
@@ -735,6 +751,25 @@ const wchar_t *env_var_t::c_str(void) const {
     return wcstring::c_str();
 }
 
+/// Returns the history that $history refers to.
+static history_t *env_get_history() {
+    history_t *history = reader_get_history();
+    if (!history) {
+        history = &history_t::history_with_name(L"fish");
+    }
+    return history;
+}
+
+bool env_is_lazy_list(const wcstring &key) {
+    // As with env_get_string, we only allow getting the history on the main thread.
+    return key == L"history" && is_main_thread();
+}
+
+void env_get_lazy_list(const wcstring &key, size_t max_count, wcstring_list_t *out) {
+    assert(env_is_lazy_list(key));
+    env_get_history()->get_history(out, max_count);
+}
+
 env_var_t env_get_string(const wcstring &key, env_mode_flags_t mode) {
     const bool has_scope = mode & (ENV_LOCAL | ENV_GLOBAL | ENV_UNIVERSAL);
     const bool search_local = !has_scope || (mode & ENV_LOCAL);
@@ -755,12 +790,7 @@ env_var_t env_get_string(const wcstring &key, env_mode_flags_t mode) {
                 return env_var_t::missing_var();
             }
             env_var_t result;
-
-            history_t *history = reader_get_history();
-            if (!history) {
-                history = &history_t::history_with_name(L"fish");
-            }
-            if (history) history->get_string_representation(&result, ARRAY_SEP_STR);
+            env_get_history()->get_string_representation(&result, ARRAY_SEP_STR);
             return result;
         } else if (key == L"COLUMNS") {
             return to_string(common_get_width());
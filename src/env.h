@@ -108,6 +108,16 @@ class env_var_t : public wcstring {
 /// \param mode An optional scope to search in. All scopes are searched if unset
 env_var_t env_get_string(const wcstring &key, env_mode_flags_t mode = ENV_DEFAULT);
 
+/// Returns true if the specified key is an electric variable whose elements can be fetched one at a
+/// time with env_get_lazy_list. Such variables, like $history, may be very long, so callers that
+/// only want some of the elements should use this rather than env_get_string. Only the leading
+/// elements are cheap: there is no lazy count, since $history skips duplicate items and so can't be
+/// counted without decoding all of them.
+bool env_is_lazy_list(const wcstring &key);
+
+/// Gets the first max_count elements of the lazy list variable \p key.
+void env_get_lazy_list(const wcstring &key, size_t max_count, wcstring_list_t *out);
+
 /// Returns true if the specified key exists. This can't be reliably done using env_get, since
 /// env_get returns null for 0-element arrays.
 ///
@@ -5,6 +5,7 @@
 #include <signal.h>
 #include <unistd.h>
 #include <algorithm>
+#include <map>
 #include <memory>
 #include <string>
 
@@ -41,8 +42,20 @@ static volatile int active_list = 0;
 
 typedef std::vector<event_t *> event_list_t;
 
-/// List of event handlers.
+/// List of event handlers, in the order they were added.
 static event_list_t s_event_handlers;
+
+/// Index of the event handlers, so firing an event only visits the handlers that can match it.
+/// Handlers are bucketed by type and by their signal, pid, job id, variable name or generic event
+/// name. Wildcard handlers land in the EVENT_ANY_SIGNAL or EVENT_ANY_PID buckets, and handlers of
+/// type EVENT_ANY in s_any_handlers. Each bucket keeps registration order.
+static std::map<int, event_list_t> s_signal_handlers;
+static std::map<int, event_list_t> s_exit_handlers;
+static std::map<int, event_list_t> s_job_id_handlers;
+static std::map<wcstring, event_list_t> s_variable_handlers;
+static std::map<wcstring, event_list_t> s_generic_handlers;
+static event_list_t s_any_handlers;
+
 /// List of event handlers that should be removed.
 static event_list_t killme;
 
@@ -99,6 +112,123 @@ static int event_match(const event_t &classv, const event_t &instance) {
     return 0;
 }
 
+/// Adds the handler to the bucket of the index it belongs in.
+static void event_index_add(event_t *handler) {
+    switch (handler->type) {
+        case EVENT_SIGNAL: {
+            s_signal_handlers[handler->param1.signal].push_back(handler);
+            break;
+        }
+        case EVENT_EXIT: {
+            s_exit_handlers[handler->param1.pid].push_back(handler);
+            break;
+        }
+        case EVENT_JOB_ID: {
+            s_job_id_handlers[handler->param1.job_id].push_back(handler);
+            break;
+        }
+        case EVENT_VARIABLE: {
+            s_variable_handlers[handler->str_param1].push_back(handler);
+            break;
+        }
+        case EVENT_GENERIC: {
+            s_generic_handlers[handler->str_param1].push_back(handler);
+            break;
+        }
+        default: {
+            s_any_handlers.push_back(handler);
+            break;
+        }
+    }
+}
+
+/// Rebuilds the index from s_event_handlers.
+static void event_index_rebuild() {
+    s_signal_handlers.clear();
+    s_exit_handlers.clear();
+    s_job_id_handlers.clear();
+    s_variable_handlers.clear();
+    s_generic_handlers.clear();
+    s_any_handlers.clear();
+    for (size_t i = 0; i < s_event_handlers.size(); i++) {
+        event_index_add(s_event_handlers.at(i));
+    }
+}
+
+/// Returns the bucket for the given key, or NULL if there is none.
+template <typename KEY>
+static const event_list_t *event_index_bucket(const std::map<KEY, event_list_t> &index,
+                                              const KEY &key) {
+    typename std::map<KEY, event_list_t>::const_iterator where = index.find(key);
+    return where == index.end() ? NULL : &where->second;
+}
+
+/// Appends the handlers that match the given event to \c out, in the order they were added.
+static void event_get_handlers_for(const event_t &event, event_list_t *out) {
+    // At most three buckets can hold matching handlers: the one for the event's exact key, the
+    // wildcard one for its type, and the EVENT_ANY handlers.
+    const event_list_t *buckets[3] = {};
+    size_t bucket_count = 0;
+    switch (event.type) {
+        case EVENT_SIGNAL: {
+            buckets[bucket_count++] = event_index_bucket(s_signal_handlers, event.param1.signal);
+            if (event.param1.signal != EVENT_ANY_SIGNAL) {
+                buckets[bucket_count++] =
+                    event_index_bucket(s_signal_handlers, (int)EVENT_ANY_SIGNAL);
+            }
+            break;
+        }
+        case EVENT_EXIT: {
+            buckets[bucket_count++] = event_index_bucket(s_exit_handlers, (int)event.param1.pid);
+            if (event.param1.pid != EVENT_ANY_PID) {
+                buckets[bucket_count++] = event_index_bucket(s_exit_handlers, (int)EVENT_ANY_PID);
+            }
+            break;
+        }
+        case EVENT_JOB_ID: {
+            buckets[bucket_count++] = event_index_bucket(s_job_id_handlers, event.param1.job_id);
+            break;
+        }
+        case EVENT_VARIABLE: {
+            buckets[bucket_count++] = event_index_bucket(s_variable_handlers, event.str_param1);
+            break;
+        }
+        case EVENT_GENERIC: {
+            buckets[bucket_count++] = event_index_bucket(s_generic_handlers, event.str_param1);
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+    if (!s_any_handlers.empty()) buckets[bucket_count++] = &s_any_handlers;
+
+    size_t nonempty = 0;
+    const event_list_t *only = NULL;
+    for (size_t i = 0; i < bucket_count; i++) {
+        if (buckets[i] != NULL && !buckets[i]->empty()) {
+            nonempty++;
+            only = buckets[i];
+        }
+    }
+    if (nonempty == 0) return;
+
+    if (nonempty == 1) {
+        for (size_t i = 0; i < only->size(); i++) {
+            event_t *handler = only->at(i);
+            if (event_match(*handler, event)) out->push_back(handler);
+        }
+        return;
+    }
+
+    // Handlers from several buckets match. This only happens with wildcard handlers, which are
+    // rare, so recover the registration order with a scan of the full list.
+    for (size_t i = 0; i < s_event_handlers.size(); i++) {
+        event_t *handler = s_event_handlers.at(i);
+        if (event_match(*handler, event)) out->push_back(handler);
+    }
+}
+
 /// Test if specified event is blocked.
 static int event_is_blocked(const event_t &e) {
     const block_t *block;
@@ -256,6 +386,7 @@ void event_add_handler(const event_t &event) {
     }
 
     s_event_handlers.push_back(e);
+    event_index_add(e);
 }
 
 void event_remove(const event_t &criterion) {
@@ -290,7 +421,9 @@ void event_remove(const event_t &criterion) {
             new_list.push_back(n);
         }
     }
+    if (new_list.size() == s_event_handlers.size()) return;
     s_event_handlers.swap(new_list);
+    event_index_rebuild();
 }
 
 int event_get(const event_t &criterion, std::vector<event_t *> *out) {
@@ -346,17 +479,10 @@ static void event_fire_internal(const event_t &event) {
 
     if (s_event_handlers.empty()) return;
 
-    // Then we iterate over all events, adding events that should be fired to a second list. We need
-    // to do this in a separate step since an event handler might call event_remove or
-    // event_add_handler, which will change the contents of the \c events list.
-    for (size_t i = 0; i < s_event_handlers.size(); i++) {
-        event_t *criterion = s_event_handlers.at(i);
-
-        // Check if this event is a match.
-        if (event_match(*criterion, event)) {
-            fire.push_back(criterion);
-        }
-    }
+    // Then we collect the matching handlers into a second list. We need to do this in a separate
+    // step since an event handler might call event_remove or event_add_handler, which will change
+    // the contents of the \c events list.
+    event_get_handlers_for(event, &fire);
 
     // No matches. Time to return.
     if (fire.empty()) return;
@@ -494,6 +620,7 @@ void event_init() {}
 void event_destroy() {
     for_each(s_event_handlers.begin(), s_event_handlers.end(), event_free);
     s_event_handlers.clear();
+    event_index_rebuild();
 
     for_each(killme.begin(), killme.end(), event_free);
     killme.clear();
@@ -26,6 +26,7 @@
 #include <sys/proc.h>
 #else
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #endif
 
@@ -78,6 +79,9 @@
 /// Unclean characters. See \c expand_is_clean().
 #define UNCLEAN L"$*?\\\"'({})"
 
+/// Error issued when an expansion produces more results than the caller asked for.
+#define TOO_MANY_RESULTS_ERR_MSG _(L"Expansion produced more than %lu results")
+
 static void remove_internal_separator(wcstring *s, bool conv);
 
 /// Test if the specified argument is clean, i.e. it does not contain any tokens which need to be
@@ -238,7 +242,7 @@ class process_iterator_t {
     wcstring name_for_pid(pid_t pid);
 
    public:
-    process_iterator_t();
+    explicit process_iterator_t(bool for_completions);
     bool next_process(wcstring *str, pid_t *pid);
 };
 
@@ -297,7 +301,8 @@ bool process_iterator_t::next_process(wcstring *out_str, pid_t *out_pid) {
     return result;
 }
 
-process_iterator_t::process_iterator_t() : idx(0) {
+process_iterator_t::process_iterator_t(bool for_completions) : idx(0) {
+    UNUSED(for_completions);
     int err;
     struct kinfo_proc *result;
     bool done;
@@ -361,72 +366,132 @@ process_iterator_t::process_iterator_t() : idx(0) {
 
 #else
 
-/// /proc style process completions.
-class process_iterator_t {
-    DIR *dir;
+/// /proc style process completions. Walking /proc is slow on hosts with thousands of processes,
+/// so the user's processes are read into a snapshot which completions reuse for
+/// PROCESS_SNAPSHOT_LIFETIME seconds. Expanding %name for a command always reads a fresh one, since
+/// e.g. `kill %foo` must not act on a process list that is out of date.
+#define PROCESS_SNAPSHOT_LIFETIME 1.0
 
-   public:
-    process_iterator_t();
-    ~process_iterator_t();
+/// Largest prefix of /proc/<pid>/cmdline that we read. Only the first argument is used.
+#define PROCESS_CMDLINE_MAX 4096
 
-    bool next_process(wcstring *out_str, pid_t *out_pid);
+struct process_snapshot_entry_t {
+    pid_t pid;
+    wcstring cmd;
 };
-
-process_iterator_t::process_iterator_t(void) { dir = opendir("/proc"); }
-
-process_iterator_t::~process_iterator_t(void) {
-    if (dir) closedir(dir);
-}
-
-bool process_iterator_t::next_process(wcstring *out_str, pid_t *out_pid) {
+typedef std::vector<process_snapshot_entry_t> process_snapshot_t;
+
+/// The snapshot last read for a completion. Iterators hold a reference to the snapshot they use, so
+/// replacing it here doesn't pull it out from under them.
+static mutex_lock_t s_process_snapshot_lock;
+static shared_ptr<const process_snapshot_t> s_process_snapshot;
+static double s_process_snapshot_time = 0;
+
+/// Returns the unescaped command of the process whose /proc directory is \p pid_dir, or an empty
+/// string if it can't be read.
+static wcstring process_command_at(int proc_fd, const char *pid_dir) {
+    std::string path = pid_dir;
+    path.append("/cmdline");
     wcstring cmd;
-    pid_t pid = 0;
-    while (cmd.empty()) {
-        wcstring name;
-        if (!dir || !wreaddir(dir, name)) break;
-        if (!iswnumeric(name.c_str())) continue;
-
-        wcstring path = wcstring(L"/proc/") + name;
-        struct stat buf;
-        if (wstat(path, &buf)) continue;
-
-        if (buf.st_uid != getuid()) continue;
-
-        // Remember the pid.
-        pid = fish_wcstoi(name.c_str());
-        if (errno || pid < 0) {
-            debug(1, _(L"Unexpected failure to convert pid '%ls' to integer\n"), name.c_str());
-        }
-
-        // The 'cmdline' file exists, it should contain the commandline.
-        FILE *cmdfile;
-        if ((cmdfile = wfopen(path + L"/cmdline", "r"))) {
-            wcstring full_command_line;
-            fgetws2(&full_command_line, cmdfile);
+    int fd = openat(proc_fd, path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        char buff[PROCESS_CMDLINE_MAX];
+        ssize_t amt = read_loop(fd, buff, sizeof buff);
+        close(fd);
+        if (amt > 0) {
+            // The arguments are separated by nul characters; the command is the first one, up
+            // to the first newline.
+            size_t len = strnlen(buff, amt);
+            const char *newline = (const char *)memchr(buff, '\n', len);
+            if (newline) len = newline - buff;
+            std::string first_arg(buff, len);
+            first_arg.erase(std::remove(first_arg.begin(), first_arg.end(), '\r'),
+                            first_arg.end());
 
             // The command line needs to be escaped.
-            cmd = tok_first(full_command_line);
+            cmd = tok_first(str2wcstring(first_arg));
         }
+    }
 #ifdef SunOS
-        else if ((cmdfile = wfopen(path + L"/psinfo", "r"))) {
+    if (cmd.empty()) {
+        path = pid_dir;
+        path.append("/psinfo");
+        fd = openat(proc_fd, path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
             psinfo_t info;
-            if (fread(&info, sizeof(info), 1, cmdfile)) {
+            if (read_loop(fd, &info, sizeof info) == (ssize_t)sizeof info) {
                 // The filename is unescaped.
                 cmd = str2wcstring(info.pr_fname);
             }
+            close(fd);
         }
+    }
 #endif
-        if (cmdfile) fclose(cmdfile);
+    return cmd;
+}
+
+/// Reads the processes owned by the current user from /proc.
+static void read_process_snapshot(process_snapshot_t *snapshot) {
+    DIR *dir = opendir("/proc");
+    if (!dir) return;
+    const int proc_fd = dirfd(dir);
+    const uid_t uid = getuid();
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        const char *name = ent->d_name;
+        if (name[0] < '0' || name[0] > '9') continue;
+        if (name[strspn(name, "0123456789")] != '\0') continue;
+
+        struct stat buf;
+        if (fstatat(proc_fd, name, &buf, 0) != 0 || buf.st_uid != uid) continue;
+
+        process_snapshot_entry_t entry;
+        entry.cmd = process_command_at(proc_fd, name);
+        if (entry.cmd.empty()) continue;
+        entry.pid = (pid_t)strtol(name, NULL, 10);
+        snapshot->push_back(entry);
     }
+    closedir(dir);
+}
 
-    bool result = !cmd.empty();
-    if (result) {
-        *out_str = cmd;
-        *out_pid = pid;
+/// Returns a process snapshot. Completions get the cached one unless it is too old; anything else
+/// reads /proc again.
+static shared_ptr<const process_snapshot_t> get_process_snapshot(bool for_completions) {
+    if (!for_completions) {
+        process_snapshot_t *snapshot = new process_snapshot_t();
+        read_process_snapshot(snapshot);
+        return shared_ptr<const process_snapshot_t>(snapshot);
     }
-    return result;
+
+    scoped_lock locker(s_process_snapshot_lock);
+    const double now = timef();
+    if (!s_process_snapshot || now - s_process_snapshot_time > PROCESS_SNAPSHOT_LIFETIME) {
+        process_snapshot_t *snapshot = new process_snapshot_t();
+        read_process_snapshot(snapshot);
+        s_process_snapshot.reset(snapshot);
+        s_process_snapshot_time = timef();
+    }
+    return s_process_snapshot;
 }
 
+class process_iterator_t {
+    const shared_ptr<const process_snapshot_t> snapshot;
+    size_t idx;
+
+   public:
+    explicit process_iterator_t(bool for_completions)
+        : snapshot(get_process_snapshot(for_completions)), idx(0) {}
+
+    bool next_process(wcstring *out_str, pid_t *out_pid) {
+        if (idx >= snapshot->size()) return false;
+        const process_snapshot_entry_t &entry = snapshot->at(idx++);
+        *out_str = entry.cmd;
+        *out_pid = entry.pid;
+        return true;
+    }
+};
+
 #endif
 
 // Helper function to do a job search.
@@ -562,7 +627,7 @@ static void find_process(const wchar_t *proc, expand_flags_t flags,
     // Iterate over all processes.
     wcstring process_name;
     pid_t process_pid;
-    process_iterator_t iterator;
+    process_iterator_t iterator((flags & EXPAND_FOR_COMPLETIONS) != 0);
     while (iterator.next_process(&process_name, &process_pid)) {
         size_t offset;
         if (match_pid(process_name, proc, &offset)) {
@@ -701,6 +766,15 @@ static size_t parse_slice(const wchar_t *in, wchar_t **end_ptr, std::vector<long
     return 0;
 }
 
+/// Returns whether the slice starting at \c slice_start in \c instr has a negative index. Any
+/// variables or command substitutions in the slice have already been expanded by now.
+static bool slice_has_negative_index(const wcstring &instr, size_t slice_start) {
+    for (size_t pos = slice_start + 1; pos < instr.size() && instr.at(pos) != L']'; pos++) {
+        if (instr.at(pos) == L'-') return true;
+    }
+    return false;
+}
+
 /// Expand all environment variables in the string *ptr.
 ///
 /// This function is slow, fragile and complicated. There are lots of little corner cases, like
@@ -716,10 +790,17 @@ static size_t parse_slice(const wchar_t *in, wchar_t **end_ptr, std::vector<long
 /// Note: last_idx is considered to be where it previously finished procesisng. This means it
 /// actually starts operating on last_idx-1. As such, to process a string fully, pass string.size()
 /// as last_idx instead of string.size()-1.
+///
+/// If max_results is nonzero, gives up (returning false) once out holds more than that many
+/// strings.
 static int expand_variables(const wcstring &instr, std::vector<completion_t> *out, long last_idx,
-                            parse_error_list_t *errors) {
+                            parse_error_list_t *errors, size_t max_results) {
     const size_t insize = instr.size();
 
+    if (max_results > 0 && out->size() > max_results) {
+        return false;
+    }
+
     // last_idx may be 1 past the end of the string, but no further.
     assert(last_idx >= 0 && (size_t)last_idx <= insize);
 
@@ -777,8 +858,12 @@ static int expand_variables(const wcstring &instr, std::vector<completion_t> *ou
 
         var_tmp.append(instr, start_pos, var_len);
         env_var_t var_val;
+        bool is_lazy_list = false;
         if (var_len == 1 && var_tmp[0] == VARIABLE_EXPAND_EMPTY) {
             var_val = env_var_t::missing_var();
+        } else if (env_is_lazy_list(var_tmp)) {
+            // We fetch the elements below, once we know which ones we need.
+            is_lazy_list = true;
         } else {
             var_val = expand_var(var_tmp.c_str());
         }
@@ -788,10 +873,17 @@ static int expand_variables(const wcstring &instr, std::vector<completion_t> *ou
             wcstring_list_t var_item_list;
 
             if (is_ok) {
-                tokenize_variable_array(var_val, var_item_list);
-
                 const size_t slice_start = stop_pos;
-                if (slice_start < insize && instr.at(slice_start) == L'[') {
+                const bool has_slice = slice_start < insize && instr.at(slice_start) == L'[';
+                if (!is_lazy_list) {
+                    tokenize_variable_array(var_val, var_item_list);
+                } else if (!has_slice || slice_has_negative_index(instr, slice_start)) {
+                    // Negative indexes count from the end, so we need every element.
+                    env_get_lazy_list(var_tmp, (size_t)-1, &var_item_list);
+                    is_lazy_list = false;
+                }
+
+                if (has_slice) {
                     wchar_t *slice_end;
                     size_t bad_pos;
                     all_vars = 0;
@@ -806,6 +898,15 @@ static int expand_variables(const wcstring &instr, std::vector<completion_t> *ou
                     stop_pos = (slice_end - in);
                 }
 
+                if (is_lazy_list) {
+                    // All the indexes are positive, so we only need elements up to the largest.
+                    long max_idx = 0;
+                    for (size_t j = 0; j < var_idx_list.size(); j++) {
+                        if (var_idx_list.at(j) > max_idx) max_idx = var_idx_list.at(j);
+                    }
+                    env_get_lazy_list(var_tmp, (size_t)max_idx, &var_item_list);
+                }
+
                 if (!all_vars) {
                     wcstring_list_t string_values(var_idx_list.size());
                     for (size_t j = 0; j < var_idx_list.size(); j++) {
@@ -859,7 +960,7 @@ static int expand_variables(const wcstring &instr, std::vector<completion_t> *ou
                 }
                 assert(stop_pos <= insize);
                 res.append(instr, stop_pos, insize - stop_pos);
-                is_ok &= expand_variables(res, out, i, errors);
+                is_ok &= expand_variables(res, out, i, errors, max_results);
             } else {
                 for (size_t j = 0; j < var_item_list.size(); j++) {
                     const wcstring &next = var_item_list.at(j);
@@ -880,7 +981,7 @@ static int expand_variables(const wcstring &instr, std::vector<completion_t> *ou
                             assert(stop_pos <= insize);
                             new_in.append(next);
                             new_in.append(instr, stop_pos, insize - stop_pos);
-                            is_ok &= expand_variables(new_in, out, i, errors);
+                            is_ok &= expand_variables(new_in, out, i, errors, max_results);
                         }
                     }
                 }
@@ -931,7 +1032,7 @@ static int expand_variables(const wcstring &instr, std::vector<completion_t> *ou
             assert(stop_pos <= insize);
             res.append(instr, stop_pos, insize - stop_pos);
 
-            is_ok &= expand_variables(res, out, i, errors);
+            is_ok &= expand_variables(res, out, i, errors, max_results);
             return is_ok;
         }
     }
@@ -943,9 +1044,15 @@ static int expand_variables(const wcstring &instr, std::vector<completion_t> *ou
     return is_ok;
 }
 
-/// Perform bracket expansion.
+/// Perform bracket expansion. If max_results is nonzero, gives up (returning EXPAND_ERROR) once out
+/// holds more than that many strings.
 static expand_error_t expand_brackets(const wcstring &instr, expand_flags_t flags,
-                                      std::vector<completion_t> *out, parse_error_list_t *errors) {
+                                      std::vector<completion_t> *out, parse_error_list_t *errors,
+                                      size_t max_results) {
+    if (max_results > 0 && out->size() > max_results) {
+        return EXPAND_ERROR;
+    }
+
     bool syntax_error = false;
     int bracket_count = 0;
 
@@ -1001,7 +1108,7 @@ static expand_error_t expand_brackets(const wcstring &instr, expand_flags_t flag
             }
 
             // Note: this code looks very fishy, apparently it has never worked.
-            return expand_brackets(mod, 1, out, errors);
+            return expand_brackets(mod, 1, out, errors, max_results);
         }
     }
 
@@ -1029,7 +1136,10 @@ static expand_error_t expand_brackets(const wcstring &instr, expand_flags_t flag
             whole_item.append(in, length_preceding_brackets);
             whole_item.append(item_begin, item_len);
             whole_item.append(bracket_end + 1);
-            expand_brackets(whole_item, flags, out, errors);
+            if (expand_brackets(whole_item, flags, out, errors, max_results) == EXPAND_ERROR &&
+                max_results > 0 && out->size() > max_results) {
+                return EXPAND_ERROR;
+            }
 
             item_begin = pos + 1;
             if (pos == bracket_end) break;
@@ -1306,14 +1416,18 @@ static void remove_internal_separator(wcstring *str, bool conv) {
 
 /// A stage in string expansion is represented as a function that takes an input and returns a list
 /// of output (by reference). We get flags and errors. It may return an error; if so expansion
-/// halts.
+/// halts. Stages that multiply their input stop early once out holds more than max_results strings
+/// (unless it is zero); the caller tells that apart from a real error by the size of out.
 typedef expand_error_t (*expand_stage_t)(const wcstring &input,           //!OCLINT(unused param)
                                          std::vector<completion_t> *out,  //!OCLINT(unused param)
                                          expand_flags_t flags,            //!OCLINT(unused param)
-                                         parse_error_list_t *errors);     //!OCLINT(unused param)
+                                         parse_error_list_t *errors,      //!OCLINT(unused param)
+                                         size_t max_results);             //!OCLINT(unused param)
 
 static expand_error_t expand_stage_cmdsubst(const wcstring &input, std::vector<completion_t> *out,
-                                            expand_flags_t flags, parse_error_list_t *errors) {
+                                            expand_flags_t flags, parse_error_list_t *errors,
+                                            size_t max_results) {
+    UNUSED(max_results);
     expand_error_t result = EXPAND_OK;
     if (EXPAND_SKIP_CMDSUBST & flags) {
         wchar_t *begin, *end;
@@ -1334,7 +1448,8 @@ static expand_error_t expand_stage_cmdsubst(const wcstring &input, std::vector<c
 }
 
 static expand_error_t expand_stage_variables(const wcstring &input, std::vector<completion_t> *out,
-                                             expand_flags_t flags, parse_error_list_t *errors) {
+                                             expand_flags_t flags, parse_error_list_t *errors,
+                                             size_t max_results) {
     // We accept incomplete strings here, since complete uses expand_string to expand incomplete
     // strings from the commandline.
     wcstring next;
@@ -1348,7 +1463,7 @@ static expand_error_t expand_stage_variables(const wcstring &input, std::vector<
         }
         append_completion(out, next);
     } else {
-        if (!expand_variables(next, out, next.size(), errors)) {
+        if (!expand_variables(next, out, next.size(), errors, max_results)) {
             return EXPAND_ERROR;
         }
     }
@@ -1356,13 +1471,16 @@ static expand_error_t expand_stage_variables(const wcstring &input, std::vector<
 }
 
 static expand_error_t expand_stage_brackets(const wcstring &input, std::vector<completion_t> *out,
-                                            expand_flags_t flags, parse_error_list_t *errors) {
-    return expand_brackets(input, flags, out, errors);
+                                            expand_flags_t flags, parse_error_list_t *errors,
+                                            size_t max_results) {
+    return expand_brackets(input, flags, out, errors, max_results);
 }
 
 static expand_error_t expand_stage_home_and_pid(const wcstring &input,
                                                 std::vector<completion_t> *out,
-                                                expand_flags_t flags, parse_error_list_t *errors) {
+                                                expand_flags_t flags, parse_error_list_t *errors,
+                                                size_t max_results) {
+    UNUSED(max_results);
     wcstring next = input;
 
     if (!(EXPAND_SKIP_HOME_DIRECTORIES & flags)) {
@@ -1382,8 +1500,10 @@ static expand_error_t expand_stage_home_and_pid(const wcstring &input,
 }
 
 static expand_error_t expand_stage_wildcards(const wcstring &input, std::vector<completion_t> *out,
-                                             expand_flags_t flags, parse_error_list_t *errors) {
+                                             expand_flags_t flags, parse_error_list_t *errors,
+                                             size_t max_results) {
     UNUSED(errors);
+    UNUSED(max_results);
     expand_error_t result = EXPAND_OK;
     wcstring path_to_expand = input;
 
@@ -1471,50 +1591,121 @@ static expand_error_t expand_stage_wildcards(const wcstring &input, std::vector<
     return result;
 }
 
-expand_error_t expand_string(const wcstring &input, std::vector<completion_t> *out_completions,
-                             expand_flags_t flags, parse_error_list_t *errors) {
-    // Early out. If we're not completing, and there's no magic in the input, we're done.
-    if (!(flags & EXPAND_FOR_COMPLETIONS) && expand_is_clean(input)) {
-        append_completion(out_completions, input);
-        return EXPAND_OK;
-    }
-
-    // Our expansion stages.
-    const expand_stage_t stages[] = {expand_stage_cmdsubst, expand_stage_variables,
-                                     expand_stage_brackets, expand_stage_home_and_pid,
-                                     expand_stage_wildcards};
+// Our expansion stages.
+static const expand_stage_t expand_stages[] = {expand_stage_cmdsubst, expand_stage_variables,
+                                               expand_stage_brackets, expand_stage_home_and_pid,
+                                               expand_stage_wildcards};
+static const size_t expand_stage_count = sizeof expand_stages / sizeof *expand_stages;
+
+/// Runs strings through the expansion stages depth first: each output of a stage goes through the
+/// rest of the stages before we look at the next one. That way we only hold one stage's output per
+/// level rather than every intermediate product, and can stop as soon as we have enough results.
+class expander_t {
+    const expand_flags_t flags;
+    parse_error_list_t *const errors;
+    /// Where results go, and how many we want at most. Zero means no limit.
+    std::vector<completion_t> *const results;
+    const size_t max_results;
+    /// How many strings a stage other than the last may make from one input. Zero means no limit.
+    const size_t max_intermediate;
 
-    // Load up our single initial completion.
-    std::vector<completion_t> completions, output_storage;
-    append_completion(&completions, input);
+   public:
+    /// The overall result. Only the wildcard stage can produce a match or no match; once anything
+    /// matched, that's the result.
+    expand_error_t total_result;
+    /// Whether we stopped because we hit max_results or max_intermediate.
+    bool hit_limit;
+
+    expander_t(expand_flags_t f, parse_error_list_t *e, std::vector<completion_t> *r, size_t max,
+               size_t max_inter)
+        : flags(f),
+          errors(e),
+          results(r),
+          max_results(max),
+          max_intermediate(max_inter),
+          total_result(EXPAND_OK),
+          hit_limit(false) {}
+
+    /// Expands the input from the given stage on. Returns false if expansion should stop, because
+    /// of an error or because we have too many results.
+    bool expand(const wcstring &input, size_t stage_idx) {
+        const bool last_stage = stage_idx + 1 == expand_stage_count;
+        std::vector<completion_t> stage_output;
+        std::vector<completion_t> *out = last_stage ? results : &stage_output;
+        // Intermediate products may have their own limit: that's what keeps e.g. brace expansion
+        // from building an enormous list only for us to throw it away.
+        const size_t limit = last_stage ? max_results : max_intermediate;
+        expand_error_t this_result = expand_stages[stage_idx](input, out, flags, errors, limit);
+        if (limit > 0 && out->size() > limit) {
+            hit_limit = true;
+            return false;
+        }
+        if (this_result == EXPAND_ERROR) {
+            total_result = EXPAND_ERROR;
+            return false;
+        }
 
-    expand_error_t total_result = EXPAND_OK;
-    for (size_t stage_idx = 0;
-         total_result != EXPAND_ERROR && stage_idx < sizeof stages / sizeof *stages; stage_idx++) {
-        for (size_t i = 0; total_result != EXPAND_ERROR && i < completions.size(); i++) {
-            const wcstring &next = completions.at(i).completion;
-            expand_error_t this_result = stages[stage_idx](next, &output_storage, flags, errors);
+        if (last_stage) {
             // If this_result was no match, but total_result is that we have a match, then don't
             // change it.
             if (!(this_result == EXPAND_WILDCARD_NO_MATCH &&
                   total_result == EXPAND_WILDCARD_MATCH)) {
                 total_result = this_result;
             }
+            return true;
         }
 
-        // Output becomes our next stage's input.
-        completions.swap(output_storage);
-        output_storage.clear();
+        for (size_t i = 0; i < stage_output.size(); i++) {
+            if (!expand(stage_output.at(i).completion, stage_idx + 1)) return false;
+        }
+        return true;
     }
+};
+
+/// Expands the input, stopping once there are more than max_results results, or a stage other than
+/// the last makes more than max_intermediate strings from one input (unless they are zero). Reports
+/// whether that happened in *out_hit_limit.
+static expand_error_t expand_string_with_limit(const wcstring &input,
+                                               std::vector<completion_t> *out_completions,
+                                               expand_flags_t flags, parse_error_list_t *errors,
+                                               size_t max_results, size_t max_intermediate,
+                                               bool *out_hit_limit) {
+    *out_hit_limit = false;
 
-    if (total_result != EXPAND_ERROR) {
+    // Early out. If we're not completing, and there's no magic in the input, we're done.
+    if (!(flags & EXPAND_FOR_COMPLETIONS) && expand_is_clean(input)) {
+        append_completion(out_completions, input);
+        return EXPAND_OK;
+    }
+
+    std::vector<completion_t> completions;
+    expander_t expander(flags, errors, &completions, max_results, max_intermediate);
+    expander.expand(input, 0);
+    if (expander.hit_limit) {
+        *out_hit_limit = true;
+        return EXPAND_ERROR;
+    }
+
+    if (expander.total_result != EXPAND_ERROR) {
         // Hack to un-expand tildes (see #647).
         if (!(flags & EXPAND_SKIP_HOME_DIRECTORIES)) {
             unexpand_tildes(input, &completions);
         }
         out_completions->insert(out_completions->end(), completions.begin(), completions.end());
     }
-    return total_result;
+    return expander.total_result;
+}
+
+expand_error_t expand_string(const wcstring &input, std::vector<completion_t> *out_completions,
+                             expand_flags_t flags, parse_error_list_t *errors, size_t max_results) {
+    bool hit_limit;
+    expand_error_t result = expand_string_with_limit(input, out_completions, flags, errors,
+                                                     max_results, max_results, &hit_limit);
+    if (hit_limit) {
+        append_syntax_error(errors, SOURCE_LOCATION_UNKNOWN, TOO_MANY_RESULTS_ERR_MSG,
+                            (unsigned long)max_results);
+    }
+    return result;
 }
 
 bool expand_one(wcstring &string, expand_flags_t flags, parse_error_list_t *errors) {
@@ -1524,7 +1715,11 @@ bool expand_one(wcstring &string, expand_flags_t flags, parse_error_list_t *erro
         return true;
     }
 
-    if (expand_string(string, &completions, flags | EXPAND_NO_DESCRIPTIONS, errors) &&
+    // We only want one result, so stop as soon as there is a second. Intermediate products are not
+    // limited, since e.g. {a,b}* may still match a single file.
+    bool hit_limit;
+    if (expand_string_with_limit(string, &completions, flags | EXPAND_NO_DESCRIPTIONS, errors, 1, 0,
+                                 &hit_limit) &&
         completions.size() == 1) {
         string = completions.at(0).completion;
         return true;
@@ -111,12 +111,17 @@ enum expand_error_t {
 /// \param flags Specifies if any expansion pass should be skipped. Legal values are any combination
 /// of EXPAND_SKIP_CMDSUBST EXPAND_SKIP_VARIABLES and EXPAND_SKIP_WILDCARDS
 /// \param errors Resulting errors, or NULL to ignore
+/// \param max_results The most results to produce, or zero for no limit. If the input expands to
+/// more, expansion stops early, nothing is output, and EXPAND_ERROR is returned. Intermediate
+/// products count too, so this also trips if e.g. bracket expansion makes more strings than that
+/// even though wildcard expansion would have dropped some of them.
 ///
 /// \return One of EXPAND_OK, EXPAND_ERROR, EXPAND_WILDCARD_MATCH and EXPAND_WILDCARD_NO_MATCH.
 /// EXPAND_WILDCARD_NO_MATCH and EXPAND_WILDCARD_MATCH are normal exit conditions used only on
 /// strings containing wildcards to tell if the wildcard produced any matches.
 __warn_unused expand_error_t expand_string(const wcstring &input, std::vector<completion_t> *output,
-                                           expand_flags_t flags, parse_error_list_t *errors);
+                                           expand_flags_t flags, parse_error_list_t *errors,
+                                           size_t max_results = 0);
 
 /// expand_one is identical to expand_string, except it will fail if in expands to more than one
 /// string. This is used for expanding command names.
@@ -12,6 +12,7 @@
 #include <errno.h>   // IWYU pragma: keep
 #include <fcntl.h>   // IWYU pragma: keep
 #include <limits.h>  // IWYU pragma: keep
+#include <pthread.h>
 #include <stdarg.h>  // IWYU pragma: keep
 #include <stdio.h>   // IWYU pragma: keep
 #include <stdlib.h>
@@ -285,7 +286,51 @@ int fish_wcswidth(const wchar_t *str, size_t n) { return wcswidth(str, n); }
 #else
 static int mk_wcwidth(wchar_t wc);
 static int mk_wcswidth(const wchar_t *pwcs, size_t n);
-int fish_wcwidth(wchar_t wc) { return mk_wcwidth(wc); }
+
+// mk_wcwidth binary searches a table of intervals, and screen layout asks for the width of every
+// character of the prompt, command line and pager on each repaint. So widths in the Basic
+// Multilingual Plane come from a two-level table built on first use: a page of widths for each
+// high byte, where pages whose characters all have the same width share one page.
+#define WCWIDTH_TABLE_LIMIT 0x10000
+#define WCWIDTH_PAGE_SIZE 256
+#define WCWIDTH_PAGE_COUNT (WCWIDTH_TABLE_LIMIT / WCWIDTH_PAGE_SIZE)
+static const signed char *s_wcwidth_pages[WCWIDTH_PAGE_COUNT];
+static pthread_once_t s_wcwidth_pages_once = PTHREAD_ONCE_INIT;
+
+static void build_wcwidth_pages() {
+    // The shared pages for widths -1 through 2, and room for every page to be different.
+    static signed char uniform_pages[4][WCWIDTH_PAGE_SIZE];
+    static signed char mixed_pages[WCWIDTH_PAGE_COUNT][WCWIDTH_PAGE_SIZE];
+    size_t mixed_page_count = 0;
+
+    for (int width = -1; width <= 2; width++) {
+        memset(uniform_pages[width + 1], width, WCWIDTH_PAGE_SIZE);
+    }
+
+    for (size_t page = 0; page < WCWIDTH_PAGE_COUNT; page++) {
+        signed char *widths = mixed_pages[mixed_page_count];
+        bool uniform = true;
+        for (size_t i = 0; i < WCWIDTH_PAGE_SIZE; i++) {
+            widths[i] = (signed char)mk_wcwidth((wchar_t)(page * WCWIDTH_PAGE_SIZE + i));
+            if (widths[i] != widths[0]) uniform = false;
+        }
+        if (uniform) {
+            s_wcwidth_pages[page] = uniform_pages[widths[0] + 1];
+        } else {
+            s_wcwidth_pages[page] = widths;
+            mixed_page_count++;
+        }
+    }
+}
+
+int fish_wcwidth(wchar_t wc) {
+    // Printable ASCII is by far the most common, and doesn't need the table.
+    if (wc >= 32 && wc < 0x7f) return 1;
+    if ((unsigned long)wc >= WCWIDTH_TABLE_LIMIT) return mk_wcwidth(wc);
+    VOMIT_ON_FAILURE_NO_ERRNO(pthread_once(&s_wcwidth_pages_once, build_wcwidth_pages));
+    return s_wcwidth_pages[wc / WCWIDTH_PAGE_SIZE][wc % WCWIDTH_PAGE_SIZE];
+}
+
 int fish_wcswidth(const wchar_t *str, size_t n) { return mk_wcswidth(str, n); }
 
 /*
@@ -467,7 +512,7 @@ static int mk_wcswidth(const wchar_t *pwcs, size_t n) {
     for (size_t i = 0; i < n; i++) {
         if (pwcs[i] == L'\0') break;
 
-        int w = mk_wcwidth(pwcs[i]);
+        int w = fish_wcwidth(pwcs[i]);
         if (w < 0) {
             width = -1;
             break;
@@ -46,11 +46,13 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 #include "function.h"
 #include "history.h"
 #include "input.h"
+#include "intern.h"
 #include "io.h"
 #include "parser.h"
 #include "path.h"
 #include "proc.h"
 #include "reader.h"
+#include "util.h"
 #include "wutil.h"  // IWYU pragma: keep
 
 // PATH_MAX may not exist.
@@ -61,6 +63,19 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 /// If we are doing profiling, the filename to output to.
 static const char *s_profiling_output_filename = NULL;
 
+/// Time of the last startup phase to finish, and the time each phase took, for the report printed
+/// at debug level 2.
+static long long s_startup_phase_end = 0;
+static wcstring s_startup_report;
+
+/// Note that the named startup phase has finished.
+static void startup_phase_done(const wchar_t *name) {
+    if (debug_level < 2) return;
+    long long now = get_time();
+    append_format(s_startup_report, L" %ls %lld", name, now - s_startup_phase_end);
+    s_startup_phase_end = now;
+}
+
 static bool has_suffix(const std::string &path, const char *suffix, bool ignore_case) {
     size_t pathlen = path.size(), suffixlen = strlen(suffix);
     return pathlen >= suffixlen &&
@@ -293,7 +308,7 @@ static int read_init(const struct config_paths_t &paths) {
 
 /// Parse the argument list, return the index of the first non-flag arguments.
 static int fish_parse_opt(int argc, char **argv, std::vector<std::string> *cmds) {
-    const char *short_opts = "+hilnvc:p:d:D:";
+    const char *short_opts = "+hilnvWc:p:d:D:";
     const struct option long_opts[] = {{"command", required_argument, NULL, 'c'},
                                        {"debug-level", required_argument, NULL, 'd'},
                                        {"debug-stack-frames", required_argument, NULL, 'D'},
@@ -303,6 +318,7 @@ static int fish_parse_opt(int argc, char **argv, std::vector<std::string> *cmds)
                                        {"profile", required_argument, NULL, 'p'},
                                        {"help", no_argument, NULL, 'h'},
                                        {"version", no_argument, NULL, 'v'},
+                                       {"whole-script", no_argument, NULL, 'W'},
                                        {NULL, 0, NULL, 0}};
 
     int opt;
@@ -358,6 +374,10 @@ static int fish_parse_opt(int argc, char **argv, std::vector<std::string> *cmds)
                 exit(0);
                 break;
             }
+            case 'W': {
+                reader_set_read_whole_scripts(true);
+                break;
+            }
             case 'D': {
                 char *end;
                 long tmp;
@@ -424,6 +444,7 @@ int main(int argc, char **argv) {
     int res = 1;
     int my_optind = 0;
 
+    s_startup_phase_end = get_time();
     program_name = L"fish";
     set_main_thread();
     setup_fork_guards();
@@ -456,21 +477,29 @@ int main(int argc, char **argv) {
 
     const struct config_paths_t paths = determine_config_directory_paths(argv[0]);
 
+    startup_phase_done(L"options");
     proc_init();
     event_init();
+    startup_phase_done(L"proc");
     builtin_init();
     function_init();
+    startup_phase_done(L"builtin");
     env_init(&paths);
+    startup_phase_done(L"env");
     reader_init();
     history_init();
+    startup_phase_done(L"reader");
     // For set_color to support term256 in config.fish (issue #1022).
     update_fish_color_support();
     misc_init();
+    startup_phase_done(L"misc");
 
     parser_t &parser = parser_t::principal_parser();
 
     const io_chain_t empty_ios;
     if (read_init(paths)) {
+        startup_phase_done(L"config");
+        debug(2, L"Startup times in microseconds:%ls", s_startup_report.c_str());
         // Stomp the exit status of any initialization commands (issue #635).
         proc_set_last_status(STATUS_BUILTIN_OK);
 
@@ -537,6 +566,16 @@ int main(int argc, char **argv) {
         parser.emit_profiling(s_profiling_output_filename);
     }
 
+    const intern_stats_t intern_stats = intern_get_stats();
+    debug(2, L"Interned %lu strings: %lu bytes in arena (%lu allocated), %lu bytes in table",
+          (unsigned long)intern_stats.string_count, (unsigned long)intern_stats.arena_bytes_used,
+          (unsigned long)intern_stats.arena_bytes_allocated,
+          (unsigned long)intern_stats.table_bytes);
+
+    const file_detection_stats_t file_detection_stats = file_detection_get_stats();
+    debug(2, L"History file detection checked %lu paths, reused %lu verdicts",
+          file_detection_stats.stats_issued, file_detection_stats.stats_avoided);
+
     history_destroy();
     proc_destroy();
     builtin_destroy();
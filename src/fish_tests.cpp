@@ -4,9 +4,12 @@
 // IWYU pragma: no_include <cstring>
 // IWYU pragma: no_include <cstddef>
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include <limits.h>
+#include <locale.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -15,6 +18,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/select.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -47,6 +51,7 @@
 #include "history.h"
 #include "input.h"
 #include "input_common.h"
+#include "intern.h"
 #include "io.h"
 #include "iothread.h"
 #include "lru.h"
@@ -89,6 +94,25 @@ static bool should_test_function(const char *func_name) {
     return result;
 }
 
+/// Number of allocations made through operator new, so benchmarks can report them.
+static unsigned long s_allocation_count = 0;
+
+void *operator new(size_t size) {
+    __sync_fetch_and_add(&s_allocation_count, 1);
+    void *result = malloc(size ? size : 1);
+    if (result == NULL) DIE_MEM();
+    return result;
+}
+
+void operator delete(void *ptr) throw() { free(ptr); }
+
+/// Benchmarks are only run when asked for by name (or name prefix, such as "benchmark_"), never as
+/// part of the normal test run.
+static bool should_run_benchmark(const char *func_name) {
+    if (!s_arguments || !s_arguments[0]) return false;
+    return should_test_function(func_name);
+}
+
 /// The number of tests to run.
 #define ESCAPE_TEST_COUNT 100000
 /// The average length of strings to unescape.
@@ -491,6 +515,26 @@ static void test_tokenizer() {
         do_test(token.error_offset == 4);
     }
 
+    // Test that TOK_NO_TEXT leaves out the text of strings and comments, but not their ranges.
+    {
+        const wcstring src = L"echo 'quoted'# comment\nfoo 2>&1";
+        tokenizer_t with_text(src.c_str(), TOK_SHOW_COMMENTS);
+        tokenizer_t without_text(src.c_str(), TOK_SHOW_COMMENTS | TOK_NO_TEXT);
+        tok_t other;
+        while (with_text.next(&token)) {
+            do_test(without_text.next(&other));
+            do_test(token.type == other.type);
+            do_test(token.offset == other.offset && token.length == other.length);
+            if (token.type == TOK_STRING || token.type == TOK_COMMENT) {
+                do_test(other.text.empty());
+                do_test(token.text == wcstring(src, token.offset, token.length));
+            } else {
+                do_test(token.text == other.text);
+            }
+        }
+        do_test(!without_text.next(&other));
+    }
+
     // Test redirection_type_for_string.
     if (redirection_type_for_string(L"<") != TOK_REDIRECT_IN)
         err(L"redirection_type_for_string failed on line %ld", (long)__LINE__);
@@ -697,6 +741,17 @@ static void test_parser() {
         err(L"backgrounded 'while' conditional not reported as error");
     }
 
+    // Errors in arguments are remembered, so make sure they are reported at each place the argument
+    // appears, and again the next time around.
+    for (size_t i = 0; i < 2; i++) {
+        parse_error_list_t errors;
+        parse_util_detect_errors(L"echo (echo \\xFF9)\nls; echo (echo \\xFF9)", &errors);
+        if (errors.size() != 2 || errors.at(0).source_start != 11 ||
+            errors.at(1).source_start != 33) {
+            err(L"Errors in repeated arguments reported at wrong locations");
+        }
+    }
+
     say(L"Testing basic evaluation");
 
     // Ensure that we don't crash on infinite self recursion and mutual recursion. These must use
@@ -1140,6 +1195,26 @@ static void test_escape_sequences(void) {
         err(L"test_escape_sequences failed on line %d\n", __LINE__);
 }
 
+static void test_wcwidth() {
+    say(L"Testing wcwidth");
+    do_test(fish_wcwidth(L'\0') == 0);
+    do_test(fish_wcwidth(L'\x1b') == -1);
+    do_test(fish_wcwidth(L'\x9b') == -1);
+    do_test(fish_wcwidth(L'a') == 1);
+    do_test(fish_wcwidth(L'\x00e9') == 1);  // e with acute accent
+    do_test(fish_wcwidth(L'\x0301') == 0);  // combining acute accent
+    do_test(fish_wcwidth(L'\x200b') == 0);  // zero width space
+    do_test(fish_wcwidth(L'\x1100') == 2);  // Hangul choseong
+    do_test(fish_wcwidth(L'\x4e00') == 2);  // CJK ideograph
+    do_test(fish_wcwidth(L'\xff01') == 2);  // fullwidth exclamation mark
+    do_test(fish_wcwidth(L'\xff61') == 1);  // halfwidth ideographic full stop
+    do_test(fish_wcwidth(L'\xfeff') == 0);  // byte order mark
+    do_test(fish_wcwidth((wchar_t)0x20000) == 2);
+    do_test(fish_wcwidth((wchar_t)0xe0001) == 0);
+    do_test(fish_wcswidth(L"a\x4e00\x0301" L"b", 4) == 4);
+    do_test(fish_wcswidth(L"a\x1b", 2) == -1);
+}
+
 class lru_node_test_t : public lru_node_t {
    public:
     explicit lru_node_test_t(const wcstring &tmp) : lru_node_t(tmp) {}
@@ -1181,6 +1256,43 @@ static void test_lru(void) {
     }
 }
 
+static void test_intern(void) {
+    say(L"Testing string interning");
+
+    const intern_stats_t before = intern_get_stats();
+
+    // Equal strings intern to the same pointer, distinct strings to distinct pointers.
+    wcstring_list_t strs;
+    std::vector<const wchar_t *> interned;
+    for (size_t i = 0; i < 1000; i++) {
+        strs.push_back(format_string(L"intern_test_%lu", (unsigned long)i));
+        interned.push_back(intern(strs.back().c_str()));
+    }
+    for (size_t i = 0; i < strs.size(); i++) {
+        const wcstring copy = strs.at(i);
+        do_test(interned.at(i) != strs.at(i).c_str());
+        do_test(interned.at(i) == intern(copy.c_str()));
+        do_test(copy == interned.at(i));
+    }
+    do_test(interned.at(0) != interned.at(1));
+
+    // Large strings are interned too.
+    const wcstring big(100000, L'x');
+    const wchar_t *big_interned = intern(big.c_str());
+    do_test(big == big_interned);
+    do_test(big_interned == intern(wcstring(big).c_str()));
+
+    // Static strings are not copied.
+    static const wchar_t *const static_str = L"intern_test_static";
+    do_test(intern_static(static_str) == static_str);
+    do_test(intern(L"intern_test_static") == static_str);
+
+    const intern_stats_t after = intern_get_stats();
+    do_test(after.string_count == before.string_count + strs.size() + 2);
+    do_test(after.arena_bytes_used >= before.arena_bytes_used + big.size() * sizeof(wchar_t));
+    do_test(after.arena_bytes_allocated >= after.arena_bytes_used);
+}
+
 /// Perform parameter expansion and test if the output equals the zero-terminated parameter list
 /// supplied.
 ///
@@ -1274,6 +1386,36 @@ static void test_expand() {
     expand_test(L"foo\\$bar", EXPAND_SKIP_VARIABLES, L"foo$bar", 0,
                 L"Failed to handle dollar sign in variable-skipping expansion");
 
+    // Expansion stops once it has more results than asked for.
+    {
+        std::vector<completion_t> output;
+        parse_error_list_t errors;
+        do_test(expand_string(L"{a,b,c}{d,e}", &output, 0, &errors, 6) == EXPAND_OK);
+        do_test(output.size() == 6 && output.at(1).completion == L"bd" && errors.empty());
+        output.clear();
+        do_test(expand_string(L"{a,b,c}{d,e}", &output, 0, &errors, 5) == EXPAND_ERROR);
+        do_test(output.empty() && errors.size() == 1);
+
+        wcstring str = L"{a,b}";
+        do_test(!expand_one(str, 0) && str == L"{a,b}");
+        str = L"{a}b";
+        do_test(expand_one(str, 0) && str == L"ab");
+    }
+
+    // Process expansion finds this process by name, and does so again from the cached process
+    // list.
+    for (int i = 0; i < 2; i++) {
+        std::vector<completion_t> output;
+        const wcstring proc = L"%fish_tests";
+        do_test(expand_string(proc, &output, EXPAND_SKIP_JOBS, NULL) == EXPAND_OK);
+        const wcstring self = to_string<long>(getpid());
+        bool found_self = false;
+        for (size_t j = 0; j < output.size(); j++) {
+            if (output.at(j).completion == self) found_self = true;
+        }
+        do_test(found_self);
+    }
+
     // bb
     //    x
     // bar
@@ -1377,6 +1519,11 @@ static void test_expand() {
     expand_test(L"/tmp/fish_expand_test/aaa/x", EXPAND_FOR_COMPLETIONS | EXPAND_FUZZY_MATCH, wnull,
                 L"Wrong fuzzy matching 6 - shouldn't remove valid directory names (#3211)");
 
+    // Only the final result counts for expand_one, so a bracket expansion that wildcards narrow
+    // down to a single file is fine.
+    wcstring one_file = L"/tmp/fish_expand_test/{bb,lol}/x*";
+    do_test(expand_one(one_file, 0) && one_file == L"/tmp/fish_expand_test/bb/x");
+
     if (!expand_test(L"/tmp/fish_expand_test/.*", 0, L"/tmp/fish_expand_test/.foo", 0)) {
         err(L"Expansion not correctly handling dotfiles");
     }
@@ -1709,6 +1856,112 @@ static void test_pager_layout() {
     }
 }
 
+/// Returns the completions the pager shows, by cycling the selection through them.
+static wcstring_list_t pager_visible_completions(pager_t &pager) {
+    wcstring_list_t result;
+    page_rendering_t rendering = pager.render();
+    while (pager.select_next_completion_in_direction(direction_next, rendering)) {
+        pager.update_rendering(&rendering);
+        const completion_t *selected = pager.selected_completion(rendering);
+        if (!selected || (!result.empty() && selected->completion == result.front())) break;
+        result.push_back(selected->completion);
+    }
+    pager.select_next_completion_in_direction(direction_deselect, rendering);
+    return result;
+}
+
+static void test_pager_filter() {
+    say(L"Testing pager filtering");
+    completion_list_t completions;
+    append_completion(&completions, L"abc");
+    append_completion(&completions, L"abd");
+    append_completion(&completions, L"xbc", L"Has ab in its description");
+    append_completion(&completions, L"xyz");
+
+    pager_t pager;
+    pager.set_completions(completions);
+    pager.set_term_size(80, 24);
+    do_test(pager_visible_completions(pager).size() == 4);
+
+    // Growing the filter narrows what we have.
+    pager.set_search_field_shown(true);
+    pager.search_field_line.insert_string(L"a");
+    pager.refilter_completions();
+    do_test(pager_visible_completions(pager).size() == 3);
+    pager.search_field_line.insert_string(L"bd");
+    pager.refilter_completions();
+    do_test(pager_visible_completions(pager) == wcstring_list_t(1, L"abd"));
+
+    // Shrinking it brings completions back.
+    pager.search_field_line.text = L"b";
+    pager.refilter_completions();
+    do_test(pager_visible_completions(pager).size() == 3);
+    pager.set_search_field_shown(false);
+    pager.refilter_completions();
+    do_test(pager_visible_completions(pager).size() == 4);
+
+    // Editing the middle of the filter may swap in a different set of the same size, which must be
+    // laid out afresh: two short completions share a row, two long ones don't.
+    const wcstring long_name(50, L'c');
+    completions.clear();
+    append_completion(&completions, L"ab1");
+    append_completion(&completions, L"ab2");
+    append_completion(&completions, L"ac" + long_name);
+    append_completion(&completions, L"ac" + long_name + L"2");
+    pager.set_completions(completions);
+    pager.set_search_field_shown(true);
+    pager.search_field_line.text = L"ab";
+    pager.refilter_completions();
+    page_rendering_t rendering = pager.render();
+    do_test(rendering.rows == 1 && rendering.cols == 2);
+    pager.search_field_line.text = L"ac";
+    pager.refilter_completions();
+    rendering = pager.render();
+    do_test(rendering.rows == 2 && rendering.cols == 1);
+    do_test(pager_visible_completions(pager).size() == 2);
+}
+
+/// Shows, navigates and filters a pager holding as many completions as a large directory.
+static void benchmark_pager() {
+    const size_t count = 100000;
+    say(L"Benchmarking the pager with %lu completions", (unsigned long)count);
+    completion_list_t completions;
+    for (size_t i = 0; i < count; i++) {
+        append_completion(&completions, format_string(L"file_%06lu.txt", (unsigned long)i),
+                          i % 8 ? L"" : L"Some description");
+    }
+
+    double start = timef();
+    pager_t pager;
+    pager.set_term_size(80, 24);
+    pager.set_completions(completions);
+    page_rendering_t rendering = pager.render();
+    double shown = timef();
+
+    const size_t moves = 200;
+    for (size_t i = 0; i < moves; i++) {
+        pager.select_next_completion_in_direction(i % 2 ? direction_south : direction_next,
+                                                  rendering);
+        pager.update_rendering(&rendering);
+    }
+    double navigated = timef();
+
+    // Type a filter one character at a time.
+    const wcstring needle = L"file_0123";
+    pager.set_search_field_shown(true);
+    for (size_t i = 0; i < needle.size(); i++) {
+        pager.search_field_line.insert_string(needle, i, 1);
+        pager.refilter_completions();
+        pager.update_rendering(&rendering);
+    }
+    double filtered = timef();
+
+    say(L"Show: %.1f ms, %lu moves: %.1f ms (%.3f ms per move), %lu filter keys: %.1f ms",
+        (shown - start) * 1e3, (unsigned long)moves, (navigated - shown) * 1e3,
+        (navigated - shown) * 1e3 / moves, (unsigned long)needle.size(),
+        (filtered - navigated) * 1e3);
+}
+
 enum word_motion_t { word_motion_left, word_motion_right };
 static void test_1_word_motion(word_motion_t motion, move_word_style_t style,
                                const wcstring &test) {
@@ -2389,6 +2642,171 @@ static void test_autosuggestion_combining() {
     do_test(combine_command_and_autosuggestion(L"alpha", L"ALPHA") == L"alpha");
 }
 
+struct autosuggest_history_request_t {
+    history_t *history;
+    wcstring search_string;
+    const env_vars_snapshot_t *vars;
+    wcstring suggestion;
+};
+
+static int autosuggest_history_request_perform(autosuggest_history_request_t *req) {
+    req->suggestion.clear();
+    reader_autosuggest_from_history(req->history, req->search_string, L"/", *req->vars,
+                                    &req->suggestion);
+    return 0;
+}
+
+/// Returns the history autosuggestion for the given command line, searching on a background thread
+/// as the reader does.
+static wcstring autosuggest_from_history(history_t &history, const wcstring &search_string,
+                                         const env_vars_snapshot_t &vars) {
+    autosuggest_history_request_t req = {&history, search_string, &vars, wcstring()};
+    iothread_perform(autosuggest_history_request_perform, &req);
+    iothread_drain_all();
+    return req.suggestion;
+}
+
+static void test_autosuggest_from_history() {
+    say(L"Testing autosuggestions from history");
+    history_t &history = history_t::history_with_name(L"autosuggest_test");
+    history.clear();
+    const env_vars_snapshot_t vars(env_vars_snapshot_t::highlighting_keys);
+
+    history.add(L"echo alpha");
+    history.add(L"echo beta");
+    history.add(L"echo_not_a_command gamma");
+    do_test(autosuggest_from_history(history, L"echo", vars) == L"echo beta");
+    // These extend the previous search, which resumes from its suggestion.
+    do_test(autosuggest_from_history(history, L"echo ", vars) == L"echo beta");
+    do_test(autosuggest_from_history(history, L"echo a", vars) == L"echo alpha");
+    do_test(autosuggest_from_history(history, L"echo al", vars) == L"echo alpha");
+    do_test(autosuggest_from_history(history, L"echo alz", vars).empty());
+    do_test(autosuggest_from_history(history, L"echo alzz", vars).empty());
+    // These don't, so they start over.
+    do_test(autosuggest_from_history(history, L"echo_", vars).empty());
+    do_test(autosuggest_from_history(history, L"ech", vars) == L"echo beta");
+    // New history items are seen.
+    history.add(L"echo delta");
+    do_test(autosuggest_from_history(history, L"echo", vars) == L"echo delta");
+    history.clear();
+}
+
+/// Replays typing a few command lines against a large history, timing the history search done for
+/// each keystroke. Most of the history consists of items that fail validation, like cd to removed
+/// directories and mistyped commands, which are the expensive ones to search past.
+static void benchmark_autosuggest() {
+    say(L"Benchmarking autosuggestions from history");
+    history_t &history = history_t::history_with_name(L"autosuggest_benchmark");
+    history.clear();
+    const env_vars_snapshot_t vars(env_vars_snapshot_t::highlighting_keys);
+
+    history.disable_automatic_saving();
+    const size_t item_count = 300000;
+    for (size_t i = 0; i < item_count; i++) {
+        switch (i % 3) {
+            case 0: {
+                history.add(format_string(L"cd /tmp/fish_autosuggest_benchmark/%lu", i));
+                break;
+            }
+            case 1: {
+                history.add(format_string(L"echo change %lu", i));
+                break;
+            }
+            default: {
+                history.add(format_string(L"ecoh change %lu", i));
+                break;
+            }
+        }
+    }
+
+    const wchar_t *const typed[] = {L"echo change 12", L"ecoh change 12",
+                                    L"cd /tmp/fish_autosuggest_benchmark/12", L"echo change 3"};
+    size_t keystrokes = 0;
+    double total = 0, slowest = 0;
+    for (size_t i = 0; i < sizeof typed / sizeof *typed; i++) {
+        const wcstring line = typed[i];
+        for (size_t len = 1; len <= line.size(); len++) {
+            double start = timef();
+            autosuggest_from_history(history, line.substr(0, len), vars);
+            double elapsed = timef() - start;
+            keystrokes++;
+            total += elapsed;
+            if (elapsed > slowest) slowest = elapsed;
+        }
+    }
+    say(L"%lu keystrokes against %lu history items: %.3f ms per keystroke, %.3f ms slowest",
+        (unsigned long)keystrokes, (unsigned long)item_count, total * 1000 / keystrokes,
+        slowest * 1000);
+    history.clear();
+    history.enable_automatic_saving();
+}
+
+/// Times rewriting a large history file with many duplicates, as happens when vacuuming it or
+/// deleting an item from it.
+static void benchmark_history_vacuum() {
+    say(L"Benchmarking history vacuum");
+    history_t &history = history_t::history_with_name(L"vacuum_benchmark");
+    history.clear();
+
+    // Write the file directly, which is much faster than adding the items one by one.
+    wcstring path;
+    do_test(path_get_data(path));
+    path.append(L"/vacuum_benchmark_history");
+    FILE *f = wfopen(path, "w");
+    do_test(f != NULL);
+    if (f == NULL) return;
+    const unsigned long item_count = 2000000;
+    for (unsigned long i = 0; i < item_count; i++) {
+        fprintf(f, "- cmd: echo history vacuum benchmark item %lu\n  when: %lu\n",
+                i % (item_count / 4), 1000000000UL + i);
+    }
+    fclose(f);
+
+    // Deleting an item forces a rewrite.
+    history.remove(L"echo history vacuum benchmark item 0");
+    double start = timef();
+    history.save();
+    double elapsed = timef() - start;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    say(L"Rewrote %lu items in %.0f ms, peak RSS %ld KB", item_count, elapsed * 1000,
+        (long)usage.ru_maxrss);
+    history.clear();
+}
+
+/// Test that file detection for many new history items checks each path only once.
+static void test_history_file_detection() {
+    say(L"Testing history file detection");
+    if (system("mkdir -p /tmp/fish_file_detection_test/ && "
+               "touch /tmp/fish_file_detection_test/present")) {
+        err(L"mkdir failed");
+    }
+    history_t &history = history_t::history_with_name(L"file_detection_test");
+    history.clear();
+
+    const file_detection_stats_t before = file_detection_get_stats();
+    const unsigned long item_count = 100;
+    for (unsigned long i = 0; i < item_count; i++) {
+        history.add_pending_with_file_detection(
+            format_string(L"cat%lu /tmp/fish_file_detection_test/present "
+                          L"/tmp/fish_file_detection_test/absent",
+                          i));
+    }
+    iothread_drain_all();
+    const file_detection_stats_t after = file_detection_get_stats();
+    do_test(after.stats_issued - before.stats_issued == 2);
+    do_test(after.stats_avoided - before.stats_avoided == 2 * item_count - 2);
+
+    history.resolve_pending();
+    const history_item_t item = history.item_at_index(1);
+    const path_list_t &paths = item.get_required_paths();
+    do_test(paths.size() == 1 && paths.at(0) == L"/tmp/fish_file_detection_test/present");
+
+    history.clear();
+    if (system("rm -Rf /tmp/fish_file_detection_test")) err(L"rm failed");
+}
+
 static void test_history_matches(history_search_t &search, size_t matches, unsigned from_line) {
     size_t i;
     for (i = 0; i < matches; i++) {
@@ -2439,6 +2857,260 @@ static void test_input() {
     if (c != R_DOWN_LINE) {
         err(L"Expected to read char R_DOWN_LINE, but instead got %ls\n", describe_char(c).c_str());
     }
+
+    // If only a prefix of the longer binding arrives, the shorter binding matches and the rest of
+    // the input is handled by the generic binding.
+    input_mapping_add(L"", L"self-insert");
+    for (size_t idx = 0; idx < prefix_binding.size(); idx++) {
+        input_queue_ch(prefix_binding.at(idx));
+    }
+    input_queue_ch(L'x');
+    c = input_readch();
+    if (c != R_UP_LINE) {
+        err(L"Expected to read char R_UP_LINE, but instead got %ls\n", describe_char(c).c_str());
+    }
+    c = input_readch();
+    if (c != L'x') {
+        err(L"Expected to read char 'x', but instead got %ls\n", describe_char(c).c_str());
+    }
+
+    // Bindings only apply in their own mode, and erased bindings no longer match.
+    input_mapping_add(L"qz", L"down-line", L"test_mode");
+    input_mapping_add(L"qy", L"up-line");
+    input_mapping_erase(L"qy");
+    input_queue_ch(L'q');
+    input_queue_ch(L'y');
+    c = input_readch();
+    if (c != L'q') {
+        err(L"Expected to read char 'q', but instead got %ls\n", describe_char(c).c_str());
+    }
+    c = input_readch();
+    if (c != L'y') {
+        err(L"Expected to read char 'y', but instead got %ls\n", describe_char(c).c_str());
+    }
+
+    // Pasted text is taken up to the end marker without going through the bindings, and whatever
+    // follows the marker is left for the next read.
+    const wcstring paste = L"echo " + desired_binding + L"\r\x1b[201~x";
+    for (size_t idx = 0; idx < paste.size(); idx++) {
+        input_queue_ch(paste.at(idx));
+    }
+    wcstring pasted;
+    if (!input_common_read_until(L"\x1b[201~", &pasted)) {
+        err(L"Expected to find the end of the paste");
+    }
+    if (pasted != L"echo " + desired_binding + L"\r") {
+        err(L"Unexpected pasted text '%ls'", pasted.c_str());
+    }
+    c = input_readch();
+    if (c != L'x') {
+        err(L"Expected to read char 'x', but instead got %ls\n", describe_char(c).c_str());
+    }
+    input_mapping_erase(L"qz", L"test_mode");
+    input_mapping_erase(L"");
+}
+
+/// Appends the contents of every fish script under the given directory.
+static void read_fish_scripts(const wcstring &dir_path, wcstring_list_t *scripts) {
+    DIR *dir = wopendir(dir_path);
+    if (dir == NULL) return;
+    wcstring name;
+    bool is_dir = false;
+    while (wreaddir_resolving(dir, dir_path, name, &is_dir)) {
+        if (name == L"." || name == L"..") continue;
+        const wcstring path = dir_path + L"/" + name;
+        if (is_dir) {
+            read_fish_scripts(path, scripts);
+        } else if (string_suffixes_string(L".fish", name)) {
+            int fd = wopen_cloexec(path, O_RDONLY);
+            if (fd < 0) continue;
+            std::string contents;
+            char buff[4096];
+            ssize_t amt;
+            while ((amt = read(fd, buff, sizeof buff)) > 0) contents.append(buff, amt);
+            close(fd);
+            scripts->push_back(str2wcstring(contents));
+        }
+    }
+    closedir(dir);
+}
+
+static void benchmark_parse() {
+    say(L"Benchmarking parsing");
+    wcstring_list_t scripts;
+    read_fish_scripts(L"share", &scripts);
+    do_test(!scripts.empty());
+    size_t chars = 0;
+    for (size_t i = 0; i < scripts.size(); i++) chars += scripts.at(i).size();
+
+    const size_t rounds = 20;
+    size_t nodes = 0;
+    unsigned long allocations = s_allocation_count;
+    double start = timef();
+    for (size_t round = 0; round < rounds; round++) {
+        for (size_t i = 0; i < scripts.size(); i++) {
+            parse_node_tree_t tree;
+            parse_tree_from_string(scripts.at(i), parse_flag_continue_after_error, &tree, NULL);
+            nodes += tree.size();
+        }
+    }
+    double elapsed = timef() - start;
+    allocations = s_allocation_count - allocations;
+
+    const size_t parses = rounds * scripts.size();
+    say(L"Parsed %lu scripts (%lu chars) %lu times in %.0f ms: %.1f MB/s, %lu nodes, %.1f "
+        L"allocations per parse",
+        (unsigned long)scripts.size(), (unsigned long)chars, (unsigned long)rounds,
+        elapsed * 1000, chars * rounds / elapsed / (1024 * 1024), (unsigned long)(nodes / rounds),
+        (double)allocations / parses);
+}
+
+static void benchmark_tokenizer() {
+    say(L"Benchmarking tokenizer");
+    wcstring_list_t scripts;
+    read_fish_scripts(L"share", &scripts);
+    do_test(!scripts.empty());
+
+    const size_t rounds = 20;
+    const tok_flags_t flags[] = {TOK_SQUASH_ERRORS, TOK_SQUASH_ERRORS | TOK_NO_TEXT};
+    for (size_t f = 0; f < sizeof flags / sizeof *flags; f++) {
+        size_t tokens = 0;
+        unsigned long allocations = s_allocation_count;
+        double start = timef();
+        for (size_t round = 0; round < rounds; round++) {
+            for (size_t i = 0; i < scripts.size(); i++) {
+                tokenizer_t tok(scripts.at(i).c_str(), flags[f]);
+                tok_t token;
+                while (tok.next(&token)) tokens++;
+            }
+        }
+        double elapsed = timef() - start;
+        allocations = s_allocation_count - allocations;
+
+        say(L"Read %lu tokens %ls in %.0f ms: %.1f million tokens/s, %.1f allocations per script",
+            (unsigned long)tokens, flags[f] & TOK_NO_TEXT ? L"without text" : L"with text",
+            elapsed * 1000, tokens / elapsed / 1000000,
+            (double)allocations / (rounds * scripts.size()));
+    }
+}
+
+static void benchmark_detect_errors() {
+    say(L"Benchmarking error detection");
+    // A long pasted script, where most arguments contain command substitutions.
+    wcstring src;
+    const size_t line_count = 1000;
+    for (size_t i = 0; i < line_count; i++) {
+        append_format(src, L"set var%lu (string replace -r 'a(b)' c (echo $PWD/%lu)) (count $argv)\n",
+                      (unsigned long)i, (unsigned long)i);
+    }
+
+    // Validate it repeatedly, as the reader does as the user edits and executes it.
+    const size_t rounds = 10;
+    double start = timef();
+    for (size_t round = 0; round < rounds; round++) {
+        parse_error_list_t errors;
+        do_test(parse_util_detect_errors(src, &errors, true) == 0);
+    }
+    double elapsed = timef() - start;
+    say(L"Checked %lu lines %lu times in %.0f ms, %.1f ms per check", (unsigned long)line_count,
+        (unsigned long)rounds, elapsed * 1000, elapsed * 1000 / rounds);
+}
+
+static void benchmark_read() {
+    say(L"Benchmarking read");
+    const char *path = "/tmp/fish_read_benchmark";
+    FILE *f = fopen(path, "w");
+    do_test(f != NULL);
+    if (f == NULL) return;
+    const unsigned long line_count = 1300000;
+    for (unsigned long i = 0; i < line_count; i++) {
+        fprintf(f, "%07lu the quick brown fox jumps over the lazy dog, again and again and again\n",
+                i);
+    }
+    long size = ftell(f);
+    fclose(f);
+
+    double start = timef();
+    parser_t::principal_parser().eval(
+        L"while read -l line; end < " + str2wcstring(path), io_chain_t(), TOP);
+    double elapsed = timef() - start;
+    say(L"Read %lu lines (%ld MB) in %.0f ms", line_count, size / (1024 * 1024), elapsed * 1000);
+    unlink(path);
+}
+
+/// Replays a stream of keys through the binding matcher, with a few hundred bindings spread across
+/// several modes, as with vi mode and plugin bindings.
+static void benchmark_input() {
+    say(L"Benchmarking input");
+    const wchar_t *const modes[] = {DEFAULT_BIND_MODE, L"insert", L"visual"};
+    const size_t mode_count = sizeof modes / sizeof *modes;
+    for (size_t m = 0; m < mode_count; m++) {
+        input_mapping_add(L"", L"self-insert", modes[m], modes[m]);
+        for (wchar_t final = L'A'; final <= L'Z'; final++) {
+            for (int modifier = 2; modifier <= 5; modifier++) {
+                const wcstring seq = format_string(L"\x1b[1;%d%lc", modifier, final);
+                input_mapping_add(seq.c_str(), L"forward-char", modes[m], modes[m]);
+            }
+            input_mapping_add(format_string(L"\x1b%lc", towlower(final)).c_str(), L"backward-word",
+                              modes[m], modes[m]);
+        }
+        for (wchar_t ctrl = 1; ctrl < 27; ctrl++) {
+            const wchar_t seq[] = {L'\x18', ctrl, L'\0'};  // control-X prefix, like emacs
+            input_mapping_add(seq, L"kill-line", modes[m], modes[m]);
+        }
+    }
+
+    // The key stream: mostly plain typing, with arrow keys, alt-letters and control-X chords mixed
+    // in. It must not end in an escape, or we would wait for more input.
+    wcstring keys;
+    const wchar_t *const chunks[] = {L"git commit -m ", L"\x1b[1;5C", L"echo hello world",
+                                     L"\x1b" L"b", L"\x18\x05", L"ls -la /tmp", L"\x1b[1;2D"};
+    const size_t chunk_count = sizeof chunks / sizeof *chunks;
+    while (keys.size() < 1000000) {
+        for (size_t i = 0; i < chunk_count; i++) keys.append(chunks[i]);
+    }
+
+    // Control-X control-X marks the end of the stream.
+    input_mapping_add(L"\x18\x18", L"end-of-history", L"insert", L"insert");
+    keys.append(L"\x18\x18");
+
+    input_set_bind_mode(L"insert");
+    for (size_t i = 0; i < keys.size(); i++) input_queue_ch(keys.at(i));
+    double start = timef();
+    size_t events = 0;
+    while (input_readch() != R_END_OF_HISTORY) events++;
+    double end = timef();
+    input_set_bind_mode(DEFAULT_BIND_MODE);
+    say(L"Matched %lu keys as %lu events in %.3f seconds (%.0f ns per key)",
+        (unsigned long)keys.size(), (unsigned long)events, end - start,
+        (end - start) * 1e9 / keys.size());
+}
+
+/// Sets a variable many times with hundreds of event handlers registered on other variables and
+/// events, as with prompt plugins and directory hooks.
+static void benchmark_event() {
+    say(L"Benchmarking event dispatch");
+    const size_t handler_count = 500;
+    for (size_t i = 0; i < handler_count; i++) {
+        event_t handler(i % 2 ? EVENT_GENERIC : EVENT_VARIABLE);
+        handler.str_param1 = format_string(L"__fish_bench_watched_%lu", (unsigned long)i);
+        handler.function_name = format_string(L"__fish_bench_handler_%lu", (unsigned long)i);
+        event_add_handler(handler);
+    }
+
+    const size_t set_count = 100000;
+    double start = timef();
+    for (size_t i = 0; i < set_count; i++) {
+        env_set(L"__fish_bench_var", i % 2 ? L"odd" : L"even", ENV_GLOBAL);
+    }
+    double end = timef();
+    say(L"Set a variable %lu times with %lu handlers in %.3f seconds (%.0f ns per set)",
+        (unsigned long)set_count, (unsigned long)handler_count, end - start,
+        (end - start) * 1e9 / set_count);
+
+    event_t all(EVENT_ANY);
+    event_remove(all);
+    env_remove(L"__fish_bench_var", ENV_GLOBAL);
 }
 
 #define UVARS_PER_THREAD 8
@@ -2699,6 +3371,8 @@ class history_tests_t {
     static void test_history(void);
     static void test_history_merge(void);
     static void test_history_formats(void);
+    static void test_history_vacuum(void);
+    static void benchmark_history_incorporate(void);
     // static void test_history_speed(void);
     static void test_history_races(void);
     static void test_history_races_pound_on_history();
@@ -2767,6 +3441,30 @@ void history_tests_t::test_history(void) {
     test_history_matches(searcher, 2, __LINE__);
     do_test(searcher.current_string() == L"ALPH");
 
+    // Items matching non-ASCII text, case-insensitive. Folding the case of non-ASCII characters
+    // needs a locale that knows about them, so switch to a UTF-8 one if there is one.
+    history.add(L"\u00C9t\u00E9");
+    history.add(L"\u00E9T\u00C9");
+    const std::string saved_ctype = setlocale(LC_CTYPE, NULL);
+    if (setlocale(LC_CTYPE, "C.UTF-8") || setlocale(LC_CTYPE, "en_US.UTF-8")) {
+        searcher = history_search_t(history, L"\u00E9t", HISTORY_SEARCH_TYPE_PREFIX, false);
+        test_history_matches(searcher, 2, __LINE__);
+        do_test(searcher.current_string() == L"\u00E9T\u00C9");
+    } else {
+        say(L"Skipping non-ASCII case-insensitive history search: no UTF-8 locale");
+    }
+    setlocale(LC_CTYPE, saved_ctype.c_str());
+    searcher = history_search_t(history, L"T\u00C9", HISTORY_SEARCH_TYPE_CONTAINS, true);
+    test_history_matches(searcher, 1, __LINE__);
+    do_test(searcher.current_string() == L"\u00E9T\u00C9");
+
+    // Getting the first few items for $history, newest first.
+    wcstring_list_t first_items;
+    history.get_history(&first_items, 3);
+    do_test(first_items.size() == 3);
+    do_test(first_items.at(0) == L"\u00E9T\u00C9");
+    do_test(first_items.at(2) == L"ZZZ");
+
     // Test item removal case-sensitive.
     searcher = history_search_t(history, L"Alpha");
     test_history_matches(searcher, 1, __LINE__);
@@ -2809,7 +3507,7 @@ void history_tests_t::test_history(void) {
     do_test(before.size() == after.size());
     for (size_t i = 0; i < before.size(); i++) {
         const history_item_t &bef = before.at(i), &aft = after.at(i);
-        do_test(bef.contents == aft.contents);
+        do_test(bef.str() == aft.str());
         do_test(bef.creation_timestamp == aft.creation_timestamp);
         do_test(bef.required_paths == aft.required_paths);
     }
@@ -3077,6 +3775,93 @@ static bool history_equals(history_t &hist, const wchar_t *const *strings) {
     return true;
 }
 
+void history_tests_t::test_history_vacuum(void) {
+    say(L"Testing history vacuuming");
+    // Only one vacuum runs at a time, so let any from earlier tests finish.
+    iothread_drain_all();
+    history_t *hist = new history_t(L"vacuum_test");
+    hist->clear();
+
+    wcstring path;
+    do_test(path_get_data(path));
+    path.append(L"/vacuum_test_history");
+    FILE *f = wfopen(path, "w");
+    do_test(f != NULL);
+    if (f == NULL) return;
+    fputs("- cmd: one\n  when: 1\n- cmd: two\n  when: 2\n- cmd: one\n  when: 3\n", f);
+    fclose(f);
+
+    // The next save vacuums, which happens on a background thread.
+    hist->countdown_to_vacuum = 0;
+    hist->add(L"three");
+    iothread_drain_all();
+
+    std::string contents;
+    f = wfopen(path, "r");
+    do_test(f != NULL);
+    if (f != NULL) {
+        char buff[256];
+        size_t amt;
+        while ((amt = fread(buff, 1, sizeof buff, f)) > 0) contents.append(buff, amt);
+        fclose(f);
+    }
+    const char *expected = "- cmd: two\n  when: 2\n- cmd: one\n  when: 3\n- cmd: three\n";
+    if (contents.compare(0, strlen(expected), expected) != 0) {
+        err(L"Vacuumed history file has unexpected contents:\n%s", contents.c_str());
+    }
+
+    hist->clear();
+    delete hist;
+}
+
+/// Times picking up another shell's item from a large history file, as happens at every prompt when
+/// sharing history.
+void history_tests_t::benchmark_history_incorporate(void) {
+    say(L"Benchmarking incorporating external history changes");
+    const wcstring name = L"incorporate_benchmark";
+    history_t *reader = new history_t(name);
+    reader->clear();
+
+    wcstring path;
+    do_test(path_get_data(path));
+    path.append(L"/incorporate_benchmark_history");
+    FILE *f = wfopen(path, "w");
+    do_test(f != NULL);
+    if (f == NULL) return;
+    const unsigned long item_count = 500000;
+    for (unsigned long i = 0; i < item_count; i++) {
+        fprintf(f, "- cmd: echo history incorporate benchmark item %lu\n  when: %lu\n", i,
+                1000000000UL + i);
+    }
+    fclose(f);
+
+    // The writer would otherwise date its items a second late, if they were added in the second it
+    // was created.
+    history_t *writer = new history_t(name);
+    writer->boundary_timestamp = 0;
+    do_test(!reader->item_at_index(1).empty());
+    const size_t rounds = 100;
+    double total = 0;
+    for (size_t i = 0; i < rounds; i++) {
+        writer->add(format_string(L"echo from another shell %lu", (unsigned long)i));
+        writer->save();
+
+        // Pretend a second has passed, since we only incorporate changes once a second.
+        reader->boundary_timestamp--;
+        double start = timef();
+        reader->incorporate_external_changes();
+        history_item_t item = reader->item_at_index(1);
+        total += timef() - start;
+        do_test(item.str() == format_string(L"echo from another shell %lu", (unsigned long)i));
+    }
+    say(L"%lu rounds against %lu history items: %.3f ms per round", (unsigned long)rounds,
+        item_count, total * 1000 / rounds);
+
+    reader->clear();
+    delete reader;
+    delete writer;
+}
+
 void history_tests_t::test_history_formats(void) {
     const wchar_t *name;
 
@@ -4199,7 +4984,9 @@ int main(int argc, char **argv) {
     if (should_test_function("utils")) test_utils();
     if (should_test_function("utf8")) test_utf8();
     if (should_test_function("escape_sequences")) test_escape_sequences();
+    if (should_test_function("wcwidth")) test_wcwidth();
     if (should_test_function("lru")) test_lru();
+    if (should_test_function("intern")) test_intern();
     if (should_test_function("expand")) test_expand();
     if (should_test_function("fuzzy_match")) test_fuzzy_match();
     if (should_test_function("abbreviations")) test_abbreviations();
@@ -4207,11 +4994,24 @@ int main(int argc, char **argv) {
     if (should_test_function("path")) test_path();
     if (should_test_function("pager_navigation")) test_pager_navigation();
     if (should_test_function("pager_layout")) test_pager_layout();
+    if (should_test_function("pager_filter")) test_pager_filter();
     if (should_test_function("word_motion")) test_word_motion();
     if (should_test_function("is_potential_path")) test_is_potential_path();
     if (should_test_function("colors")) test_colors();
     if (should_test_function("complete")) test_complete();
     if (should_test_function("input")) test_input();
+    if (should_run_benchmark("benchmark_input")) benchmark_input();
+    if (should_run_benchmark("benchmark_event")) benchmark_event();
+    if (should_run_benchmark("benchmark_autosuggest")) benchmark_autosuggest();
+    if (should_run_benchmark("benchmark_history_vacuum")) benchmark_history_vacuum();
+    if (should_run_benchmark("benchmark_parse")) benchmark_parse();
+    if (should_run_benchmark("benchmark_pager")) benchmark_pager();
+    if (should_run_benchmark("benchmark_tokenizer")) benchmark_tokenizer();
+    if (should_run_benchmark("benchmark_detect_errors")) benchmark_detect_errors();
+    if (should_run_benchmark("benchmark_read")) benchmark_read();
+    if (should_run_benchmark("benchmark_history_incorporate")) {
+        history_tests_t::benchmark_history_incorporate();
+    }
     if (should_test_function("universal")) test_universal();
     if (should_test_function("universal")) test_universal_callbacks();
     if (should_test_function("notifiers")) test_universal_notifiers();
@@ -4219,11 +5019,14 @@ int main(int argc, char **argv) {
     if (should_test_function("autosuggestion_ignores")) test_autosuggestion_ignores();
     if (should_test_function("autosuggestion_combining")) test_autosuggestion_combining();
     if (should_test_function("autosuggest_suggest_special")) test_autosuggest_suggest_special();
+    if (should_test_function("autosuggest_from_history")) test_autosuggest_from_history();
     if (should_test_function("wcstring_tok")) test_wcstring_tok();
     if (should_test_function("history")) history_tests_t::test_history();
+    if (should_test_function("history_file_detection")) test_history_file_detection();
     if (should_test_function("history_merge")) history_tests_t::test_history_merge();
     if (should_test_function("history_races")) history_tests_t::test_history_races();
     if (should_test_function("history_formats")) history_tests_t::test_history_formats();
+    if (should_test_function("history_vacuum")) history_tests_t::test_history_vacuum();
     if (should_test_function("string")) test_string();
     if (should_test_function("env_vars")) test_env_vars();
     if (should_test_function("illegal_command_exit_code")) test_illegal_command_exit_code();
@@ -52,6 +52,9 @@
 // Default buffer size for flushing to the history file.
 #define HISTORY_OUTPUT_BUFFER_SIZE (16 * 1024)
 
+/// When vacuuming, we write in much bigger chunks, since we're writing the whole file anyways.
+#define HISTORY_VACUUM_BUFFER_SIZE (1024 * 1024)
+
 namespace {
 
 /// Helper class for certain output. This is basically a string that allows us to ensure we only
@@ -140,44 +143,6 @@ static bool history_file_lock(int fd, int lock_type) {
     return retval != -1;
 }
 
-/// Our LRU cache is used for restricting the amount of history we have, and limiting how long we
-/// order it.
-class history_lru_node_t : public lru_node_t {
-   public:
-    time_t timestamp;
-    path_list_t required_paths;
-    explicit history_lru_node_t(const history_item_t &item)
-        : lru_node_t(item.str()),
-          timestamp(item.timestamp()),
-          required_paths(item.get_required_paths()) {}
-};
-
-class history_lru_cache_t : public lru_cache_t<history_lru_node_t> {
-   protected:
-    /// Override to delete evicted nodes.
-    virtual void node_was_evicted(history_lru_node_t *node) { delete node; }
-
-   public:
-    explicit history_lru_cache_t(size_t max) : lru_cache_t<history_lru_node_t>(max) {}
-
-    /// Function to add a history item.
-    void add_item(const history_item_t &item) {
-        // Skip empty items.
-        if (item.empty()) return;
-
-        // See if it's in the cache. If it is, update the timestamp. If not, we create a new node
-        // and add it. Note that calling get_node promotes the node to the front.
-        history_lru_node_t *node = this->get_node(item.str());
-        if (node == NULL) {
-            node = new history_lru_node_t(item);
-            this->add_node(node);
-        } else {
-            node->timestamp = std::max(node->timestamp, item.timestamp());
-            // What to do about paths here? Let's just ignore them.
-        }
-    }
-};
-
 class history_collection_t {
     pthread_mutex_t m_lock;
     std::map<wcstring, history_t *> m_histories;
@@ -419,7 +384,8 @@ static history_item_t decode_item(const char *base, size_t len, history_file_typ
 /// recent identifier, and the longer list of required paths.
 bool history_item_t::merge(const history_item_t &item) {
     bool result = false;
-    if (this->contents == item.contents) {
+    if (this->narrow_contents == item.narrow_contents &&
+        this->wide_contents == item.wide_contents) {
         this->creation_timestamp = std::max(this->creation_timestamp, item.creation_timestamp);
         if (this->required_paths.size() < item.required_paths.size()) {
             this->required_paths = item.required_paths;
@@ -432,54 +398,71 @@ bool history_item_t::merge(const history_item_t &item) {
     return result;
 }
 
-#if 0
-history_item_t::history_item_t(const wcstring &str)
-    : contents(str), contents_lower(L""), creation_timestamp(time(NULL)), identifier(0) {
-        for (wcstring::const_iterator it = str.begin(); it != str.end(); ++it) {
-                contents_lower.push_back(towlower(*it));
-        }
-    }
-#endif
-
 history_item_t::history_item_t(const wcstring &str, time_t when, history_identifier_t ident)
-    : contents(str), contents_lower(L""), creation_timestamp(when), identifier(ident) {
+    : creation_timestamp(when), identifier(ident) {
+    bool is_ascii = true;
     for (wcstring::const_iterator it = str.begin(); it != str.end(); ++it) {
-        contents_lower.push_back(towlower(*it));
+        if (*it <= 0 || *it >= 0x80) {
+            is_ascii = false;
+            break;
+        }
+    }
+    if (is_ascii) {
+        narrow_contents.assign(str.begin(), str.end());
+    } else {
+        wide_contents = str;
     }
 }
 
-bool history_item_t::matches_search(const wcstring &term, enum history_search_type_t type,
-                                    bool case_sensitive) const {
+wcstring history_item_t::str() const {
+    if (!wide_contents.empty()) return wide_contents;
+    return wcstring(narrow_contents.begin(), narrow_contents.end());
+}
+
+/// Compares characters, optionally ignoring case.
+struct history_char_equal_t {
+    const bool case_sensitive;
+
+    explicit history_char_equal_t(bool cs) : case_sensitive(cs) {}
+
+    template <typename CHAR1, typename CHAR2>
+    bool operator()(CHAR1 c1, CHAR2 c2) const {
+        wchar_t wc1 = (wchar_t)c1, wc2 = (wchar_t)c2;
+        return case_sensitive ? wc1 == wc2 : towlower(wc1) == towlower(wc2);
+    }
+};
+
+/// Returns whether the given contents match a search term.
+template <typename STR>
+static bool history_contents_match(const STR &contents, const wcstring &term,
+                                   enum history_search_type_t type, bool case_sensitive) {
     // We don't use a switch below because there are only three cases and if the strings are the
     // same length we can use the faster HISTORY_SEARCH_TYPE_EXACT for the other two cases.
     //
     // Too, we consider equal strings to match a prefix search, so that autosuggest will allow
     // suggesting what you've typed.
-    if (case_sensitive) {
-        if (type == HISTORY_SEARCH_TYPE_EXACT || term.size() == contents.size()) {
-            return term == contents;
-        } else if (type == HISTORY_SEARCH_TYPE_CONTAINS) {
-            return contents.find(term) != wcstring::npos;
-        } else if (type == HISTORY_SEARCH_TYPE_PREFIX) {
-            return string_prefixes_string(term, contents);
-        }
-    } else {
-        wcstring lterm(L"");
-        for (wcstring::const_iterator it = term.begin(); it != term.end(); ++it) {
-            lterm.push_back(towlower(*it));
-        }
-
-        if (type == HISTORY_SEARCH_TYPE_EXACT || lterm.size() == contents.size()) {
-            return lterm == contents_lower;
-        } else if (type == HISTORY_SEARCH_TYPE_CONTAINS) {
-            return contents_lower.find(lterm) != wcstring::npos;
-        } else if (type == HISTORY_SEARCH_TYPE_PREFIX) {
-            return string_prefixes_string(lterm, contents_lower);
-        }
+    const history_char_equal_t eq(case_sensitive);
+    if (type == HISTORY_SEARCH_TYPE_EXACT || term.size() == contents.size()) {
+        return term.size() == contents.size() &&
+               std::equal(term.begin(), term.end(), contents.begin(), eq);
+    } else if (type == HISTORY_SEARCH_TYPE_CONTAINS) {
+        return std::search(contents.begin(), contents.end(), term.begin(), term.end(), eq) !=
+               contents.end();
+    } else if (type == HISTORY_SEARCH_TYPE_PREFIX) {
+        return term.size() <= contents.size() &&
+               std::equal(term.begin(), term.end(), contents.begin(), eq);
     }
     DIE("unexpected history_search_type_t value");
 }
 
+bool history_item_t::matches_search(const wcstring &term, enum history_search_type_t type,
+                                    bool case_sensitive) const {
+    if (!wide_contents.empty()) {
+        return history_contents_match(wide_contents, term, type, case_sensitive);
+    }
+    return history_contents_match(narrow_contents, term, type, case_sensitive);
+}
+
 /// Append our YAML history format to the provided vector at the given offset, updating the offset.
 static void append_yaml_to_buffer(const wcstring &wcmd, time_t timestamp,
                                   const path_list_t &required_paths,
@@ -560,10 +543,12 @@ static const char *next_line(const char *start, size_t length) {
 /// Support for iteratively locating the offsets of history items.
 /// Pass the address and length of a mapped region.
 /// Pass a pointer to a cursor size_t, initially 0.
-/// If custoff_timestamp is nonzero, skip items created at or after that timestamp.
+/// If custoff_timestamp is nonzero, skip items created at or after that timestamp. If
+/// skipped_offsets is not NULL, the offsets of those items are appended to it.
 /// Returns (size_t)-1 when done.
 static size_t offset_of_next_item_fish_2_0(const char *begin, size_t mmap_length,
-                                           size_t *inout_cursor, time_t cutoff_timestamp) {
+                                           size_t *inout_cursor, time_t cutoff_timestamp,
+                                           std::vector<size_t> *skipped_offsets) {
     size_t cursor = *inout_cursor;
     size_t result = (size_t)-1;
     while (cursor < mmap_length) {
@@ -639,6 +624,7 @@ static size_t offset_of_next_item_fish_2_0(const char *begin, size_t mmap_length
 
             // Skip this item if the timestamp is past our cutoff.
             if (has_timestamp && timestamp > cutoff_timestamp) {
+                if (skipped_offsets != NULL) skipped_offsets->push_back(line_start - begin);
                 continue;
             }
         }
@@ -689,10 +675,12 @@ static size_t offset_of_next_item_fish_1_x(const char *begin, size_t mmap_length
 /// Returns the offset of the next item based on the given history type, or -1.
 static size_t offset_of_next_item(const char *begin, size_t mmap_length,
                                   history_file_type_t mmap_type, size_t *inout_cursor,
-                                  time_t cutoff_timestamp) {
+                                  time_t cutoff_timestamp,
+                                  std::vector<size_t> *skipped_offsets = NULL) {
     size_t result = (size_t)-1;
     if (mmap_type == history_type_fish_2_0) {
-        result = offset_of_next_item_fish_2_0(begin, mmap_length, inout_cursor, cutoff_timestamp);
+        result = offset_of_next_item_fish_2_0(begin, mmap_length, inout_cursor, cutoff_timestamp,
+                                              skipped_offsets);
     } else if (mmap_type == history_type_fish_1_x) {
         result = offset_of_next_item_fish_1_x(begin, mmap_length, inout_cursor);
     }
@@ -719,6 +707,7 @@ history_t::history_t(const wcstring &pname)
       mmap_length(0),
       mmap_type(history_file_type_t(-1)),
       mmap_file_id(kInvalidFileID),
+      mmap_scan_cursor(0),
       boundary_timestamp(time(NULL)),
       countdown_to_vacuum(-1),
       loaded_old(false),
@@ -771,7 +760,6 @@ void history_t::save_internal_unless_disabled() {
         vacuum = true;
     }
 
-    // This might be a good candidate for moving to a background thread.
     time_profiler_t profiler(vacuum ? "save_internal vacuum"       //!OCLINT(unused var)
                                     : "save_internal no vacuum");  //!OCLINT(side-effect)
     this->save_internal(vacuum);
@@ -836,9 +824,16 @@ void history_t::set_valid_file_paths(const wcstring_list_t &valid_file_paths,
 }
 
 void history_t::get_string_representation(wcstring *result, const wcstring &separator) {
-    scoped_lock locker(lock);
+    wcstring_list_t items;
+    get_history(&items, (size_t)-1);
+    for (size_t i = 0; i < items.size(); i++) {
+        if (i > 0) result->append(separator);
+        result->append(items.at(i));
+    }
+}
 
-    bool first = true;
+void history_t::get_history(wcstring_list_t *result, size_t max_count) {
+    scoped_lock locker(lock);
 
     std::set<wcstring> seen;
 
@@ -850,6 +845,8 @@ void history_t::get_string_representation(wcstring *result, const wcstring &sepa
     // http://github.com/fish-shell/fish-shell/issues/431.
     for (history_item_list_t::reverse_iterator iter = new_items.rbegin(); iter < new_items.rend();
          ++iter) {
+        if (result->size() >= max_count) return;
+
         // Skip a pending item if we have one.
         if (next_is_pending) {
             next_is_pending = false;
@@ -857,27 +854,24 @@ void history_t::get_string_representation(wcstring *result, const wcstring &sepa
         }
 
         // Skip duplicates.
-        if (!seen.insert(iter->str()).second) continue;
-
-        if (!first) result->append(separator);
-        result->append(iter->str());
-        first = false;
+        wcstring str = iter->str();
+        if (!seen.insert(str).second) continue;
+        result->push_back(str);
     }
 
     // Append old items.
+    if (result->size() >= max_count) return;
     load_old_if_needed();
     for (std::deque<size_t>::reverse_iterator iter = old_item_offsets.rbegin();
-         iter != old_item_offsets.rend(); ++iter) {
+         iter != old_item_offsets.rend() && result->size() < max_count; ++iter) {
         size_t offset = *iter;
         const history_item_t item =
             decode_item(mmap_start + offset, mmap_length - offset, mmap_type);
 
         // Skip duplicates.
-        if (!seen.insert(item.str()).second) continue;
-
-        if (!first) result->append(separator);
-        result->append(item.str());
-        first = false;
+        wcstring str = item.str();
+        if (!seen.insert(str).second) continue;
+        result->push_back(str);
     }
 }
 
@@ -914,12 +908,16 @@ history_item_t history_t::item_at_index(size_t idx) {
     return history_item_t(wcstring(), 0);
 }
 
+/// Returns whether two file IDs refer to the same file, regardless of whether it has changed.
+static bool history_same_file(const file_id_t &a, const file_id_t &b) {
+    return a.device == b.device && a.inode == b.inode;
+}
+
 void history_t::populate_from_mmap(void) {
-    mmap_type = infer_file_type(mmap_start, mmap_length);
-    size_t cursor = 0;
+    if (mmap_scan_cursor == 0) mmap_type = infer_file_type(mmap_start, mmap_length);
     for (;;) {
-        size_t offset =
-            offset_of_next_item(mmap_start, mmap_length, mmap_type, &cursor, boundary_timestamp);
+        size_t offset = offset_of_next_item(mmap_start, mmap_length, mmap_type, &mmap_scan_cursor,
+                                            boundary_timestamp, &newer_item_offsets);
         // If we get back -1, we're done.
         if (offset == (size_t)-1) break;
 
@@ -928,6 +926,51 @@ void history_t::populate_from_mmap(void) {
     }
 }
 
+bool history_t::incorporate_file_tail() {
+    ASSERT_IS_LOCKED(lock);
+    // If we haven't loaded the file, we'll read all of it when we do.
+    if (!loaded_old) return true;
+    if (mmap_start == NULL || mmap_type != history_type_fish_2_0) return false;
+
+    const char *new_mmap_start = NULL;
+    size_t new_mmap_length = 0;
+    file_id_t new_file_id;
+    if (!map_file(name, &new_mmap_start, &new_mmap_length, &new_file_id)) return false;
+
+    // If the file was replaced (vacuumed) or shrank, what we've read may have changed.
+    if (!history_same_file(new_file_id, mmap_file_id) || new_mmap_length < mmap_length) {
+        munmap((void *)new_mmap_start, new_mmap_length);
+        return false;
+    }
+
+    // The file was only appended to, so everything we've read is still where it was.
+    munmap((void *)mmap_start, mmap_length);
+    mmap_start = new_mmap_start;
+    mmap_length = new_mmap_length;
+    mmap_file_id = new_file_id;
+
+    // Items we skipped for being newer than our boundary timestamp may not be anymore. They are in
+    // file order, as are our old items, so merge them in.
+    std::vector<size_t> still_newer;
+    const size_t old_count = old_item_offsets.size();
+    for (size_t i = 0; i < newer_item_offsets.size(); i++) {
+        size_t offset = newer_item_offsets.at(i);
+        const history_item_t item = decode_item(mmap_start + offset, mmap_length - offset, mmap_type);
+        if (item.timestamp() > boundary_timestamp) {
+            still_newer.push_back(offset);
+        } else {
+            old_item_offsets.push_back(offset);
+        }
+    }
+    newer_item_offsets.swap(still_newer);
+    std::inplace_merge(old_item_offsets.begin(), old_item_offsets.begin() + old_count,
+                       old_item_offsets.end());
+
+    // Now read the tail.
+    this->populate_from_mmap();
+    return true;
+}
+
 /// Do a private, read-only map of the entirety of a history file with the given name. Returns true
 /// if successful. Returns the mapped memory region by reference.
 bool history_t::map_file(const wcstring &name, const char **out_map_start, size_t *out_map_len,
@@ -1006,6 +1049,7 @@ bool history_search_t::should_skip_match(const wcstring &str) const {
 bool history_search_t::go_forwards() {
     // Pop the top index (if more than one) and return if we have any left.
     if (prev_matches.size() > 1) {
+        prev_match_strings.erase(prev_matches.back().second.str());
         prev_matches.pop_back();
         return true;
     }
@@ -1016,7 +1060,7 @@ bool history_search_t::go_backwards() {
     // Backwards means increasing our index.
     const size_t max_idx = (size_t)-1;
 
-    size_t idx = 0;
+    size_t idx = start_index;
     if (!prev_matches.empty()) idx = prev_matches.back().first;
 
     if (idx == max_idx) return false;
@@ -1034,11 +1078,13 @@ bool history_search_t::go_backwards() {
             return false;
         }
 
-        // Look for a term that matches and that we haven't seen before.
-        const wcstring &str = item.str();
-        if (item.matches_search(term, search_type, case_sensitive) && !match_already_made(str) &&
-            !should_skip_match(str)) {
+        // Look for a term that matches and that we haven't seen before. Only widen the contents of
+        // items that match.
+        if (!item.matches_search(term, search_type, case_sensitive)) continue;
+        const wcstring str = item.str();
+        if (!match_already_made(str) && !should_skip_match(str)) {
             prev_matches.push_back(prev_match_t(idx, item));
+            prev_match_strings.insert(str);
             return true;
         }
     }
@@ -1046,7 +1092,10 @@ bool history_search_t::go_backwards() {
 }
 
 /// Goes to the end (forwards).
-void history_search_t::go_to_end(void) { prev_matches.clear(); }
+void history_search_t::go_to_end(void) {
+    prev_matches.clear();
+    prev_match_strings.clear();
+}
 
 /// Returns if we are at the end, which is where we start.
 bool history_search_t::is_at_end(void) const { return prev_matches.empty(); }
@@ -1069,12 +1118,18 @@ wcstring history_search_t::current_string() const {
     return item.str();
 }
 
+size_t history_search_t::current_index() const {
+    assert(!prev_matches.empty());  //!OCLINT(double negative)
+    return prev_matches.back().first;
+}
+
+void history_search_t::skip_to_index(size_t idx) {
+    assert(idx > 0);
+    start_index = idx - 1;
+}
+
 bool history_search_t::match_already_made(const wcstring &match) const {
-    for (std::vector<prev_match_t>::const_iterator iter = prev_matches.begin();
-         iter != prev_matches.end(); ++iter) {
-        if (iter->second.str() == match) return true;
-    }
-    return false;
+    return prev_match_strings.count(match) > 0;
 }
 
 static void replace_all(std::string *str, const char *needle, const char *replacement) {
@@ -1143,8 +1198,10 @@ void history_t::clear_file_state() {
     }
     mmap_start = NULL;
     mmap_length = 0;
+    mmap_scan_cursor = 0;
     loaded_old = false;
     old_item_offsets.clear();
+    newer_item_offsets.clear();
 }
 
 void history_t::compact_new_items() {
@@ -1154,7 +1211,7 @@ void history_t::compact_new_items() {
     size_t idx = new_items.size();
     while (idx--) {
         const history_item_t &item = new_items[idx];
-        if (!seen.insert(item.contents).second) {
+        if (!seen.insert(item.str()).second) {
             // This item was not inserted because it was already in the set, so delete the item at
             // this index.
             new_items.erase(new_items.begin() + idx);
@@ -1168,6 +1225,263 @@ void history_t::compact_new_items() {
     }
 }
 
+/// Gets the command of the item at the given offset, escaped as in our YAML format, along with its
+/// timestamp. Returns false if the item has no command. For our own format this reads the lines
+/// directly rather than decoding the whole item.
+static bool vacuum_item_command(const char *map_start, size_t map_len, history_file_type_t type,
+                                size_t offset, std::string *out_cmd, time_t *out_when) {
+    if (type != history_type_fish_2_0) {
+        const history_item_t item = decode_item(map_start + offset, map_len - offset, type);
+        *out_cmd = wcs2string(item.str());
+        escape_yaml(out_cmd);
+        *out_when = item.timestamp();
+        return !item.empty();
+    }
+
+    // Items found by offset_of_next_item_fish_2_0 always end with a newline.
+    const char *const end = map_start + map_len;
+    const char *line = map_start + offset;
+    const char *newline = (const char *)memchr(line, '\n', end - line);
+    const size_t prefix_len = strlen("- cmd: ");
+    if (newline == NULL || (size_t)(newline - line) <= prefix_len ||
+        memcmp(line, "- cmd: ", prefix_len) != 0) {
+        return false;
+    }
+    out_cmd->assign(line + prefix_len, newline - line - prefix_len);
+
+    *out_when = 0;
+    for (const char *interior_line = next_line(line, end - line);
+         interior_line != NULL && interior_line[0] == ' ';
+         interior_line = next_line(interior_line, end - interior_line)) {
+        if (parse_timestamp(interior_line, out_when)) break;
+    }
+    return true;
+}
+
+/// FNV-1a hash of an escaped command.
+static uint64_t vacuum_hash(const std::string &cmd) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < cmd.size(); i++) {
+        hash ^= (unsigned char)cmd[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/// Open addressed hash table from a hash of an item's command to where its first and last copies
+/// are, and the latest timestamp of any of its copies. Items in the file are at their offset into
+/// it, and items we have not yet written at the length of the file plus their index in new_items.
+class vacuum_table_t {
+   public:
+    struct entry_t {
+        uint64_t hash;
+        size_t first_where;
+        size_t where;
+        time_t timestamp;
+    };
+
+   private:
+    std::vector<entry_t> slots;
+    size_t count;
+
+    static const size_t kEmpty = (size_t)-1;
+
+    size_t find_slot(uint64_t hash) const {
+        size_t mask = slots.size() - 1;
+        size_t idx = (size_t)hash & mask;
+        while (slots[idx].where != kEmpty && slots[idx].hash != hash) idx = (idx + 1) & mask;
+        return idx;
+    }
+
+   public:
+    vacuum_table_t() : count(0) {
+        entry_t empty = {0, kEmpty, kEmpty, 0};
+        slots.assign(1024, empty);
+    }
+
+    size_t size() const { return count; }
+
+    /// Records a copy of an item.
+    void add(uint64_t hash, size_t where, time_t timestamp) {
+        entry_t &slot = slots[find_slot(hash)];
+        if (slot.where == kEmpty) {
+            entry_t entry = {hash, where, where, timestamp};
+            slot = entry;
+            // Keep the load factor under 1/2.
+            if (++count * 2 > slots.size()) grow();
+        } else {
+            slot.where = where;
+            slot.timestamp = std::max(slot.timestamp, timestamp);
+        }
+    }
+
+    /// Returns the entry for the given hash, which must have been added.
+    const entry_t &get(uint64_t hash) const {
+        const entry_t &slot = slots[find_slot(hash)];
+        assert(slot.where != kEmpty);
+        return slot;
+    }
+
+   private:
+    void grow() {
+        entry_t empty = {0, kEmpty, kEmpty, 0};
+        std::vector<entry_t> old_slots(slots.size() * 2, empty);
+        old_slots.swap(slots);
+        for (size_t i = 0; i < old_slots.size(); i++) {
+            if (old_slots[i].where != kEmpty) slots[find_slot(old_slots[i].hash)] = old_slots[i];
+        }
+    }
+};
+
+/// Writes a vacuumed copy of a history file to out_fd. That is the items in the given map followed
+/// by new_items from first_new_item on, minus deleted items, with only the last copy of each
+/// duplicated item, and only the most recent HISTORY_SAVE_MAX items.
+///
+/// This streams through the map twice rather than decoding all the items into memory. The first
+/// pass remembers only a hash of each distinct command, so two different commands whose hashes
+/// collide would be treated as duplicates. With a 64 bit hash that is vanishingly unlikely. The
+/// second pass decodes just the items we keep.
+static bool write_vacuumed_history(const char *map_start, size_t map_len,
+                                   const std::set<wcstring> &deleted_items,
+                                   const history_item_list_t &new_items, size_t first_new_item,
+                                   int out_fd) {
+    const history_file_type_t map_type =
+        map_start ? infer_file_type(map_start, map_len) : history_file_type_t(-1);
+
+    // Deleted items are compared in their escaped form.
+    std::set<std::string> deleted_cmds;
+    for (std::set<wcstring>::const_iterator iter = deleted_items.begin();
+         iter != deleted_items.end(); ++iter) {
+        std::string cmd = wcs2string(*iter);
+        escape_yaml(&cmd);
+        deleted_cmds.insert(cmd);
+    }
+
+    // First pass: find the last copy of each item.
+    vacuum_table_t table;
+    std::string cmd;
+    time_t when;
+    size_t cursor = 0;
+    for (;;) {
+        size_t offset = map_start ? offset_of_next_item(map_start, map_len, map_type, &cursor, 0)
+                                  : (size_t)-1;
+        // If we get back -1, we're done.
+        if (offset == (size_t)-1) break;
+
+        if (!vacuum_item_command(map_start, map_len, map_type, offset, &cmd, &when)) continue;
+        if (deleted_cmds.count(cmd) > 0) continue;
+        table.add(vacuum_hash(cmd), offset, when);
+    }
+    for (size_t i = first_new_item; i < new_items.size(); i++) {
+        const history_item_t &item = new_items.at(i);
+        if (item.empty()) continue;
+        cmd = wcs2string(item.str());
+        escape_yaml(&cmd);
+        table.add(vacuum_hash(cmd), map_len + i, item.timestamp());
+    }
+
+    // Skip the oldest items beyond HISTORY_SAVE_MAX.
+    size_t to_skip = table.size() > HISTORY_SAVE_MAX ? table.size() - HISTORY_SAVE_MAX : 0;
+
+    // Second pass: write out the last copy of each item.
+    history_output_buffer_t buffer;
+    cursor = 0;
+    for (;;) {
+        size_t offset = map_start ? offset_of_next_item(map_start, map_len, map_type, &cursor, 0)
+                                  : (size_t)-1;
+        if (offset == (size_t)-1) break;
+
+        if (!vacuum_item_command(map_start, map_len, map_type, offset, &cmd, &when)) continue;
+        if (deleted_cmds.count(cmd) > 0) continue;
+        const vacuum_table_t::entry_t &entry = table.get(vacuum_hash(cmd));
+        if (entry.where != offset) continue;
+        if (to_skip > 0) {
+            to_skip--;
+            continue;
+        }
+
+        // The paths come from the first copy, which is where they were detected.
+        const history_item_t item = decode_item(map_start + offset, map_len - offset, map_type);
+        const history_item_t first =
+            entry.first_where == offset
+                ? item
+                : decode_item(map_start + entry.first_where, map_len - entry.first_where, map_type);
+        append_yaml_to_buffer(item.str(), entry.timestamp, first.get_required_paths(), &buffer);
+        if (buffer.output_size() >= HISTORY_VACUUM_BUFFER_SIZE && !buffer.flush_to_fd(out_fd)) {
+            return false;
+        }
+    }
+    for (size_t i = first_new_item; i < new_items.size(); i++) {
+        const history_item_t &item = new_items.at(i);
+        if (item.empty()) continue;
+        cmd = wcs2string(item.str());
+        escape_yaml(&cmd);
+        const vacuum_table_t::entry_t &entry = table.get(vacuum_hash(cmd));
+        if (entry.where != map_len + i) continue;
+        if (to_skip > 0) {
+            to_skip--;
+            continue;
+        }
+
+        const history_item_t &first = entry.first_where < map_len
+                                          ? decode_item(map_start + entry.first_where,
+                                                        map_len - entry.first_where, map_type)
+                                          : new_items.at(entry.first_where - map_len);
+        append_yaml_to_buffer(item.str(), entry.timestamp, first.get_required_paths(), &buffer);
+        if (buffer.output_size() >= HISTORY_VACUUM_BUFFER_SIZE && !buffer.flush_to_fd(out_fd)) {
+            return false;
+        }
+    }
+    return buffer.flush_to_fd(out_fd);
+}
+
+/// Creates a temporary file from the given template, and returns its fd, or -1 on failure.
+static int create_temporary_history_file(const wcstring &name_template, wcstring *out_name) {
+    // Try to create a temporary file, up to 10 times. We don't use mkstemps because we want to
+    // open it CLO_EXEC. This should almost always succeed on the first try.
+    int out_fd = -1;
+    for (size_t attempt = 0; attempt < 10 && out_fd == -1; attempt++) {
+        char *narrow_str = wcs2str(name_template.c_str());
+#if HAVE_MKOSTEMP
+        out_fd = mkostemp(narrow_str, O_CLOEXEC);
+        if (out_fd >= 0) {
+            *out_name = str2wcstring(narrow_str);
+        }
+#else
+        if (narrow_str && mktemp(narrow_str)) {
+            // It was successfully templated; try opening it atomically.
+            *out_name = str2wcstring(narrow_str);
+            out_fd = wopen_cloexec(*out_name, O_WRONLY | O_CREAT | O_EXCL | O_TRUNC, 0600);
+        }
+#endif
+        free(narrow_str);
+    }
+    return out_fd;
+}
+
+/// Moves a temporary file written by a vacuum into place as the history file.
+static bool replace_history_file(int tmp_fd, const wcstring &tmp_name, const wcstring &new_name) {
+    // Ensure we maintain the ownership and permissions of the original (#2355). If the stat fails,
+    // we assume (hope) our default permissions are correct. This corresponds to e.g. someone
+    // running sudo -E as the very first command. If they did, it would be tricky to set the
+    // permissions correctly. (bash doesn't get this case right either).
+    struct stat sbuf;
+    if (wstat(new_name, &sbuf) >= 0) {  // success
+        if (fchown(tmp_fd, sbuf.st_uid, sbuf.st_gid) == -1) {
+            debug(2, L"Error %d when changing ownership of history file", errno);
+        }
+        if (fchmod(tmp_fd, sbuf.st_mode) == -1) {
+            debug(2, L"Error %d when changing mode of history file", errno);
+        }
+    }
+
+    if (wrename(tmp_name, new_name) == -1) {
+        debug(2, L"Error %d when renaming history file", errno);
+        return false;
+    }
+    return true;
+}
+
 bool history_t::save_internal_via_rewrite() {
     // This must be called while locked.
     ASSERT_IS_LOCKED(lock);
@@ -1175,132 +1489,39 @@ bool history_t::save_internal_via_rewrite() {
 
     wcstring tmp_name_template = history_filename(name, L".XXXXXX");
     if (!tmp_name_template.empty()) {
-        // Make an LRU cache to save only the last N elements.
-        history_lru_cache_t lru(HISTORY_SAVE_MAX);
-
-        // Insert old items in, from old to new. Merge them with our new items, inserting items with
-        // earlier timestamps first.
-        history_item_list_t::const_iterator new_item_iter = new_items.begin();
-
         // Map in existing items (which may have changed out from underneath us, so don't trust our
         // old mmap'd data).
         const char *local_mmap_start = NULL;
         size_t local_mmap_size = 0;
-        if (map_file(name, &local_mmap_start, &local_mmap_size, NULL)) {
-            const history_file_type_t local_mmap_type =
-                infer_file_type(local_mmap_start, local_mmap_size);
-            size_t cursor = 0;
-            for (;;) {
-                size_t offset = offset_of_next_item(local_mmap_start, local_mmap_size,
-                                                    local_mmap_type, &cursor, 0);
-                // If we get back -1, we're done.
-                if (offset == (size_t)-1) break;
-
-                // Try decoding an old item.
-                const history_item_t old_item = decode_item(
-                    local_mmap_start + offset, local_mmap_size - offset, local_mmap_type);
-                if (old_item.empty() || deleted_items.count(old_item.str()) > 0) {
-                    //                    debug(0, L"Item is deleted : %s\n",
-                    //                    old_item.str().c_str());
-                    continue;
-                }
-                // The old item may actually be more recent than our new item, if it came from
-                // another session. Insert all new items at the given index with an earlier
-                // timestamp.
-                for (; new_item_iter != new_items.end(); ++new_item_iter) {
-                    if (new_item_iter->timestamp() < old_item.timestamp()) {
-                        // This "new item" is in fact older.
-                        lru.add_item(*new_item_iter);
-                    } else {
-                        // The new item is not older.
-                        break;
-                    }
-                }
-
-                // Now add this old item.
-                lru.add_item(old_item);
-            }
-            munmap((void *)local_mmap_start, local_mmap_size);
-        }
-
-        // Insert any remaining new items.
-        for (; new_item_iter != new_items.end(); ++new_item_iter) {
-            lru.add_item(*new_item_iter);
+        if (!map_file(name, &local_mmap_start, &local_mmap_size, NULL)) {
+            local_mmap_start = NULL;
+            local_mmap_size = 0;
         }
 
         signal_block();
 
-        // Try to create a temporary file, up to 10 times. We don't use mkstemps because we want to
-        // open it CLO_EXEC. This should almost always succeed on the first try.
-        int out_fd = -1;
         wcstring tmp_name;
-        for (size_t attempt = 0; attempt < 10 && out_fd == -1; attempt++) {
-            char *narrow_str = wcs2str(tmp_name_template.c_str());
-#if HAVE_MKOSTEMP
-            out_fd = mkostemp(narrow_str, O_CLOEXEC);
-            if (out_fd >= 0) {
-                tmp_name = str2wcstring(narrow_str);
-            }
-#else
-            if (narrow_str && mktemp(narrow_str)) {
-                // It was successfully templated; try opening it atomically.
-                tmp_name = str2wcstring(narrow_str);
-                out_fd = wopen_cloexec(tmp_name, O_WRONLY | O_CREAT | O_EXCL | O_TRUNC, 0600);
-            }
-#endif
-            free(narrow_str);
-        }
-
+        int out_fd = create_temporary_history_file(tmp_name_template, &tmp_name);
         if (out_fd >= 0) {
-            // Write them out.
-            bool errored = false;
-            history_output_buffer_t buffer;
-            for (history_lru_cache_t::iterator iter = lru.begin(); iter != lru.end(); ++iter) {
-                const history_lru_node_t *node = *iter;
-                append_yaml_to_buffer(node->key, node->timestamp, node->required_paths, &buffer);
-                if (buffer.output_size() >= HISTORY_OUTPUT_BUFFER_SIZE &&
-                    !buffer.flush_to_fd(out_fd)) {
-                    errored = true;
-                    break;
-                }
-            }
-
-            if (!errored && buffer.flush_to_fd(out_fd)) {
+            // Write them out. Our new items that are already written are in the file.
+            if (write_vacuumed_history(local_mmap_start, local_mmap_size, deleted_items,
+                                       new_items, first_unwritten_new_item_index, out_fd)) {
                 ok = true;
             }
 
             if (!ok) {
                 // This message does not have high enough priority to be shown by default.
                 debug(2, L"Error when writing history file");
+                wunlink(tmp_name);
             } else {
-                wcstring new_name = history_filename(name, wcstring());
-
-                // Ensure we maintain the ownership and permissions of the original (#2355). If the
-                // stat fails, we assume (hope) our default permissions are correct. This
-                // corresponds to e.g. someone running sudo -E as the very first command. If they
-                // did, it would be tricky to set the permissions correctly. (bash doesn't get this
-                // case right either).
-                struct stat sbuf;
-                if (wstat(new_name, &sbuf) >= 0) {  // success
-                    if (fchown(out_fd, sbuf.st_uid, sbuf.st_gid) == -1) {
-                        debug(2, L"Error %d when changing ownership of history file", errno);
-                    }
-                    if (fchmod(out_fd, sbuf.st_mode) == -1) {
-                        debug(2, L"Error %d when changing mode of history file", errno);
-                    }
-                }
-
-                if (wrename(tmp_name, new_name) == -1) {
-                    debug(2, L"Error %d when renaming history file", errno);
-                }
+                replace_history_file(out_fd, tmp_name, history_filename(name, wcstring()));
             }
             close(out_fd);
         }
 
         signal_unblock();
 
-        // Make sure we clear all nodes, since this doesn't happen automatically.
-        lru.evict_all_nodes();
+        if (local_mmap_start != NULL) munmap((void *)local_mmap_start, local_mmap_size);
     }
 
     if (ok) {
@@ -1318,6 +1539,97 @@ bool history_t::save_internal_via_rewrite() {
     return ok;
 }
 
+/// Whether a background vacuum is running. We only run one at a time.
+static bool s_vacuum_in_progress = false;
+static mutex_lock_t s_vacuum_lock;
+
+/// What a background vacuum needs to know. It does not touch the history_t itself.
+struct history_vacuum_context_t {
+    wcstring path;
+    wcstring tmp_name_template;
+    history_vacuum_context_t(const wcstring &p, const wcstring &t) : path(p), tmp_name_template(t) {}
+};
+
+/// Vacuums a history file that other shells, and our own history_t, may be appending to. The file
+/// is only locked at the end, to pick up anything appended while we were working and move the new
+/// file into place.
+static bool vacuum_history_file(const wcstring &path, const wcstring &tmp_name_template) {
+    int fd = wopen_cloexec(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    // Take a read lock so we don't see a partial append, as in history_t::map_file.
+    bool ok = false;
+    history_file_lock(fd, LOCK_SH);
+    off_t len = lseek(fd, 0, SEEK_END);
+    const char *map_start = NULL;
+    if (len > 0) {
+        void *mapped = mmap(0, (size_t)len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) map_start = (const char *)mapped;
+    }
+    history_file_lock(fd, LOCK_UN);
+
+    wcstring tmp_name;
+    int tmp_fd = map_start ? create_temporary_history_file(tmp_name_template, &tmp_name) : -1;
+    if (tmp_fd >= 0) {
+        const std::set<wcstring> no_deleted_items;
+        const history_item_list_t no_new_items;
+        ok = write_vacuumed_history(map_start, (size_t)len, no_deleted_items, no_new_items, 0,
+                                    tmp_fd);
+    }
+    if (map_start != NULL) munmap((void *)map_start, (size_t)len);
+
+    if (ok) {
+        history_file_lock(fd, LOCK_EX);
+
+        // If the file was removed or replaced while we worked, our copy is stale.
+        struct stat fd_buf, path_buf;
+        ok = fstat(fd, &fd_buf) == 0 && wstat(path, &path_buf) == 0 &&
+             fd_buf.st_dev == path_buf.st_dev && fd_buf.st_ino == path_buf.st_ino;
+
+        // Copy over anything that was appended while we worked. It may hold duplicates, which the
+        // next vacuum will take care of.
+        off_t pos = len;
+        char buff[4096];
+        while (ok && pos < fd_buf.st_size) {
+            ssize_t amt = pread(fd, buff, sizeof buff, pos);
+            ok = amt > 0 && write_loop(tmp_fd, buff, (size_t)amt) >= 0;
+            pos += amt;
+        }
+
+        if (ok) ok = replace_history_file(tmp_fd, tmp_name, path);
+        history_file_lock(fd, LOCK_UN);
+    }
+    if (tmp_fd >= 0) {
+        if (!ok) wunlink(tmp_name);
+        close(tmp_fd);
+    }
+    close(fd);
+    return ok;
+}
+
+static int threaded_vacuum_history(history_vacuum_context_t *ctx) {
+    ASSERT_IS_BACKGROUND_THREAD();
+    bool ok = vacuum_history_file(ctx->path, ctx->tmp_name_template);
+    delete ctx;
+
+    scoped_lock locker(s_vacuum_lock);
+    s_vacuum_in_progress = false;
+    return ok;
+}
+
+void history_t::vacuum_in_background() {
+    ASSERT_IS_LOCKED(lock);
+    wcstring path = history_filename(name, wcstring());
+    wcstring tmp_name_template = history_filename(name, L".XXXXXX");
+    if (path.empty() || tmp_name_template.empty()) return;
+
+    scoped_lock locker(s_vacuum_lock);
+    if (s_vacuum_in_progress) return;
+    s_vacuum_in_progress = true;
+    iothread_perform(threaded_vacuum_history,
+                     new history_vacuum_context_t(path, tmp_name_template));
+}
+
 bool history_t::save_internal_via_appending() {
     // This must be called while locked.
     ASSERT_IS_LOCKED(lock);
@@ -1335,21 +1647,35 @@ bool history_t::save_internal_via_appending() {
 
     signal_block();
 
-    // Open the file.
-    int out_fd = wopen_cloexec(history_path, O_WRONLY | O_APPEND);
-    if (out_fd >= 0) {
-        // Check to see if the file changed.
-        if (file_id_for_fd(out_fd) != mmap_file_id) file_changed = true;
-
-        // Exclusive lock on the entire file. This is released when we close the file (below). This
-        // may fail on (e.g.) lockless NFS. If so, proceed as if it did not fail; the risk is that
-        // we may get interleaved history items, which is considered better than no history, or
-        // forcing everything through the slow copy-move mode. We try to minimize this possibility
-        // by writing with O_APPEND.
-        //
+    // Open the file, and take an exclusive lock on it. The lock is released when we close the file
+    // (below). This may fail on (e.g.) lockless NFS. If so, proceed as if it did not fail; the risk
+    // is that we may get interleaved history items, which is considered better than no history, or
+    // forcing everything through the slow copy-move mode. We try to minimize this possibility by
+    // writing with O_APPEND.
+    //
+    // If a vacuum moved a new file into place while we waited for the lock, anything we append to
+    // the old one would be lost, so try again with the new one.
+    int out_fd = -1;
+    for (int attempt = 0; attempt < 3; attempt++) {
+        out_fd = wopen_cloexec(history_path, O_WRONLY | O_APPEND);
+        if (out_fd < 0) break;
+
         // Simulate a failing lock in chaos_mode
         if (!chaos_mode) history_file_lock(out_fd, LOCK_EX);
 
+        struct stat fd_buf, path_buf;
+        if (fstat(out_fd, &fd_buf) != 0 || wstat(history_path, &path_buf) != 0 ||
+            (fd_buf.st_dev == path_buf.st_dev && fd_buf.st_ino == path_buf.st_ino)) {
+            break;
+        }
+        close(out_fd);
+        out_fd = -1;
+    }
+    if (out_fd >= 0) {
+        // Check to see if the file changed. Appends don't count, since what we've read is
+        // unaffected by them.
+        if (!history_same_file(file_id_for_fd(out_fd), mmap_file_id)) file_changed = true;
+
         // We (hopefully successfully) took the exclusive lock. Append to the file.
         // Note that this is sketchy for a few reasons:
         //   - Another shell may have appended its own items with a later timestamp, so our file may
@@ -1415,13 +1741,16 @@ void history_t::save_internal(bool vacuum) {
     // Try saving. If we have items to delete, we have to rewrite the file. If we do not, we can
     // append to it.
     bool ok = false;
-    if (!vacuum && deleted_items.empty()) {
+    if (deleted_items.empty()) {
         // Try doing a fast append.
         ok = save_internal_via_appending();
     }
     if (!ok) {
-        // We did not or could not append; rewrite the file ("vacuum" it).
+        // We could not append; rewrite the file ("vacuum" it).
         this->save_internal_via_rewrite();
+    } else if (vacuum) {
+        // Our items are safely in the file, so we can leave vacuuming it to a background thread.
+        this->vacuum_in_background();
     }
 }
 
@@ -1630,10 +1959,9 @@ void history_t::populate_from_bash(FILE *stream) {
 
 void history_t::incorporate_external_changes() {
     // To incorporate new items, we simply update our timestamp to now, so that items from previous
-    // instances get added. We then clear the file state so that we remap the file. Note that this
-    // is somehwhat expensive because we will be going back over old items. An optimization would be
-    // to preserve old_item_offsets so that they don't have to be recomputed. (However, then items
-    // *deleted* in other instances would not show up here).
+    // instances get added. We then remap the file. If it has only been appended to, we keep the
+    // old_item_offsets we have and just read the new items at the end. Items *deleted* in other
+    // instances are removed by rewriting the file, which we notice and reread it all.
     time_t new_timestamp = time(NULL);
     scoped_lock locker(lock);
 
@@ -1641,7 +1969,6 @@ void history_t::incorporate_external_changes() {
     // we only do work if time has progressed. This also makes multiple calls cheap.
     if (new_timestamp > this->boundary_timestamp) {
         this->boundary_timestamp = new_timestamp;
-        this->clear_file_state();
 
         // We also need to erase new_items, since we go through those first, and that means we
         // will not properly interleave them with items from other instances.
@@ -1649,6 +1976,9 @@ void history_t::incorporate_external_changes() {
         this->save_internal(false);
         this->new_items.clear();
         this->first_unwritten_new_item_index = 0;
+
+        // Usually the file has only been appended to, so we just read the new part.
+        if (!this->incorporate_file_tail()) this->clear_file_state();
     }
 }
 
@@ -1663,7 +1993,11 @@ void history_collection_t::save() {
     }
 }
 
-void history_destroy() { histories.save(); }
+void history_destroy() {
+    // Let any background vacuum finish, rather than leave its temporary file behind.
+    iothread_drain_all();
+    histories.save();
+}
 
 void history_sanity_check() {
     // No sanity checking implemented yet...
@@ -1698,24 +2032,151 @@ bool file_detection_context_t::paths_are_valid(const path_list_t &paths) {
 file_detection_context_t::file_detection_context_t(history_t *hist, history_identifier_t ident)
     : history(hist), working_directory(env_get_pwd_slash()), history_item_identifier(ident) {}
 
-static int threaded_perform_file_detection(file_detection_context_t *ctx) {
+/// How long, in seconds, we trust whether a path was valid before checking it again.
+#define FILE_DETECTION_VERDICT_LIFETIME 2.0
+
+/// Number of paths whose validity we remember.
+#define FILE_DETECTION_VERDICT_CACHE_SIZE 1024
+
+/// Whether a path was valid, keyed by the path resolved against the working directory.
+class file_detection_verdict_node_t : public lru_node_t {
+   public:
+    bool valid;
+    double when;
+
+    file_detection_verdict_node_t(const wcstring &key, bool valid_, double when_)
+        : lru_node_t(key), valid(valid_), when(when_) {}
+};
+
+class file_detection_verdict_cache_t : public lru_cache_t<file_detection_verdict_node_t> {
+   protected:
+    virtual void node_was_evicted(file_detection_verdict_node_t *node) { delete node; }
+
+   public:
+    file_detection_verdict_cache_t()
+        : lru_cache_t<file_detection_verdict_node_t>(FILE_DETECTION_VERDICT_CACHE_SIZE) {}
+};
+
+/// History items waiting for file detection. Rather than a job per item, a single iothread job
+/// works through them in batches, so pasting many commands that mention the same paths only checks
+/// each path once.
+struct file_detection_queue_t {
+    mutex_lock_t lock;
+    /// Items waiting to be checked.
+    std::vector<file_detection_context_t *> pending;
+    /// Items that have been checked, waiting to be applied on the main thread.
+    std::vector<file_detection_context_t *> done;
+    /// Whether a job is working through pending.
+    bool job_running;
+    file_detection_stats_t stats;
+    /// Recent verdicts. Only touched by the running job.
+    file_detection_verdict_cache_t verdicts;
+
+    file_detection_queue_t() : job_running(false) {
+        stats.stats_issued = 0;
+        stats.stats_avoided = 0;
+    }
+};
+static file_detection_queue_t s_file_detection_queue;
+
+/// Checks every path of a history item, reusing recent verdicts. Returns the number of paths that
+/// had to be checked.
+static unsigned long detect_files_with_verdicts(file_detection_context_t *ctx,
+                                                file_detection_verdict_cache_t *verdicts) {
+    unsigned long issued = 0;
+    const double now = timef();
+    ctx->valid_paths.clear();
+    for (size_t i = 0; i < ctx->potential_paths.size(); i++) {
+        const wcstring &path = ctx->potential_paths.at(i);
+        // The working directory ends with a slash.
+        const wcstring key = string_prefixes_string(L"/", path) ? path : ctx->working_directory + path;
+        file_detection_verdict_node_t *verdict = verdicts->get_node(key);
+        if (verdict == NULL || now - verdict->when > FILE_DETECTION_VERDICT_LIFETIME) {
+            bool valid = path_is_valid(path, ctx->working_directory);
+            issued++;
+            if (verdict == NULL) {
+                verdict = new file_detection_verdict_node_t(key, valid, now);
+                verdicts->add_node(verdict);
+            } else {
+                verdict->valid = valid;
+                verdict->when = now;
+            }
+        }
+        if (verdict->valid) {
+            // Push the original (possibly relative) path.
+            ctx->valid_paths.push_back(path);
+        }
+    }
+    return issued;
+}
+
+static int threaded_perform_file_detection(file_detection_queue_t *queue) {
     ASSERT_IS_BACKGROUND_THREAD();
-    assert(ctx != NULL);
-    return ctx->perform_file_detection(true /* test all */);
+    std::vector<file_detection_context_t *> batch;
+    for (;;) {
+        {
+            scoped_lock locker(queue->lock);
+            queue->done.insert(queue->done.end(), batch.begin(), batch.end());
+            batch.clear();
+            if (queue->pending.empty()) {
+                queue->job_running = false;
+                break;
+            }
+            batch.swap(queue->pending);
+        }
+
+        unsigned long paths = 0, issued = 0;
+        for (size_t i = 0; i < batch.size(); i++) {
+            paths += batch.at(i)->potential_paths.size();
+            issued += detect_files_with_verdicts(batch.at(i), &queue->verdicts);
+        }
+
+        scoped_lock locker(queue->lock);
+        queue->stats.stats_issued += issued;
+        queue->stats.stats_avoided += paths - issued;
+    }
+    return 0;
 }
 
-static void perform_file_detection_done(file_detection_context_t *ctx, int success) {
+static void perform_file_detection_done(file_detection_queue_t *queue, int success) {
     UNUSED(success);
     ASSERT_IS_MAIN_THREAD();
 
-    // Now that file detection is done, update the history item with the valid file paths.
-    ctx->history->set_valid_file_paths(ctx->valid_paths, ctx->history_item_identifier);
+    std::vector<file_detection_context_t *> done;
+    {
+        scoped_lock locker(queue->lock);
+        done.swap(queue->done);
+    }
+
+    for (size_t i = 0; i < done.size(); i++) {
+        file_detection_context_t *ctx = done.at(i);
 
-    // Allow saving again.
-    ctx->history->enable_automatic_saving();
+        // Now that file detection is done, update the history item with the valid file paths.
+        ctx->history->set_valid_file_paths(ctx->valid_paths, ctx->history_item_identifier);
 
-    // Done with the context.
-    delete ctx;
+        // Allow saving again.
+        ctx->history->enable_automatic_saving();
+
+        // Done with the context.
+        delete ctx;
+    }
+}
+
+/// Queues a history item for file detection, starting a job to work through the queue if there
+/// isn't one.
+static void queue_file_detection(file_detection_context_t *ctx) {
+    file_detection_queue_t *queue = &s_file_detection_queue;
+    scoped_lock locker(queue->lock);
+    queue->pending.push_back(ctx);
+    if (!queue->job_running) {
+        queue->job_running = true;
+        iothread_perform(threaded_perform_file_detection, perform_file_detection_done, queue);
+    }
+}
+
+file_detection_stats_t file_detection_get_stats() {
+    scoped_lock locker(s_file_detection_queue.lock);
+    return s_file_detection_queue.stats;
 }
 
 static bool string_could_be_path(const wcstring &potential_path) {
@@ -1781,7 +2242,7 @@ void history_t::add_pending_with_file_detection(const wcstring &str) {
 
         // Kick it off. Even though we haven't added the item yet, it updates the item on the main
         // thread, so we can't race.
-        iothread_perform(threaded_perform_file_detection, perform_file_detection_done, context);
+        queue_file_detection(context);
     }
 
     // Actually add the item to the history.
@@ -27,13 +27,16 @@ struct io_streams_t;
 // 2. A history file may be re-written ("vacuumed"). This involves reading in the file and writing a
 // new one, while performing maintenance tasks: discarding items in an LRU fashion until we reach
 // the desired maximum count, removing duplicates, and sorting them by timestamp (eventually, not
-// implemented yet). The new file is atomically moved into place via rename().
+// implemented yet). The new file is atomically moved into place via rename(). Periodic vacuums
+// run on a background thread. They take the write lock only at the end, to copy over anything that
+// was appended in the meantime and rename the new file into place.
 //
 // 3. History files are mapped in via mmap(). Before the file is mapped, the file takes a fcntl read
 // lock. The purpose of this lock is to avoid seeing a transient state where partial data has been
 // written to the file.
 //
-// 4. History is appended to under a fcntl write lock.
+// 4. History is appended to under a fcntl write lock. After taking the lock, we check that the file
+// we opened is still the history file, since it may have been vacuumed in the meantime.
 //
 // 5. The chaos_mode boolean can be set to true to do things like lower buffer sizes which can
 // trigger race conditions. This is useful for testing.
@@ -59,9 +62,12 @@ class history_item_t {
     // Attempts to merge two compatible history items together.
     bool merge(const history_item_t &item);
 
-    // The actual contents of the entry.
-    wcstring contents;        // value as entered by the user
-    wcstring contents_lower;  // value normalized to all lowercase for case insensitive comparisons
+    // The actual contents of the entry, as entered by the user. Nearly all commands are plain
+    // ASCII, and those are stored one byte per character in narrow_contents. Anything else is
+    // stored in wide_contents, and narrow_contents is left empty. Case insensitive comparisons
+    // lowercase the characters as they go, rather than keeping a lowercase copy.
+    std::string narrow_contents;
+    wcstring wide_contents;
 
     // Original creation time for the entry.
     time_t creation_timestamp;
@@ -75,10 +81,9 @@ class history_item_t {
    public:
     explicit history_item_t(const wcstring &str, time_t when = 0, history_identifier_t ident = 0);
 
-    const wcstring &str() const { return contents; }
-    const wcstring &str_lower() const { return contents_lower; }
+    wcstring str() const;
 
-    bool empty() const { return contents.empty(); }
+    bool empty() const { return narrow_contents.empty() && wide_contents.empty(); }
 
     // Whether our contents matches a search term.
     bool matches_search(const wcstring &term, enum history_search_type_t type,
@@ -90,7 +95,8 @@ class history_item_t {
     void set_required_paths(path_list_t paths) { required_paths = paths; }
 
     bool operator==(const history_item_t &other) const {
-        return contents == other.contents && creation_timestamp == other.creation_timestamp &&
+        return narrow_contents == other.narrow_contents && wide_contents == other.wide_contents &&
+               creation_timestamp == other.creation_timestamp &&
                required_paths == other.required_paths;
     }
 };
@@ -151,6 +157,9 @@ class history_t {
     // The file ID of the file we mmap'd.
     file_id_t mmap_file_id;
 
+    // How far into our mmap data populate_from_mmap has read.
+    size_t mmap_scan_cursor;
+
     // The boundary timestamp distinguishes old items from new items. Items whose timestamps are <=
     // the boundary are considered "old". Items whose timestemps are > the boundary are new, and are
     // ignored by this instance (unless they came from this instance). The timestamp may be adjusted
@@ -160,12 +169,20 @@ class history_t {
     // How many items we add until the next vacuum. Initially a random value.
     int countdown_to_vacuum;
 
-    // Figure out the offsets of our mmap data.
+    // Figure out the offsets of our mmap data, starting where we left off.
     void populate_from_mmap(void);
 
+    // Remaps the file after other shells have appended to it, and reads just the new items. Returns
+    // false if the file was rewritten instead, in which case we need to read all of it again.
+    bool incorporate_file_tail();
+
     // List of old items, as offsets into out mmap data.
     std::deque<size_t> old_item_offsets;
 
+    // Offsets of items in our mmap data that were skipped because they are newer than our boundary
+    // timestamp. Some of them may become old items when the boundary moves.
+    std::vector<size_t> newer_item_offsets;
+
     // Whether we've loaded old items.
     bool loaded_old;
 
@@ -184,6 +201,9 @@ class history_t {
     // Saves history by appending to the file.
     bool save_internal_via_appending();
 
+    // Vacuums the file on a background thread, unless a vacuum is already running.
+    void vacuum_in_background();
+
     // Saves history.
     void save_internal(bool vacuum);
 
@@ -253,6 +273,10 @@ class history_t {
     // environment variable. This may be long!
     void get_string_representation(wcstring *result, const wcstring &separator);
 
+    // Gets the first max_count items of the same list, newest first, stopping as soon as it has
+    // them. This lets $history[1] avoid decoding the whole history.
+    void get_history(wcstring_list_t *result, size_t max_count);
+
     // Sets the valid file paths for the history item with the given identifier.
     void set_valid_file_paths(const wcstring_list_t &valid_file_paths, history_identifier_t ident);
 
@@ -277,6 +301,12 @@ class history_search_t {
     typedef std::pair<size_t, history_item_t> prev_match_t;
     std::vector<prev_match_t> prev_matches;
 
+    // The strings of prev_matches, for quickly skipping duplicates.
+    std::set<wcstring> prev_match_strings;
+
+    // The index that go_backwards() starts after when there are no previous matches.
+    size_t start_index;
+
     // Returns yes if a given term is in prev_matches.
     bool match_already_made(const wcstring &match) const;
 
@@ -313,11 +343,23 @@ class history_search_t {
     // Returns the current search result item contents. asserts if there is no current item.
     wcstring current_string(void) const;
 
+    // Returns the index in history of the current search result. asserts if there is no current
+    // item.
+    size_t current_index(void) const;
+
+    // Skips the items more recent than the given index, so the next go_backwards() from the end
+    // starts with the item at that index. This lets a search resume where an earlier one left off.
+    void skip_to_index(size_t idx);
+
     // Constructor.
     history_search_t(history_t &hist, const wcstring &str,
                      enum history_search_type_t type = HISTORY_SEARCH_TYPE_CONTAINS,
                      bool case_sensitive = true)
-        : history(&hist), term(str), search_type(type), case_sensitive(case_sensitive) {
+        : history(&hist),
+          term(str),
+          search_type(type),
+          case_sensitive(case_sensitive),
+          start_index(0) {
         if (!case_sensitive) {
             term = wcstring();
             for (wcstring::const_iterator it = str.begin(); it != str.end(); ++it) {
@@ -328,7 +370,11 @@ class history_search_t {
 
     // Default constructor.
     history_search_t()
-        : history(), term(), search_type(HISTORY_SEARCH_TYPE_CONTAINS), case_sensitive(true) {}
+        : history(),
+          term(),
+          search_type(HISTORY_SEARCH_TYPE_CONTAINS),
+          case_sensitive(true),
+          start_index(0) {}
 };
 
 // Init history library. The history file won't actually be loaded until the first time a history
@@ -371,4 +417,15 @@ struct file_detection_context_t {
     // Determine whether the given paths are all valid.
     bool paths_are_valid(const path_list_t &paths);
 };
+
+// How much work file detection for new history items has done.
+struct file_detection_stats_t {
+    // Number of paths checked on the file system.
+    unsigned long stats_issued;
+    // Number of paths whose recent verdict was reused instead.
+    unsigned long stats_avoided;
+};
+
+// Returns how much work file detection for new history items has done.
+file_detection_stats_t file_detection_get_stats();
 #endif
@@ -21,8 +21,10 @@
 #endif
 
 #include <algorithm>
+#include <map>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "common.h"
@@ -122,7 +124,8 @@ static const wchar_t *const name_arr[] = {L"beginning-of-line",
                                           L"forward-jump",
                                           L"backward-jump",
                                           L"and",
-                                          L"cancel"};
+                                          L"cancel",
+                                          L"begin-paste"};
 
 wcstring describe_char(wint_t c) {
     wint_t initial_cmd_char = R_BEGINNING_OF_LINE;
@@ -186,11 +189,36 @@ static const wchar_t code_arr[] = {R_BEGINNING_OF_LINE,
                                    R_FORWARD_JUMP,
                                    R_BACKWARD_JUMP,
                                    R_AND,
-                                   R_CANCEL};
+                                   R_CANCEL,
+                                   R_BEGIN_PASTE};
 
 /// Mappings for the current input mode.
 static std::vector<input_mapping_t> mapping_list;
 
+/// Marker for a trie node that does not complete a mapping.
+#define INPUT_TRIE_NO_MAPPING ((size_t)-1)
+
+/// A node in the trie of mapping sequences for a bind mode.
+struct input_trie_node_t {
+    /// Index in mapping_list of the mapping whose sequence ends at this node, or
+    /// INPUT_TRIE_NO_MAPPING. At the root, this is the generic (empty sequence) mapping.
+    size_t mapping_idx;
+    /// Child nodes, as (character, node index) pairs sorted by character.
+    std::vector<std::pair<wchar_t, size_t> > children;
+
+    input_trie_node_t() : mapping_idx(INPUT_TRIE_NO_MAPPING) {}
+};
+
+/// The trie for a bind mode, stored as a list of nodes with the root first.
+typedef std::vector<input_trie_node_t> input_trie_t;
+
+/// Tries of the mappings in mapping_list, by bind mode. These let us find the longest mapping
+/// matching the input in one pass over it, rather than trying every mapping in turn.
+static std::map<wcstring, input_trie_t> mapping_tries;
+
+/// Set when mapping_list changes, so the tries are rebuilt before they are next used.
+static bool mapping_tries_stale = true;
+
 /// Terminfo map list.
 static std::vector<terminfo_mapping_t> terminfo_mappings;
 
@@ -232,21 +260,43 @@ static int input_function_arity(int function) {
 /// Sets the return status of the most recently executed input function.
 void input_function_set_status(bool status) { input_function_status = status; }
 
-/// Helper function to compare the lengths of sequences.
-static bool length_is_greater_than(const input_mapping_t &m1, const input_mapping_t &m2) {
-    return m1.seq.size() > m2.seq.size();
-}
-
 static bool specification_order_is_less_than(const input_mapping_t &m1, const input_mapping_t &m2) {
     return m1.specification_order < m2.specification_order;
 }
 
-/// Inserts an input mapping at the correct position. We sort them in descending order by length, so
-/// that we test longer sequences first.
-static void input_mapping_insert_sorted(const input_mapping_t &new_mapping) {
-    std::vector<input_mapping_t>::iterator loc = std::lower_bound(
-        mapping_list.begin(), mapping_list.end(), new_mapping, length_is_greater_than);
-    mapping_list.insert(loc, new_mapping);
+/// Returns the child of the given trie node for the given character, or INPUT_TRIE_NO_MAPPING.
+static size_t input_trie_child(const input_trie_t &trie, size_t node, wchar_t c) {
+    const std::vector<std::pair<wchar_t, size_t> > &children = trie.at(node).children;
+    std::vector<std::pair<wchar_t, size_t> >::const_iterator iter = std::lower_bound(
+        children.begin(), children.end(), std::make_pair(c, (size_t)0));
+    if (iter == children.end() || iter->first != c) return INPUT_TRIE_NO_MAPPING;
+    return iter->second;
+}
+
+/// Rebuilds the mapping tries from mapping_list.
+static void input_mapping_tries_rebuild() {
+    mapping_tries.clear();
+    for (size_t i = 0; i < mapping_list.size(); i++) {
+        const input_mapping_t &m = mapping_list.at(i);
+        input_trie_t &trie = mapping_tries[m.mode];
+        if (trie.empty()) trie.push_back(input_trie_node_t());
+
+        size_t node = 0;
+        for (size_t j = 0; j < m.seq.size(); j++) {
+            const wchar_t c = m.seq.at(j);
+            size_t child = input_trie_child(trie, node, c);
+            if (child == INPUT_TRIE_NO_MAPPING) {
+                child = trie.size();
+                trie.push_back(input_trie_node_t());
+                std::vector<std::pair<wchar_t, size_t> > &children = trie.at(node).children;
+                const std::pair<wchar_t, size_t> entry(c, child);
+                children.insert(std::lower_bound(children.begin(), children.end(), entry), entry);
+            }
+            node = child;
+        }
+        trie.at(node).mapping_idx = i;
+    }
+    mapping_tries_stale = false;
 }
 
 /// Adds an input mapping.
@@ -273,8 +323,8 @@ void input_mapping_add(const wchar_t *sequence, const wchar_t *const *commands,
     }
 
     // Add a new mapping, using the next order.
-    const input_mapping_t new_mapping = input_mapping_t(sequence, commands_vector, mode, sets_mode);
-    input_mapping_insert_sorted(new_mapping);
+    mapping_list.push_back(input_mapping_t(sequence, commands_vector, mode, sets_mode));
+    mapping_tries_stale = true;
 }
 
 void input_mapping_add(const wchar_t *sequence, const wchar_t *command, const wchar_t *mode,
@@ -476,10 +526,14 @@ static void input_mapping_execute(const input_mapping_t &m, bool allow_commands)
         // FIXME(snnw): if commands add stuff to input queue (e.g. commandline -f execute), we won't
         // see that until all other commands have also been run.
         int last_status = proc_get_last_status();
+        // The commands may run programs that read the terminal; they shouldn't get pastes
+        // bracketed for us.
+        bool bracketed_paste = reader_set_bracketed_paste(false);
         for (wcstring_list_t::const_iterator it = m.commands.begin(), end = m.commands.end();
              it != end; ++it) {
             parser_t::principal_parser().eval(it->c_str(), io_chain_t(), TOP);
         }
+        reader_set_bracketed_paste(bracketed_paste);
         proc_set_last_status(last_status);
         input_common_next_ch(R_NULL);
     } else {
@@ -491,68 +545,52 @@ static void input_mapping_execute(const input_mapping_t &m, bool allow_commands)
     input_set_bind_mode(m.sets_mode);
 }
 
-/// Try reading the specified function mapping.
-static bool input_mapping_is_match(const input_mapping_t &m) {
-    wint_t c = 0;
-    int j;
-
-    debug(2, L"trying to match mapping %ls", escape(m.seq.c_str(), ESCAPE_ALL).c_str());
-    const wchar_t *str = m.seq.c_str();
-    for (j = 0; str[j] != L'\0'; j++) {
-        bool timed = (j > 0 && iswcntrl(str[0]));
-
-        c = input_common_readch(timed);
-        if (str[j] != c) {
-            break;
-        }
-    }
-
-    if (str[j] == L'\0') {
-        // debug(0, L"matched mapping %ls (%ls)\n", escape(m.seq.c_str(), ESCAPE_ALL).c_str(),
-        // m.command.c_str());
-        // We matched the entire sequence.
-        return true;
-    }
-
-    // Reinsert the chars we read to be read again since we didn't match the bind sequence (i.e.,
-    // the input mapping).
-    input_common_next_ch(c);
-    for (int k = j - 1; k >= 0; k--) {
-        input_common_next_ch(m.seq[k]);
-    }
-
-    return false;
-}
-
 void input_queue_ch(wint_t ch) { input_common_queue_ch(ch); }
 
 static void input_mapping_execute_matching_or_generic(bool allow_commands) {
-    const input_mapping_t *generic = NULL;
+    if (mapping_tries_stale) input_mapping_tries_rebuild();
 
     const wcstring bind_mode = input_get_bind_mode();
-
-    for (size_t i = 0; i < mapping_list.size(); i++) {
-        const input_mapping_t &m = mapping_list.at(i);
-
-        // debug(0, L"trying mapping (%ls,%ls,%ls)\n", escape(m.seq.c_str(), ESCAPE_ALL).c_str(),
-        //           m.mode.c_str(), m.sets_mode.c_str());
-
-        if (m.mode != bind_mode) {
-            // debug(0, L"skipping mapping because mode %ls != %ls\n", m.mode.c_str(),
-            // input_get_bind_mode().c_str());
-            continue;
+    std::map<wcstring, input_trie_t>::const_iterator trie_iter = mapping_tries.find(bind_mode);
+    if (trie_iter == mapping_tries.end()) {
+        debug(2, L"no mappings in mode %ls, ignoring char...", bind_mode.c_str());
+        wchar_t c = input_common_readch(0);
+        if (c == R_EOF) {
+            input_common_next_ch(c);
         }
-
-        if (m.seq.length() == 0) {
-            generic = &m;
-        } else if (input_mapping_is_match(m)) {
-            input_mapping_execute(m, allow_commands);
-            return;
+        return;
+    }
+    const input_trie_t &trie = trie_iter->second;
+
+    // Walk the trie as far as the input takes us, remembering the longest complete sequence. If the
+    // sequence starts with a control character (typically escape), later characters are read with
+    // a timeout, so that a lone escape is not held up waiting for the rest of a sequence.
+    wcstring read;
+    size_t node = 0;
+    size_t match_idx = INPUT_TRIE_NO_MAPPING, match_len = 0;
+    while (!trie.at(node).children.empty()) {
+        bool timed = !read.empty() && iswcntrl(read.at(0));
+        wchar_t c = input_common_readch(timed);
+        read.push_back(c);
+
+        node = input_trie_child(trie, node, c);
+        if (node == INPUT_TRIE_NO_MAPPING) break;
+        if (trie.at(node).mapping_idx != INPUT_TRIE_NO_MAPPING) {
+            match_idx = trie.at(node).mapping_idx;
+            match_len = read.size();
         }
     }
 
-    if (generic) {
-        input_mapping_execute(*generic, allow_commands);
+    // Reinsert the chars we read past the end of the match, to be read again.
+    for (size_t k = read.size(); k > match_len; k--) {
+        input_common_next_ch(read.at(k - 1));
+    }
+
+    if (match_idx == INPUT_TRIE_NO_MAPPING) match_idx = trie.at(0).mapping_idx;  // generic
+    if (match_idx != INPUT_TRIE_NO_MAPPING) {
+        // Copy the mapping, since its commands may change the bindings.
+        const input_mapping_t m = mapping_list.at(match_idx);
+        input_mapping_execute(m, allow_commands);
     } else {
         debug(2, L"no generic found, ignoring char...");
         wchar_t c = input_common_readch(0);
@@ -652,6 +690,7 @@ bool input_mapping_erase(const wcstring &sequence, const wcstring &mode) {
          it != end; ++it) {
         if (sequence == it->seq && mode == it->mode) {
             mapping_list.erase(it);
+            mapping_tries_stale = true;
             result = true;
             break;
         }
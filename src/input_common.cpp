@@ -1,6 +1,7 @@
 // Implementation file for the low level input library.
 #include "config.h"
 
+#include <assert.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
@@ -237,6 +238,70 @@ void input_common_queue_ch(wint_t ch) { lookahead_push_back(ch); }
 
 void input_common_next_ch(wint_t ch) { lookahead_push_front(ch); }
 
+bool input_common_read_until(const wcstring &terminator, wcstring *result) {
+    assert(!terminator.empty());
+    const wint_t last = terminator.at(terminator.size() - 1);
+
+    // Characters the sequence matching code has already read come first.
+    while (has_lookahead()) {
+        wint_t c = lookahead_pop();
+        if (c >= R_MIN && c < R_SENTINAL) continue;
+        result->push_back(c);
+        if (c == last && string_suffixes_string(terminator, *result)) {
+            result->resize(result->size() - terminator.size());
+            return true;
+        }
+    }
+
+    // Then read straight from stdin in large chunks. Anything read past the terminator is decoded
+    // and put back for input_common_readch.
+    bool found = false;
+    mbstate_t state = {};
+    char buff[4096];
+    while (!found || !mbsinit(&state)) {
+        ssize_t amt = read(STDIN_FILENO, buff, sizeof buff);
+        if (amt < 0 && errno == EINTR && interrupt_handler) {
+            // Let ^C get us out if the end never comes, keeping what we have read.
+            int res = interrupt_handler();
+            if (res) {
+                lookahead_push_front(res);
+                return false;
+            }
+        }
+        if (amt < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+        if (amt <= 0) {
+            lookahead_push_back(R_EOF);
+            return false;
+        }
+
+        for (ssize_t i = 0; i < amt; i++) {
+            wchar_t wc;
+            if (MB_CUR_MAX == 1) {
+                wc = (unsigned char)buff[i];  // single-byte locale, all values are legal
+            } else {
+                size_t sz = mbrtowc(&wc, &buff[i], 1, &state);
+                if (sz == (size_t)(-1)) {
+                    memset(&state, '\0', sizeof(state));
+                    debug(2, L"Illegal input");
+                    continue;
+                }
+                if (sz == (size_t)(-2) || sz == 0) continue;
+            }
+
+            if (found) {
+                lookahead_push_back(wc);
+                continue;
+            }
+            result->push_back(wc);
+            if ((wint_t)wc == last && string_suffixes_string(terminator, *result)) {
+                result->resize(result->size() - terminator.size());
+                found = true;
+            }
+        }
+    }
+    return true;
+}
+
 void input_common_add_callback(void (*callback)(void *), void *arg) {
     ASSERT_IS_MAIN_THREAD();
     callback_queue.push(callback_info_t(callback, arg));
@@ -70,8 +70,9 @@ enum {
     R_BACKWARD_JUMP,
     R_AND,
     R_CANCEL,
+    R_BEGIN_PASTE,
     R_TIMEOUT,  // we didn't get interactive input within wait_on_escape_ms
-    R_MAX = R_CANCEL,
+    R_MAX = R_BEGIN_PASTE,
     // This is a special psuedo-char that is not used other than to mark the end of the the special
     // characters so we can sanity check the enum range.
     R_SENTINAL
@@ -102,6 +103,12 @@ void input_common_queue_ch(wint_t ch);
 /// once).
 void input_common_next_ch(wint_t ch);
 
+/// Read characters up to and including \c terminator, bypassing the key bindings, and append the
+/// ones before the terminator to \c result. This is used to take in pasted text in one go. Returns
+/// false if the input ended or the user interrupted reading before the terminator was seen; what
+/// was read up to then is still in \c result.
+bool input_common_read_until(const wcstring &terminator, wcstring *result);
+
 /// Adds a callback to be invoked at the next turn of the "event loop." The callback function will
 /// be invoked and passed arg.
 void input_common_add_callback(void (*callback)(void *), void *arg);
@@ -3,65 +3,155 @@
 
 #include <pthread.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 #include <wchar.h>
-#include <algorithm>
-#include <memory>
 #include <vector>
 
 #include "common.h"
 #include "fallback.h"  // IWYU pragma: keep
 #include "intern.h"
 
-/// Comparison function for intern'd strings.
-class string_table_compare_t {
+// The table of intern'd strings is a hash table split into stripes, each with its own lock, so
+// threads interning different strings rarely contend. Each stripe copies its strings into a bump
+// allocated arena, so strings are packed together and never individually freed.
+
+/// Number of stripes. Must be a power of two.
+#define INTERN_STRIPE_COUNT 16
+
+/// Initial number of hash slots per stripe. Must be a power of two.
+#define INTERN_INITIAL_SLOTS 64
+
+/// Size of each arena chunk, in characters. Strings larger than a quarter of this get a chunk of
+/// their own.
+#define INTERN_CHUNK_CHARS 1024
+
+/// FNV-1a hash of a string.
+static size_t intern_hash(const wchar_t *str) {
+    size_t hash = 2166136261u;
+    for (; *str; str++) {
+        hash ^= (size_t)*str;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+class intern_stripe_t {
+    /// Open addressed hash table of interned strings, with NULL for empty slots.
+    std::vector<const wchar_t *> slots;
+    /// Number of strings in the table.
+    size_t count;
+
+    /// Next free character in the current arena chunk, and how many characters are left in it.
+    /// Interned strings live for the life of the process, so chunks are never freed.
+    wchar_t *cursor;
+    size_t remaining;
+
+    size_t chars_used;
+    size_t chars_allocated;
+
+    /// Copies the string into the arena.
+    const wchar_t *arena_dup(const wchar_t *in, size_t len) {
+        size_t needed = len + 1;
+        wchar_t *result;
+        if (needed > INTERN_CHUNK_CHARS / 4) {
+            // Big string. Give it its own chunk, and keep allocating from the current one.
+            result = (wchar_t *)malloc(needed * sizeof(wchar_t));
+            if (result == NULL) DIE_MEM();
+            chars_allocated += needed;
+        } else {
+            if (needed > remaining) {
+                cursor = (wchar_t *)malloc(INTERN_CHUNK_CHARS * sizeof(wchar_t));
+                if (cursor == NULL) DIE_MEM();
+                remaining = INTERN_CHUNK_CHARS;
+                chars_allocated += INTERN_CHUNK_CHARS;
+            }
+            result = cursor;
+            cursor += needed;
+            remaining -= needed;
+        }
+        wmemcpy(result, in, needed);
+        chars_used += needed;
+        return result;
+    }
+
+    /// Returns the slot index holding the given string, or the empty slot where it belongs.
+    size_t find_slot(const wchar_t *in, size_t hash) const {
+        size_t mask = slots.size() - 1;
+        size_t idx = hash & mask;
+        while (slots[idx] != NULL && wcscmp(slots[idx], in) != 0) {
+            idx = (idx + 1) & mask;
+        }
+        return idx;
+    }
+
+    void grow() {
+        std::vector<const wchar_t *> old_slots(slots.size() * 2, (const wchar_t *)NULL);
+        old_slots.swap(slots);
+        for (size_t i = 0; i < old_slots.size(); i++) {
+            const wchar_t *str = old_slots[i];
+            if (str != NULL) slots[find_slot(str, intern_hash(str) / INTERN_STRIPE_COUNT)] = str;
+        }
+    }
+
    public:
-    bool operator()(const wchar_t *a, const wchar_t *b) const { return wcscmp(a, b) < 0; }
-};
+    mutex_lock_t lock;
+
+    intern_stripe_t()
+        : slots(INTERN_INITIAL_SLOTS, (const wchar_t *)NULL),
+          count(0),
+          cursor(NULL),
+          remaining(0),
+          chars_used(0),
+          chars_allocated(0) {}
 
-// A sorted vector ends up being a little more memory efficient than a std::set for the intern'd
-// string table.
-#define USE_SET 0
-#if USE_SET
-/// The table of intern'd strings.
-typedef std::set<const wchar_t *, string_table_compare_t> string_table_t;
-#else
-/// The table of intern'd strings.
-typedef std::vector<const wchar_t *> string_table_t;
-#endif
+    /// Returns the interned copy of the string, adding it if necessary. If dup is false, the string
+    /// itself is added rather than a copy. Must be called with the lock held.
+    const wchar_t *intern(const wchar_t *in, size_t hash, bool dup) {
+        ASSERT_IS_LOCKED(lock.mutex);
+        size_t idx = find_slot(in, hash);
+        if (slots[idx] != NULL) return slots[idx];
+
+        const wchar_t *result = dup ? arena_dup(in, wcslen(in)) : in;
+        slots[idx] = result;
+        count++;
+
+        // Keep the load factor under 3/4.
+        if (count * 4 > slots.size() * 3) grow();
+        return result;
+    }
 
-static string_table_t string_table;
+    /// Adds our usage to the given stats. Must be called with the lock held.
+    void add_stats(intern_stats_t *stats) const {
+        stats->string_count += count;
+        stats->table_bytes += slots.size() * sizeof(const wchar_t *);
+        stats->arena_bytes_used += chars_used * sizeof(wchar_t);
+        stats->arena_bytes_allocated += chars_allocated * sizeof(wchar_t);
+    }
+};
 
-/// The lock to provide thread safety for intern'd strings.
-static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+static intern_stripe_t intern_stripes[INTERN_STRIPE_COUNT];
 
 static const wchar_t *intern_with_dup(const wchar_t *in, bool dup) {
     if (!in) return NULL;
 
     debug(5, L"intern %ls", in);
-    scoped_lock locker(intern_lock);
-    const wchar_t *result;
-
-#if USE_SET
-    string_table_t::const_iterator iter = string_table.find(in);
-    if (iter != string_table.end()) {
-        result = *iter;
-    } else {
-        result = dup ? wcsdup(in) : in;
-        string_table.insert(result);
-    }
-#else
-    string_table_t::iterator iter =
-        std::lower_bound(string_table.begin(), string_table.end(), in, string_table_compare_t());
-    if (iter != string_table.end() && wcscmp(*iter, in) == 0) {
-        result = *iter;
-    } else {
-        result = dup ? wcsdup(in) : in;
-        string_table.insert(iter, result);
-    }
-#endif
-    return result;
+    // The low bits pick the stripe, the remaining bits the slot within it.
+    size_t hash = intern_hash(in);
+    intern_stripe_t &stripe = intern_stripes[hash & (INTERN_STRIPE_COUNT - 1)];
+    scoped_lock locker(stripe.lock);
+    return stripe.intern(in, hash / INTERN_STRIPE_COUNT, dup);
 }
 
 const wchar_t *intern(const wchar_t *in) { return intern_with_dup(in, true); }
 
 const wchar_t *intern_static(const wchar_t *in) { return intern_with_dup(in, false); }
+
+intern_stats_t intern_get_stats() {
+    intern_stats_t stats = {};
+    for (size_t i = 0; i < INTERN_STRIPE_COUNT; i++) {
+        scoped_lock locker(intern_stripes[i].lock);
+        intern_stripes[i].add_stats(&stats);
+    }
+    return stats;
+}
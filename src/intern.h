@@ -2,9 +2,14 @@
 #ifndef FISH_INTERN_H
 #define FISH_INTERN_H
 
+#include <stddef.h>
+
 /// Return an identical copy of the specified string from a pool of unique strings. If the string
 /// was not in the pool, add a copy.
 ///
+/// Interned strings are never freed, and equal strings always intern to the same pointer, so two
+/// interned strings may be compared by pointer rather than with wcscmp.
+///
 /// \param in the string to return an interned copy of.
 const wchar_t *intern(const wchar_t *in);
 
@@ -14,4 +19,19 @@ const wchar_t *intern(const wchar_t *in);
 /// \param in the string to add to the interned pool
 const wchar_t *intern_static(const wchar_t *in);
 
+/// Memory usage of the pool of interned strings.
+struct intern_stats_t {
+    /// Number of interned strings.
+    size_t string_count;
+    /// Bytes used by the hash table.
+    size_t table_bytes;
+    /// Bytes of interned string data copied into the arena.
+    size_t arena_bytes_used;
+    /// Bytes allocated for the arena, including unused space at the end of chunks.
+    size_t arena_bytes_allocated;
+};
+
+/// Return the memory usage of the pool of interned strings.
+intern_stats_t intern_get_stats();
+
 #endif
@@ -29,9 +29,6 @@ typedef std::vector<comp_t> comp_info_list_t;
 /// Minimum height to show completions
 #define PAGER_MIN_HEIGHT 4
 
-/// The maximum number of columns of completion to attempt to fit onto the screen.
-#define PAGER_MAX_COLS 6
-
 /// Width of the search field.
 #define PAGER_SEARCH_FIELD_WIDTH 12
 
@@ -180,8 +177,8 @@ line_t pager_t::completion_print_item(const wcstring &prefix, const comp_t *c, s
 /// \param prefix The string to print before each completion
 /// \param lst The list of completions to print
 void pager_t::completion_print(size_t cols, const size_t *width_by_column, size_t row_start,
-                               size_t row_stop, const wcstring &prefix, const comp_info_list_t &lst,
-                               page_rendering_t *rendering) const {
+                               size_t row_stop, const wcstring &prefix,
+                               const comp_info_ptr_list_t &lst, page_rendering_t *rendering) const {
     // Teach the rendering about the rows it printed.
     assert(row_start >= 0);
     assert(row_stop >= row_start);
@@ -197,7 +194,7 @@ void pager_t::completion_print(size_t cols, const size_t *width_by_column, size_
             if (lst.size() <= col * rows + row) continue;
 
             size_t idx = col * rows + row;
-            const comp_t *el = &lst.at(idx);
+            const comp_t *el = lst.at(idx);
             bool is_selected = (idx == effective_selected_idx);
 
             // Print this completion on its own "line".
@@ -297,23 +294,20 @@ static comp_info_list_t process_completions_into_infos(const completion_list_t &
     return result;
 }
 
-void pager_t::measure_completion_infos(comp_info_list_t *infos, const wcstring &prefix) const {
-    size_t prefix_len = fish_wcswidth(prefix.c_str());
-    for (size_t i = 0; i < infos->size(); i++) {
-        comp_t *comp = &infos->at(i);
-
-        // Compute comp_width.
-        const wcstring_list_t &comp_strings = comp->comp;
-        for (size_t j = 0; j < comp_strings.size(); j++) {
-            // If there's more than one, append the length of ', '.
-            if (j >= 1) comp->comp_width += 2;
-
-            comp->comp_width += prefix_len + fish_wcswidth(comp_strings.at(j).c_str());
-        }
+void pager_t::measure_completion_info(comp_t *comp, size_t prefix_width) const {
+    // Compute comp_width.
+    const wcstring_list_t &comp_strings = comp->comp;
+    comp->comp_width = 0;
+    for (size_t j = 0; j < comp_strings.size(); j++) {
+        // If there's more than one, append the length of ', '.
+        if (j >= 1) comp->comp_width += 2;
 
-        // Compute desc_width.
-        comp->desc_width = fish_wcswidth(comp->desc.c_str());
+        comp->comp_width += prefix_width + fish_wcswidth(comp_strings.at(j).c_str());
     }
+
+    // Compute desc_width.
+    comp->desc_width = fish_wcswidth(comp->desc.c_str());
+    comp->measured = true;
 }
 
 // Indicates if the given completion info passes any filtering we have.
@@ -344,13 +338,41 @@ bool pager_t::completion_info_passes_filter(const comp_t &info) const {
 
 // Update completion_infos from unfiltered_completion_infos, to reflect the filter.
 void pager_t::refilter_completions() {
-    this->completion_infos.clear();
-    for (size_t i = 0; i < this->unfiltered_completion_infos.size(); i++) {
-        const comp_t &info = this->unfiltered_completion_infos.at(i);
-        if (this->completion_info_passes_filter(info)) {
-            this->completion_infos.push_back(info);
+    const wcstring needle = search_field_shown ? this->search_field_line.text : wcstring();
+    const size_t old_count = this->completion_infos.size();
+    const bool rescanned = !string_prefixes_string(this->filtered_needle, needle);
+    if (!rescanned) {
+        // The filter only grew, so whatever fails the old filter fails the new one too. Narrow
+        // the list we have.
+        size_t kept = 0;
+        for (size_t i = 0; i < this->completion_infos.size(); i++) {
+            comp_t *info = this->completion_infos.at(i);
+            if (this->completion_info_passes_filter(*info)) {
+                this->completion_infos.at(kept++) = info;
+            }
         }
+        this->completion_infos.resize(kept);
+    } else {
+        this->completion_infos.clear();
+        for (size_t i = 0; i < this->unfiltered_completion_infos.size(); i++) {
+            comp_t *info = &this->unfiltered_completion_infos.at(i);
+            if (this->completion_info_passes_filter(*info)) {
+                this->completion_infos.push_back(info);
+            }
+        }
+    }
+    this->filtered_needle = needle;
+
+    // Only measure the completions that are left.
+    size_t prefix_width = fish_wcswidth(prefix.c_str());
+    for (size_t i = 0; i < this->completion_infos.size(); i++) {
+        comp_t *info = this->completion_infos.at(i);
+        if (!info->measured) measure_completion_info(info, prefix_width);
     }
+
+    // Narrowing keeps the survivors in order, so if it kept all of them our layout still holds.
+    // A rescan may pick a different set of the same size.
+    if (rescanned || this->completion_infos.size() != old_count) this->invalidate_column_widths();
 }
 
 void pager_t::set_completions(const completion_list_t &raw_completions) {
@@ -360,13 +382,44 @@ void pager_t::set_completions(const completion_list_t &raw_completions) {
     // Maybe join them.
     if (prefix == L"-") join_completions(&unfiltered_completion_infos);
 
-    // Compute their various widths.
-    measure_completion_infos(&unfiltered_completion_infos, prefix);
-
-    // Refilter them.
+    // Start out with everything, then filter them. Their widths are computed as they pass the
+    // filter.
+    completion_infos.clear();
+    completion_infos.reserve(unfiltered_completion_infos.size());
+    for (size_t i = 0; i < unfiltered_completion_infos.size(); i++) {
+        completion_infos.push_back(&unfiltered_completion_infos.at(i));
+    }
+    filtered_needle.clear();
+    this->invalidate_column_widths();
     this->refilter_completions();
 }
 
+/// Returns the preferred width of each column when completion_infos is laid out in \p cols
+/// columns.
+const std::vector<size_t> &pager_t::preferred_column_widths(size_t cols) const {
+    assert(cols > 0 && cols <= PAGER_MAX_COLS);
+    std::vector<size_t> &widths = preferred_widths_by_cols[cols - 1];
+    if (widths.empty()) {
+        const comp_info_ptr_list_t &lst = this->completion_infos;
+        const size_t row_count = divide_round_up(lst.size(), cols);
+        widths.resize(cols, 0);
+        for (size_t col = 0; col < cols; col++) {
+            for (size_t row = 0; row < row_count; row++) {
+                const size_t comp_idx = col * row_count + row;
+                if (comp_idx >= lst.size()) continue;
+                widths.at(col) = std::max(widths.at(col), lst.at(comp_idx)->preferred_width());
+            }
+        }
+    }
+    return widths;
+}
+
+void pager_t::invalidate_column_widths() {
+    for (size_t i = 0; i < PAGER_MAX_COLS; i++) {
+        preferred_widths_by_cols[i].clear();
+    }
+}
+
 void pager_t::set_prefix(const wcstring &pref) { prefix = pref; }
 
 void pager_t::set_term_size(int w, int h) {
@@ -379,8 +432,9 @@ void pager_t::set_term_size(int w, int h) {
 /// Try to print the list of completions lst with the prefix prefix using cols as the number of
 /// columns. Return true if the completion list was printed, false if the terminal is too narrow for
 /// the specified number of columns. Always succeeds if cols is 1.
-bool pager_t::completion_try_print(size_t cols, const wcstring &prefix, const comp_info_list_t &lst,
-                                   page_rendering_t *rendering, size_t suggested_start_row) const {
+bool pager_t::completion_try_print(size_t cols, const wcstring &prefix,
+                                   const comp_info_ptr_list_t &lst, page_rendering_t *rendering,
+                                   size_t suggested_start_row) const {
     assert(cols > 0);
     // The calculated preferred width of each column.
     size_t width_by_column[PAGER_MAX_COLS] = {0};
@@ -417,14 +471,9 @@ bool pager_t::completion_try_print(size_t cols, const wcstring &prefix, const co
     }
 
     // Calculate how wide the list would be.
-    for (size_t col = 0; col < cols; col++) {
-        for (size_t row = 0; row < row_count; row++) {
-            const size_t comp_idx = col * row_count + row;
-            if (comp_idx >= lst.size()) continue;
-            const comp_t &c = lst.at(comp_idx);
-            width_by_column[col] = std::max(width_by_column[col], c.preferred_width());
-        }
-    }
+    assert(&lst == &this->completion_infos);
+    const std::vector<size_t> &preferred_widths = this->preferred_column_widths(cols);
+    std::copy(preferred_widths.begin(), preferred_widths.end(), width_by_column);
 
     bool print;
     assert(cols >= 1);
@@ -780,7 +829,7 @@ const completion_t *pager_t::selected_completion(const page_rendering_t &renderi
     const completion_t *result = NULL;
     size_t idx = visual_selected_completion_index(rendering.rows, rendering.cols);
     if (idx != PAGER_SELECTION_NONE) {
-        result = &completion_infos.at(idx).representative;
+        result = &completion_infos.at(idx)->representative;
     }
     return result;
 }
@@ -807,6 +856,8 @@ size_t pager_t::get_selected_column(const page_rendering_t &rendering) const {
 void pager_t::clear() {
     unfiltered_completion_infos.clear();
     completion_infos.clear();
+    filtered_needle.clear();
+    invalidate_column_widths();
     prefix.clear();
     selected_completion_idx = PAGER_SELECTION_NONE;
     fully_disclosed = false;
@@ -42,6 +42,9 @@ class page_rendering_t {
 // How many rows we will show in the "initial" pager.
 #define PAGER_UNDISCLOSED_MAX_ROWS 4
 
+// The maximum number of columns of completion to attempt to fit onto the screen.
+#define PAGER_MAX_COLS 6
+
 typedef std::vector<completion_t> completion_list_t;
 
 class pager_t {
@@ -74,10 +77,14 @@ class pager_t {
         size_t comp_width;
         /// On-screen width of the description information.
         size_t desc_width;
+        /// Whether comp_width and desc_width have been computed. We only measure completions once
+        /// they pass the filter.
+        bool measured;
         /// Minimum acceptable width.
         // size_t min_width;
 
-        comp_t() : comp(), desc(), representative(L""), comp_width(0), desc_width(0) {}
+        comp_t()
+            : comp(), desc(), representative(L""), comp_width(0), desc_width(0), measured(false) {}
 
         // Our text looks like this:
         // completion  (description)
@@ -96,25 +103,38 @@ class pager_t {
 
    private:
     typedef std::vector<comp_t> comp_info_list_t;
+    typedef std::vector<comp_t *> comp_info_ptr_list_t;
 
-    // The filtered list of completion infos.
-    comp_info_list_t completion_infos;
+    // The filtered list of completion infos. These point into unfiltered_completion_infos.
+    comp_info_ptr_list_t completion_infos;
 
-    // The unfiltered list. Note there's a lot of duplication here.
+    // The unfiltered list.
     comp_info_list_t unfiltered_completion_infos;
 
+    // The filter that completion_infos reflects. If the filter grows by appending, we only need to
+    // look at the completions that passed the old one.
+    wcstring filtered_needle;
+
+    // The preferred width of each column of completion_infos when laid out in (index + 1) columns,
+    // or empty if not computed yet. Working these out looks at every completion, not just the
+    // visible ones, so we keep them until the filtered list changes.
+    mutable std::vector<size_t> preferred_widths_by_cols[PAGER_MAX_COLS];
+
     wcstring prefix;
 
-    bool completion_try_print(size_t cols, const wcstring &prefix, const comp_info_list_t &lst,
+    bool completion_try_print(size_t cols, const wcstring &prefix, const comp_info_ptr_list_t &lst,
                               page_rendering_t *rendering, size_t suggested_start_row) const;
 
+    const std::vector<size_t> &preferred_column_widths(size_t cols) const;
+    void invalidate_column_widths();
+
     void recalc_min_widths(comp_info_list_t *lst) const;
-    void measure_completion_infos(std::vector<comp_t> *infos, const wcstring &prefix) const;
+    void measure_completion_info(comp_t *info, size_t prefix_width) const;
 
     bool completion_info_passes_filter(const comp_t &info) const;
 
     void completion_print(size_t cols, const size_t *width_per_column, size_t row_start,
-                          size_t row_stop, const wcstring &prefix, const comp_info_list_t &lst,
+                          size_t row_stop, const wcstring &prefix, const comp_info_ptr_list_t &lst,
                           page_rendering_t *rendering) const;
     line_t completion_print_item(const wcstring &prefix, const comp_t *c, size_t row, size_t column,
                                  size_t width, bool secondary, bool selected,
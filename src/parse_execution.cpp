@@ -13,6 +13,8 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #include <termios.h>
 #include <unistd.h>
 #include <wchar.h>
@@ -31,6 +33,7 @@
 #include "exec.h"
 #include "expand.h"
 #include "function.h"
+#include "intern.h"
 #include "io.h"
 #include "parse_constants.h"
 #include "parse_execution.h"
@@ -51,40 +54,95 @@ static bool specific_statement_type_is_redirectable_block(const parse_node_t &no
            node.type == symbol_switch_statement;
 }
 
-/// Get the name of a redirectable block, for profiling purposes.
-static wcstring profiling_cmd_name_for_redirectable_block(const parse_node_t &node,
-                                                          const parse_node_tree_t &tree,
-                                                          const wcstring &src) {
-    assert(specific_statement_type_is_redirectable_block(node));
-    assert(node.has_source());
-
-    // Get the source for the block, and cut it at the next statement terminator.
-    const size_t src_start = node.source_start;
-    size_t src_len = node.source_length;
-
-    const parse_node_tree_t::parse_node_list_t statement_terminator_nodes =
-        tree.find_nodes(node, parse_token_type_end, 1);
-    if (!statement_terminator_nodes.empty()) {
-        const parse_node_t *term = statement_terminator_nodes.at(0);
-        assert(term->source_start >= src_start);
-        src_len = term->source_start - src_start;
+/// Returns the token a job goes by in the profile: the command of its first statement, past any
+/// and/or/not, or the keyword of a block.
+static const parse_node_t *profiling_cmd_node(const parse_node_t &job_node,
+                                              const parse_node_tree_t &tree) {
+    const parse_node_t *statement = tree.get_child(job_node, 0, symbol_statement);
+    const parse_node_t *node = tree.get_child(*statement, 0);
+    while (node->type == symbol_boolean_statement) {
+        statement = tree.get_child(*node, 1, symbol_statement);
+        node = tree.get_child(*statement, 0);
     }
+    if (node->type == symbol_decorated_statement) {
+        node = &tree.find_child(*node, symbol_plain_statement);
+    }
+    // Blocks start with their keyword, and plain statements with their command.
+    while (node->child_count > 0) {
+        node = tree.get_child(*node, 0);
+    }
+    return node;
+}
 
-    wcstring result = wcstring(src, src_start, src_len);
-    result.append(L"...");
-    return result;
+/// Returns the CPU time in microseconds used by the child processes reaped so far.
+static long long child_cpu_time() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_CHILDREN, &usage) != 0) return 0;
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000LL + usage.ru_utime.tv_usec +
+           usage.ru_stime.tv_usec;
+}
+
+profile_node_t *parse_execution_context_t::profile_enter(const parse_node_t &job_node,
+                                                         profile_start_t *start) {
+    if (!g_profiling_active) return NULL;
+
+    // Jobs are told apart by the function or file they are in, where they are in its source, and
+    // their command. The command is hashed in place, so finding the node of a job that ran before
+    // allocates nothing.
+    const wchar_t *function_name = parser->is_function();
+    const wchar_t *where = function_name ? function_name : parser->current_filename();
+    const parse_node_t *cmd_node = profiling_cmd_node(job_node, this->tree);
+    profile_key_t key;
+    key.where = where ? intern(where) : NULL;
+    key.offset = job_node.source_start;
+    key.cmd_hash = 2166136261u;
+    if (cmd_node->has_source()) {
+        const wchar_t *cmd = this->src.c_str() + cmd_node->source_start;
+        for (size_t i = 0; i < cmd_node->source_length; i++) {
+            key.cmd_hash = (key.cmd_hash ^ (size_t)cmd[i]) * 16777619u;
+        }
+    }
+
+    profile_node_t *parent = parser->profile_current;
+    profile_node_t *&node = parent->children[key];
+    if (node == NULL) {
+        node = new profile_node_t(parent);
+        int line = this->get_current_line_number();
+        if (function_name != NULL) line += function_get_definition_offset(function_name);
+        node->label = format_string(L"%ls:%d %ls", where ? where : L"-", line,
+                                    cmd_node->get_source(this->src).c_str());
+        // Keep the label from breaking up the collapsed stack or the line it is on.
+        std::replace(node->label.begin(), node->label.end(), L';', L',');
+        std::replace(node->label.begin(), node->label.end(), L'\t', L' ');
+        std::replace(node->label.begin(), node->label.end(), L'\n', L' ');
+    }
+    parser->profile_current = node;
+
+    start->time = get_time();
+    start->child_time = child_cpu_time();
+    start->fork_count = g_fork_count;
+    return node;
+}
+
+void parse_execution_context_t::profile_exit(profile_node_t *node, const profile_start_t &start) {
+    node->calls++;
+    node->wall_time += get_time() - start.time;
+    node->child_time += child_cpu_time() - start.child_time;
+    node->forks += g_fork_count - start.fork_count;
+    parser->profile_current = node->parent;
 }
 
 parse_execution_context_t::parse_execution_context_t(moved_ref<parse_node_tree_t> t,
                                                      const wcstring &s, parser_t *p,
-                                                     int initial_eval_level)
+                                                     int initial_eval_level, int line_offset)
     : tree(t),
       src(s),
       parser(p),
       eval_level(initial_eval_level),
       executing_node_idx(NODE_OFFSET_INVALID),
       cached_lineno_offset(0),
-      cached_lineno_count(0) {}
+      cached_lineno_count(0),
+      line_offset(line_offset) {}
 
 // Utilities
 
@@ -705,7 +763,7 @@ parse_execution_result_t parse_execution_context_t::report_errors(
 
         // Get a backtrace.
         wcstring backtrace_and_desc;
-        parser->get_backtrace(src, error_list, &backtrace_and_desc);
+        parser->get_backtrace(src, error_list, &backtrace_and_desc, line_offset);
 
         // Print it.
         if (!should_suppress_stderr_for_tests()) fprintf(stderr, "%ls", backtrace_and_desc.c_str());
@@ -1232,11 +1290,8 @@ parse_execution_result_t parse_execution_context_t::run_1_job(const parse_node_t
     scoped_push<node_offset_t> saved_node_offset(&executing_node_idx, this->get_offset(job_node));
 
     // Profiling support.
-    long long start_time = 0, parse_time = 0, exec_time = 0;
-    profile_item_t *profile_item = this->parser->create_profile_item();
-    if (profile_item != NULL) {
-        start_time = get_time();
-    }
+    profile_start_t profile_start;
+    profile_node_t *profile_node = this->profile_enter(job_node, &profile_start);
 
     // When we encounter a block construct (e.g. while loop) in the general case, we create a "block
     // process" that has a pointer to its source. This allows us to handle block-level redirections.
@@ -1269,16 +1324,8 @@ parse_execution_result_t parse_execution_context_t::run_1_job(const parse_node_t
             }
         }
 
-        if (profile_item != NULL) {
-            // Block-types profile a little weird. They have no 'parse' time, and their command is
-            // just the block type.
-            exec_time = get_time();
-            profile_item->level = eval_level;
-            profile_item->parse = 0;
-            profile_item->exec = (int)(exec_time - start_time);
-            profile_item->cmd = profiling_cmd_name_for_redirectable_block(specific_statement,
-                                                                          this->tree, this->src);
-            profile_item->skipped = false;
+        if (profile_node != NULL) {
+            this->profile_exit(profile_node, profile_start);
         }
 
         return result;
@@ -1315,11 +1362,6 @@ parse_execution_result_t parse_execution_context_t::run_1_job(const parse_node_t
         populated_job = false;
     }
 
-    // Store time it took to 'parse' the command.
-    if (profile_item != NULL) {
-        parse_time = get_time();
-    }
-
     if (populated_job) {
         // Success. Give the job to the parser - it will clean it up.
         parser->job_add(j);
@@ -1342,13 +1384,8 @@ parse_execution_result_t parse_execution_context_t::run_1_job(const parse_node_t
         }
     }
 
-    if (profile_item != NULL) {
-        exec_time = get_time();
-        profile_item->level = eval_level;
-        profile_item->parse = (int)(parse_time - start_time);
-        profile_item->exec = (int)(exec_time - parse_time);
-        profile_item->cmd = j ? j->command() : wcstring();
-        profile_item->skipped = !populated_job;
+    if (profile_node != NULL) {
+        this->profile_exit(profile_node, profile_start);
     }
 
     job_reap(0);  // clean up jobs
@@ -1458,7 +1495,7 @@ int parse_execution_context_t::line_offset_of_character_at_offset(size_t offset)
 
     // Easy hack to handle 0.
     if (offset == 0) {
-        return 0;
+        return line_offset;
     }
 
     // We want to return (one plus) the number of newlines at offsets less than the given offset.
@@ -1483,7 +1520,7 @@ int parse_execution_context_t::line_offset_of_character_at_offset(size_t offset)
         }
         cached_lineno_offset = offset;
     }
-    return cached_lineno_count;
+    return line_offset + cached_lineno_count;
 }
 
 int parse_execution_context_t::get_current_line_number() {
@@ -12,6 +12,7 @@
 
 class parser_t;
 struct block_t;
+struct profile_node_t;
 
 enum parse_execution_result_t {
     /// The job was successfully executed (though it have failed on its own).
@@ -39,6 +40,9 @@ class parse_execution_context_t {
     // Cached line number information.
     size_t cached_lineno_offset;
     int cached_lineno_count;
+    // The number of lines preceding src in the file it came from, if it is a piece of a larger
+    // script.
+    const int line_offset;
     // No copying allowed.
     parse_execution_context_t(const parse_execution_context_t &);
     parse_execution_context_t &operator=(const parse_execution_context_t &);
@@ -121,6 +125,16 @@ class parse_execution_context_t {
     parse_execution_result_t populate_job_from_job_node(job_t *j, const parse_node_t &job_node,
                                                         const block_t *associated_block);
 
+    // Profiling support. profile_enter finds the profile node for a job and notes where its
+    // measurements start, or returns NULL if profiling is off. profile_exit adds them to the node.
+    struct profile_start_t {
+        long long time;
+        long long child_time;
+        int fork_count;
+    };
+    profile_node_t *profile_enter(const parse_node_t &job_node, profile_start_t *start);
+    void profile_exit(profile_node_t *node, const profile_start_t &start);
+
     // Returns the line number of the node at the given index, indexed from 0. Not const since it
     // touches cached_lineno_offset.
     int line_offset_of_node_at_offset(node_offset_t idx);
@@ -128,7 +142,7 @@ class parse_execution_context_t {
 
    public:
     parse_execution_context_t(moved_ref<parse_node_tree_t> t, const wcstring &s, parser_t *p,
-                              int initial_eval_level);
+                              int initial_eval_level, int line_offset = 0);
 
     /// Returns the current eval level.
     int current_eval_level() const { return eval_level; }
@@ -436,8 +436,11 @@ const production_element_t *parse_productions::production_for_token(parse_token_
                                                                     const parse_token_t &input1,
                                                                     const parse_token_t &input2,
                                                                     parse_node_tag_t *out_tag) {
-    debug(5, "Resolving production for %ls with input token <%ls>\n",
-          token_type_description(node_type), input1.describe().c_str());
+    // Only describe the token when it will be logged; this is called for every production.
+    if (debug_level >= 5) {
+        debug(5, "Resolving production for %ls with input token <%ls>\n",
+              token_type_description(node_type), input1.describe().c_str());
+    }
 
     // Fetch the function to resolve the list of productions.
     const production_element_t *(*resolver)(const parse_token_t &input1,  //!OCLINT(unused param)
@@ -374,6 +374,10 @@ struct parse_stack_element_t {
     }
 };
 
+/// Typical number of source characters per parse node, used to size the tree before parsing. Fish
+/// scripts average a little under three.
+#define PARSE_SOURCE_CHARS_PER_NODE 2
+
 /// The parser itself, private implementation of class parse_t. This is a hand-coded table-driven LL
 /// parser. Most hand-coded LL parsers are recursive descent, but recursive descent parsers are
 /// difficult to "pause", unlike table-driven parsers.
@@ -471,7 +475,6 @@ class parse_ll_t {
         // Replace the top of the stack with new stack elements corresponding to our new nodes. Note
         // that these go in reverse order.
         symbol_stack.pop_back();
-        symbol_stack.reserve(symbol_stack.size() + child_count);
         node_offset_t idx = child_count;
         while (idx--) {
             production_element_t elem = production[idx];
@@ -481,11 +484,12 @@ class parse_ll_t {
     }
 
    public:
-    // Constructor
-    explicit parse_ll_t(enum parse_token_type_t goal)
+    // Constructor. The source length is used to estimate how many nodes we will need, so the
+    // tree is usually allocated once up front.
+    parse_ll_t(enum parse_token_type_t goal, size_t source_length)
         : fatal_errored(false), should_generate_error_messages(true) {
-        this->symbol_stack.reserve(16);
-        this->nodes.reserve(64);
+        this->symbol_stack.reserve(64);
+        this->nodes.reserve(16 + source_length / PARSE_SOURCE_CHARS_PER_NODE);
         this->reset_symbols_and_nodes(goal);
     }
 
@@ -1021,8 +1025,11 @@ static bool is_keyword_char(wchar_t c) {
            c == L'\'' || c == L'"' || c == L'\\' || c == '\n';
 }
 
-/// Given a token, returns the keyword it matches, or parse_keyword_none.
-static parse_keyword_t keyword_for_token(token_type tok, const wcstring &token) {
+/// Length of the longest keyword, so longer tokens can be rejected without looking them up.
+#define PARSE_KEYWORD_MAX_LENGTH 8
+
+/// Given a token's text, returns the keyword it matches, or parse_keyword_none.
+static parse_keyword_t keyword_for_token(token_type tok, const wchar_t *tok_txt, size_t len) {
     /* Only strings can be keywords */
     if (tok != TOK_STRING) {
         return parse_keyword_none;
@@ -1035,8 +1042,7 @@ static parse_keyword_t keyword_for_token(token_type tok, const wcstring &token)
     // that this lowercase set could be shrunk to be just the characters that are in keywords.
     parse_keyword_t result = parse_keyword_none;
     bool needs_expand = false, all_chars_valid = true;
-    const wchar_t *tok_txt = token.c_str();
-    for (size_t i = 0; tok_txt[i] != L'\0'; i++) {
+    for (size_t i = 0; i < len; i++) {
         wchar_t c = tok_txt[i];
         if (!is_keyword_char(c)) {
             all_chars_valid = false;
@@ -1049,10 +1055,16 @@ static parse_keyword_t keyword_for_token(token_type tok, const wcstring &token)
     if (all_chars_valid) {
         // Expand if necessary.
         if (!needs_expand) {
-            result = keyword_with_name(tok_txt);
+            // Copy it somewhere we can terminate it.
+            if (len <= PARSE_KEYWORD_MAX_LENGTH) {
+                wchar_t name[PARSE_KEYWORD_MAX_LENGTH + 1];
+                wmemcpy(name, tok_txt, len);
+                name[len] = L'\0';
+                result = keyword_with_name(name);
+            }
         } else {
             wcstring storage;
-            if (unescape_string(tok_txt, &storage, 0)) {
+            if (unescape_string(wcstring(tok_txt, len), &storage, 0)) {
                 result = keyword_with_name(storage.c_str());
             }
         }
@@ -1068,10 +1080,13 @@ static const parse_token_t kInvalidToken = {
 static const parse_token_t kTerminalToken = {
     parse_token_type_terminate, parse_keyword_none, false, false, SOURCE_OFFSET_INVALID, 0};
 
-static inline bool is_help_argument(const wcstring &txt) { return contains(txt, L"-h", L"--help"); }
+static inline bool is_help_argument(const wchar_t *txt, size_t len) {
+    return (len == 2 && !wcsncmp(txt, L"-h", 2)) || (len == 6 && !wcsncmp(txt, L"--help", 6));
+}
 
-/// Return a new parse token, advancing the tokenizer.
-static inline parse_token_t next_parse_token(tokenizer_t *tok, tok_t *token) {
+/// Return a new parse token, advancing the tokenizer. The tokenizer should be constructed with
+/// TOK_NO_TEXT; the token's text is read from the source in place.
+static inline parse_token_t next_parse_token(tokenizer_t *tok, tok_t *token, const wchar_t *src) {
     if (!tok->next(token)) {
         return kTerminalToken;
     }
@@ -1083,10 +1098,11 @@ static inline parse_token_t next_parse_token(tokenizer_t *tok, tok_t *token) {
     // lists builtins, but `builtin "--names"` attempts to run --names as a command. Amazingly as of
     // this writing (10/12/13) nobody seems to have noticed this. Squint at it really hard and it
     // even starts to look like a feature.
+    const wchar_t *txt = src + token->offset;
     result.type = parse_token_type_from_tokenizer_token(token->type);
-    result.keyword = keyword_for_token(token->type, token->text);
-    result.has_dash_prefix = !token->text.empty() && token->text.at(0) == L'-';
-    result.is_help_argument = result.has_dash_prefix && is_help_argument(token->text);
+    result.keyword = keyword_for_token(token->type, txt, token->length);
+    result.has_dash_prefix = token->type == TOK_STRING && token->length > 0 && txt[0] == L'-';
+    result.is_help_argument = result.has_dash_prefix && is_help_argument(txt, token->length);
 
     // These assertions are totally bogus. Basically our tokenizer works in size_t but we work in
     // uint32_t to save some space. If we have a source file larger than 4 GB, we'll probably just
@@ -1103,7 +1119,7 @@ static inline parse_token_t next_parse_token(tokenizer_t *tok, tok_t *token) {
 bool parse_tree_from_string(const wcstring &str, parse_tree_flags_t parse_flags,
                             parse_node_tree_t *output, parse_error_list_t *errors,
                             parse_token_type_t goal) {
-    parse_ll_t parser(goal);
+    parse_ll_t parser(goal, str.size());
     parser.set_should_generate_error_messages(errors != NULL);
 
     // Construct the tokenizer.
@@ -1116,6 +1132,9 @@ bool parse_tree_from_string(const wcstring &str, parse_tree_flags_t parse_flags,
 
     if (errors == NULL) tok_options |= TOK_SQUASH_ERRORS;
 
+    // We look at token text in place in the source, so don't have the tokenizer copy it.
+    tok_options |= TOK_NO_TEXT;
+
     tokenizer_t tok(str.c_str(), tok_options);
 
     // We are an LL(2) parser. We pass two tokens at a time. New tokens come in at index 1. Seed our
@@ -1127,7 +1146,7 @@ bool parse_tree_from_string(const wcstring &str, parse_tree_flags_t parse_flags,
     for (size_t token_count = 0; queue[0].type != parse_token_type_terminate; token_count++) {
         // Push a new token onto the queue.
         queue[0] = queue[1];
-        queue[1] = next_parse_token(&tok, &tokenizer_token);
+        queue[1] = next_parse_token(&tok, &tokenizer_token, str.c_str());
 
         // If we are leaving things unterminated, then don't pass parse_token_type_terminate.
         if (queue[0].type == parse_token_type_terminate &&
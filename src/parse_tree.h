@@ -130,6 +130,13 @@ class parse_node_t {
             return wcstring(str, this->source_start, this->source_length);
     }
 
+    /// Returns whether the node's source is the given string, without copying it out.
+    bool source_equals(const wcstring &str, const wchar_t *literal) const {
+        size_t len = wcslen(literal);
+        return len == this->source_length &&
+               (len == 0 || str.compare(this->source_start, len, literal) == 0);
+    }
+
     /// Returns whether the given location is within the source range or at its end.
     bool location_in_or_at_end_of_source_range(size_t loc) const {
         return has_source() && source_start <= loc && loc - source_start <= source_length;
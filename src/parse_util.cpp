@@ -16,6 +16,7 @@
 #include "common.h"
 #include "expand.h"
 #include "fallback.h"  // IWYU pragma: keep
+#include "lru.h"
 #include "parse_constants.h"
 #include "parse_tree.h"
 #include "parse_util.h"
@@ -303,7 +304,7 @@ static void job_or_process_extent(const wchar_t *buff, size_t cursor_pos, const
         DIE_MEM();
     }
 
-    tokenizer_t tok(buffcpy, TOK_ACCEPT_UNFINISHED);
+    tokenizer_t tok(buffcpy, TOK_ACCEPT_UNFINISHED | TOK_NO_TEXT);
     tok_t token;
     while (tok.next(&token) && !finished) {
         size_t tok_begin = token.offset;
@@ -371,7 +372,7 @@ void parse_util_token_extent(const wchar_t *buff, size_t cursor_pos, const wchar
 
     const wcstring buffcpy = wcstring(cmdsubst_begin, cmdsubst_end - cmdsubst_begin);
 
-    tokenizer_t tok(buffcpy.c_str(), TOK_ACCEPT_UNFINISHED | TOK_SQUASH_ERRORS);
+    tokenizer_t tok(buffcpy.c_str(), TOK_ACCEPT_UNFINISHED | TOK_SQUASH_ERRORS | TOK_NO_TEXT);
     tok_t token;
     while (tok.next(&token)) {
         size_t tok_begin = token.offset;
@@ -379,7 +380,7 @@ void parse_util_token_extent(const wchar_t *buff, size_t cursor_pos, const wchar
 
         // Calculate end of token.
         if (token.type == TOK_STRING) {
-            tok_end += token.text.size();
+            tok_end += token.length;
         }
 
         // Cursor was before beginning of this token, means that the cursor is between two tokens,
@@ -393,14 +394,14 @@ void parse_util_token_extent(const wchar_t *buff, size_t cursor_pos, const wchar
         // and break.
         if (token.type == TOK_STRING && tok_end >= offset_within_cmdsubst) {
             a = cmdsubst_begin + token.offset;
-            b = a + token.text.size();
+            b = a + token.length;
             break;
         }
 
         // Remember previous string token.
         if (token.type == TOK_STRING) {
             pa = cmdsubst_begin + token.offset;
-            pb = pa + token.text.size();
+            pb = pa + token.length;
         }
     }
 
@@ -1045,6 +1046,62 @@ parser_test_error_bits_t parse_util_detect_errors_in_argument(const parse_node_t
     return err;
 }
 
+/// Number of checked arguments whose results we remember.
+#define ARGUMENT_ERROR_CACHE_SIZE 4096
+
+/// The result of checking an argument, keyed by the argument's source. Error offsets are relative to
+/// the start of the argument.
+class argument_error_node_t : public lru_node_t {
+   public:
+    parser_test_error_bits_t bits;
+    parse_error_list_t errors;
+
+    explicit argument_error_node_t(const wcstring &src) : lru_node_t(src), bits(0) {}
+};
+
+class argument_error_cache_t : public lru_cache_t<argument_error_node_t> {
+   protected:
+    virtual void node_was_evicted(argument_error_node_t *node) { delete node; }
+
+   public:
+    argument_error_cache_t() : lru_cache_t<argument_error_node_t>(ARGUMENT_ERROR_CACHE_SIZE) {}
+};
+
+/// Checking an argument with a command substitution means parsing and checking the substitution,
+/// and the reader checks the whole command line every time it is executed. An argument's errors
+/// depend only on its source, so remember them; then checking a long pasted script again only
+/// parses the substitutions that changed. Only used on the main thread.
+static argument_error_cache_t s_argument_error_cache;
+
+/// Like parse_util_detect_errors_in_argument, but reuses the results for arguments we have seen
+/// before.
+static parser_test_error_bits_t detect_errors_in_argument_cached(const parse_node_t &node,
+                                                                 const wcstring &arg_src,
+                                                                 parse_error_list_t *out_errors) {
+    // Arguments without command substitutions are cheap to check, and not worth remembering.
+    if (!is_main_thread() || arg_src.find(L'(') == wcstring::npos) {
+        return parse_util_detect_errors_in_argument(node, arg_src, out_errors);
+    }
+
+    argument_error_node_t *cached = s_argument_error_cache.get_node(arg_src);
+    if (cached == NULL) {
+        // Check it as if it were at the start of the source, so the errors can be moved anywhere.
+        parse_node_t unplaced_node = node;
+        unplaced_node.source_start = 0;
+        cached = new argument_error_node_t(arg_src);
+        cached->bits =
+            parse_util_detect_errors_in_argument(unplaced_node, arg_src, &cached->errors);
+        s_argument_error_cache.add_node(cached);
+    }
+
+    if (out_errors != NULL && !cached->errors.empty()) {
+        parse_error_list_t errors = cached->errors;
+        parse_error_offset_source_start(&errors, node.source_start);
+        out_errors->insert(out_errors->end(), errors.begin(), errors.end());
+    }
+    return cached->bits;
+}
+
 parser_test_error_bits_t parse_util_detect_errors(const wcstring &buff_src,
                                                   parse_error_list_t *out_errors,
                                                   bool allow_incomplete,
@@ -1118,7 +1175,7 @@ parser_test_error_bits_t parse_util_detect_errors(const wcstring &buff_src,
                 }
             } else if (node.type == symbol_argument) {
                 const wcstring arg_src = node.get_source(buff_src);
-                res |= parse_util_detect_errors_in_argument(node, arg_src, &parse_errors);
+                res |= detect_errors_in_argument_cached(node, arg_src, &parse_errors);
             } else if (node.type == symbol_job) {
                 if (node_tree.job_should_be_backgrounded(node)) {
                     // Disallow background in the following cases:
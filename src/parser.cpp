@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <wchar.h>
 #include <algorithm>
+#include <map>
 #include <memory>
 
 #include "common.h"
@@ -107,7 +108,11 @@ static wcstring user_presentable_path(const wcstring &path) {
     return replace_home_directory_with_tilde(path);
 }
 
-parser_t::parser_t() : cancellation_requested(false), is_within_fish_initialization(false) {}
+parser_t::parser_t()
+    : cancellation_requested(false),
+      is_within_fish_initialization(false),
+      profile_root(NULL),
+      profile_current(&profile_root) {}
 
 /// A pointer to the principal parser (which is a static local).
 static parser_t *s_principal_parser = NULL;
@@ -261,55 +266,39 @@ void parser_t::forbid_function(const wcstring &function) { forbidden_function.pu
 
 void parser_t::allow_function() { forbidden_function.pop_back(); }
 
-/// Print profiling information to the specified stream.
-static void print_profile(const std::vector<profile_item_t *> &items, FILE *out) {
-    for (size_t pos = 0; pos < items.size(); pos++) {
-        const profile_item_t *me, *prev;
-        size_t i;
-        int my_time;
-
-        me = items.at(pos);
-        if (me->skipped) {
-            continue;
-        }
-
-        my_time = me->parse + me->exec;
-        for (i = pos + 1; i < items.size(); i++) {
-            prev = items.at(i);
-            if (prev->skipped) {
-                continue;
-            }
-            if (prev->level <= me->level) {
-                break;
-            }
-            if (prev->level > me->level + 1) {
-                continue;
-            }
-
-            my_time -= prev->parse + prev->exec;
-        }
-
-        if (me->cmd.size() == 0) {
-            continue;
-        }
+profile_node_t::~profile_node_t() {
+    for (std::map<profile_key_t, profile_node_t *>::iterator iter = children.begin();
+         iter != children.end(); ++iter) {
+        delete iter->second;
+    }
+}
 
-        if (fwprintf(out, L"%d\t%d\t", my_time, me->parse + me->exec) < 0) {
-            wperror(L"fwprintf");
-            return;
-        }
+/// Print the profile of the given node and its children, one line per node. stack is the collapsed
+/// stack of the node's caller. Returns false on write error.
+static bool print_profile(const profile_node_t &node, const wcstring &stack, FILE *out) {
+    for (std::map<profile_key_t, profile_node_t *>::const_iterator iter = node.children.begin();
+         iter != node.children.end(); ++iter) {
+        const profile_node_t &child = *iter->second;
+        wcstring child_stack = stack;
+        if (!child_stack.empty()) child_stack.push_back(L';');
+        child_stack.append(child.label);
 
-        for (i = 0; i < me->level; i++) {
-            if (fwprintf(out, L"-") < 0) {
-                wperror(L"fwprintf");
-                return;
-            }
+        long long self_time = child.wall_time;
+        for (std::map<profile_key_t, profile_node_t *>::const_iterator grandchild =
+                 child.children.begin();
+             grandchild != child.children.end(); ++grandchild) {
+            self_time -= grandchild->second->wall_time;
         }
 
-        if (fwprintf(out, L"> %ls\n", me->cmd.c_str()) < 0) {
+        if (fwprintf(out, L"%ls\t%lld\t%lld\t%lld\t%lu\t%lu\n", child_stack.c_str(),
+                     std::max(self_time, 0LL), child.wall_time, child.child_time, child.forks,
+                     child.calls) < 0) {
             wperror(L"fwprintf");
-            return;
+            return false;
         }
+        if (!print_profile(child, child_stack, out)) return false;
     }
+    return true;
 }
 
 void parser_t::emit_profiling(const char *path) const {
@@ -319,10 +308,10 @@ void parser_t::emit_profiling(const char *path) const {
     if (!f) {
         debug(1, _(L"Could not write profiling information to file '%s'"), path);
     } else {
-        if (fwprintf(f, _(L"Time\tSum\tCommand\n"), profile_items.size()) < 0) {
+        if (fwprintf(f, L"# Stack\tSelf\tTotal\tChildren\tForks\tCalls\n") < 0) {
             wperror(L"fwprintf");
         } else {
-            print_profile(profile_items, f);
+            print_profile(profile_root, wcstring(), f);
         }
 
         if (fclose(f)) {
@@ -596,15 +585,6 @@ job_t *parser_t::job_get_from_pid(int pid) {
     return 0;
 }
 
-profile_item_t *parser_t::create_profile_item() {
-    profile_item_t *result = NULL;
-    if (g_profiling_active) {
-        result = new profile_item_t();
-        profile_items.push_back(result);
-    }
-    return result;
-}
-
 int parser_t::eval(const wcstring &cmd, const io_chain_t &io, enum block_type_t block_type) {
     // Parse the source into a tree, if we can.
     parse_node_tree_t tree;
@@ -623,7 +603,8 @@ int parser_t::eval(const wcstring &cmd, const io_chain_t &io, enum block_type_t
 }
 
 int parser_t::eval_acquiring_tree(const wcstring &cmd, const io_chain_t &io,
-                                  enum block_type_t block_type, moved_ref<parse_node_tree_t> tree) {
+                                  enum block_type_t block_type, moved_ref<parse_node_tree_t> tree,
+                                  int line_offset) {
     CHECK_BLOCK(1);
     assert(block_type == TOP || block_type == SUBST);
 
@@ -640,7 +621,7 @@ int parser_t::eval_acquiring_tree(const wcstring &cmd, const io_chain_t &io,
 
     // Append to the execution context stack.
     parse_execution_context_t *ctx =
-        new parse_execution_context_t(tree, cmd, this, exec_eval_level);
+        new parse_execution_context_t(tree, cmd, this, exec_eval_level, line_offset);
     execution_contexts.push_back(ctx);
 
     // Execute the first node.
@@ -750,7 +731,7 @@ bool parser_t::detect_errors_in_argument_list(const wcstring &arg_list_src, wcst
 }
 
 void parser_t::get_backtrace(const wcstring &src, const parse_error_list_t &errors,
-                             wcstring *output) const {
+                             wcstring *output, int line_offset) const {
     assert(output != NULL);
     if (!errors.empty()) {
         const parse_error_t &err = errors.at(0);
@@ -764,7 +745,8 @@ void parser_t::get_backtrace(const wcstring &src, const parse_error_list_t &erro
         bool skip_caret = true;
         if (err.source_start != SOURCE_LOCATION_UNKNOWN && err.source_start <= src.size()) {
             // Determine which line we're on.
-            which_line = 1 + std::count(src.begin(), src.begin() + err.source_start, L'\n');
+            which_line =
+                1 + line_offset + std::count(src.begin(), src.begin() + err.source_start, L'\n');
 
             // Don't include the caret if we're interactive, this is the first line of text, and our
             // source is at its beginning, because then it's obvious.
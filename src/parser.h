@@ -4,6 +4,7 @@
 
 #include <stddef.h>
 #include <list>
+#include <map>
 #include <vector>
 
 #include "common.h"
@@ -157,19 +158,47 @@ enum parser_error {
     CMDSUBST_ERROR,
 };
 
-struct profile_item_t {
-    /// Time spent executing the specified command, including parse time for nested blocks.
-    int exec;
-    /// Time spent parsing the specified command, including execution time for command
-    /// substitutions.
-    int parse;
-    /// The block level of the specified command. nested blocks and command substitutions both
-    /// increase the block level.
-    size_t level;
-    /// If the execution of this command was skipped.
-    bool skipped;
-    /// The command string.
-    wcstring cmd;
+/// Identifies a statement among the ones run by the same caller: the function or file it is in
+/// (interned, so it compares by pointer), its offset in that source, and a hash of its command.
+struct profile_key_t {
+    const wchar_t *where;
+    size_t offset;
+    size_t cmd_hash;
+
+    bool operator<(const profile_key_t &rhs) const {
+        if (where != rhs.where) return where < rhs.where;
+        if (offset != rhs.offset) return offset < rhs.offset;
+        return cmd_hash < rhs.cmd_hash;
+    }
+};
+
+/// A node in the profile's call tree: a statement, as reached through one particular chain of
+/// callers. Every run of the statement along that chain is added to the same node, so the profile
+/// grows with the number of distinct call paths rather than with the number of commands run.
+struct profile_node_t {
+    /// How the statement is shown in the profile, as "where:line command".
+    wcstring label;
+    /// Number of times the statement ran.
+    unsigned long calls;
+    /// Wall clock time in microseconds, including everything the statement called.
+    long long wall_time;
+    /// CPU time in microseconds of the child processes reaped while the statement ran.
+    long long child_time;
+    /// Number of processes forked or spawned while the statement ran.
+    unsigned long forks;
+    /// The statement that called this one, or NULL for the root.
+    profile_node_t *parent;
+    /// The statements this one called. We own these pointers.
+    std::map<profile_key_t, profile_node_t *> children;
+
+    explicit profile_node_t(profile_node_t *p)
+        : calls(0), wall_time(0), child_time(0), forks(0), parent(p) {}
+    ~profile_node_t();
+
+   private:
+    // No copying allowed.
+    profile_node_t(const profile_node_t &);
+    profile_node_t &operator=(const profile_node_t &);
 };
 
 class parse_execution_context_t;
@@ -198,8 +227,9 @@ class parser_t {
     wcstring block_stack_description() const;
 #endif
 
-    /// List of profile items, allocated with new.
-    std::vector<profile_item_t *> profile_items;
+    /// Root of the profile's call tree, and the node of the statement being run.
+    profile_node_t profile_root;
+    profile_node_t *profile_current;
 
     // No copying allowed.
     parser_t(const parser_t &);
@@ -240,9 +270,10 @@ class parser_t {
     int eval(const wcstring &cmd, const io_chain_t &io, enum block_type_t block_type);
 
     /// Evaluate the expressions contained in cmd, which has been parsed into the given parse tree.
-    /// This takes ownership of the tree.
+    /// This takes ownership of the tree. If cmd is a piece of a larger script, line_offset is the
+    /// number of lines that precede it, so line numbers are reported relative to the whole script.
     int eval_acquiring_tree(const wcstring &cmd, const io_chain_t &io, enum block_type_t block_type,
-                            moved_ref<parse_node_tree_t> t);
+                            moved_ref<parse_node_tree_t> t, int line_offset = 0);
 
     /// Evaluates a block node at the given node offset in the topmost execution context.
     int eval_block_node(node_offset_t node_idx, const io_chain_t &io, enum block_type_t block_type);
@@ -307,12 +338,10 @@ class parser_t {
     /// Returns the job with the given pid.
     job_t *job_get_from_pid(int pid);
 
-    /// Returns a new profile item if profiling is active. The caller should fill it in. The
-    /// parser_t will clean it up.
-    profile_item_t *create_profile_item();
-
-    void get_backtrace(const wcstring &src, const parse_error_list_t &errors,
-                       wcstring *output) const;
+    /// Describes the first of the given errors in src, followed by the stack trace. line_offset is
+    /// the number of lines that precede src, if it is a piece of a larger script.
+    void get_backtrace(const wcstring &src, const parse_error_list_t &errors, wcstring *output,
+                       int line_offset = 0) const;
 
     /// Detect errors in the specified string when parsed as an argument list. Returns true if an
     /// error occurred.
@@ -326,7 +355,10 @@ class parser_t {
     /// Undo last call to parser_forbid_function().
     void allow_function();
 
-    /// Output profiling data to the given filename.
+    /// Output profiling data to the given filename. Each line is a path through the profile's call
+    /// tree, written as a collapsed stack (statements separated by semicolons), followed by the
+    /// self time, total time and child process CPU time in microseconds, the number of forks and
+    /// the number of calls, separated by tabs.
     void emit_profiling(const char *path) const;
 
     /// Returns the file currently evaluated by the parser. This can be different than
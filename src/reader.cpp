@@ -35,6 +35,7 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <wchar.h>
 #include <memory>
@@ -56,6 +57,7 @@
 #include "io.h"
 #include "iothread.h"
 #include "kill.h"
+#include "lru.h"
 #include "output.h"
 #include "pager.h"
 #include "parse_constants.h"
@@ -96,6 +98,11 @@
 /// more input without repainting.
 #define READAHEAD_MAX 256
 
+/// The minimum time in seconds between two repaints while more input is already waiting to be read.
+/// Repaint requests arriving faster than this are coalesced into the next frame. When no input is
+/// pending, repaints are never delayed.
+#define REPAINT_FRAME_INTERVAL 0.016
+
 /// A mode for calling the reader_kill function. In this mode, the new string is appended to the
 /// current contents of the kill buffer.
 #define KILL_APPEND 0
@@ -222,6 +229,18 @@ class reader_data_t {
     bool repaint_needed;
     /// Whether a screen reset is needed after a repaint.
     bool screen_reset_needed;
+    /// Whether a deferred repaint is waiting in the input callback queue.
+    bool repaint_scheduled;
+    /// When the pending repaint was first requested.
+    double repaint_request_time;
+    /// When the screen was last repainted.
+    double last_repaint_time;
+    /// Number of repaints requested, and number actually performed. These and the latencies below
+    /// (from the request of a repaint to its completion) are reported at debug level 2.
+    unsigned long repaint_requests;
+    unsigned long repaint_count;
+    double repaint_latency_total;
+    double repaint_latency_max;
     /// Whether the reader should exit on ^C.
     bool exit_on_interrupt;
 
@@ -267,6 +286,13 @@ class reader_data_t {
           search_mode(0),
           repaint_needed(0),
           screen_reset_needed(0),
+          repaint_scheduled(false),
+          repaint_request_time(0),
+          last_repaint_time(0),
+          repaint_requests(0),
+          repaint_count(0),
+          repaint_latency_total(0),
+          repaint_latency_max(0),
           exit_on_interrupt(0) {}
 };
 
@@ -310,6 +336,7 @@ static int exit_forced;
 /// Give up control of terminal.
 static void term_donate() {
     set_color(rgb_color_t::normal(), rgb_color_t::normal());
+    reader_set_bracketed_paste(false);
 
     while (1) {
         if (tcsetattr(STDIN_FILENO, TCSANOW, &tty_modes_for_external_cmds) == -1) {
@@ -399,6 +426,12 @@ wcstring combine_command_and_autosuggestion(const wcstring &cmdline,
 /// Repaint the entire commandline. This means reset and clear the commandline, write the prompt,
 /// perform syntax highlighting, write the commandline and move the cursor.
 static void reader_repaint() {
+    double start = timef();
+    if (!data->repaint_needed) {
+        data->repaint_request_time = start;
+        data->repaint_requests++;
+    }
+
     editable_line_t *cmd_line = &data->command_line;
     // Update the indentation.
     data->indents = parse_util_compute_indents(cmd_line->text);
@@ -435,6 +468,13 @@ static void reader_repaint() {
             data->current_page_rendering, focused_on_pager);
 
     data->repaint_needed = false;
+
+    double end = timef();
+    double latency = end - data->repaint_request_time;
+    data->last_repaint_time = end;
+    data->repaint_count++;
+    data->repaint_latency_total += latency;
+    data->repaint_latency_max = std::max(data->repaint_latency_max, latency);
 }
 
 /// Internal helper function for handling killing parts of text.
@@ -466,7 +506,7 @@ static void reader_kill(editable_line_t *el, size_t begin_idx, size_t length, in
     data->command_line_changed(el);
 
     reader_super_highlight_me_plenty();
-    reader_repaint();
+    reader_repaint_needed();
 }
 
 // This is called from a signal handler!
@@ -824,7 +864,11 @@ void reader_exit(int do_exit, int forced) {
 
 void reader_repaint_needed() {
     if (data) {
-        data->repaint_needed = true;
+        if (!data->repaint_needed) {
+            data->repaint_needed = true;
+            data->repaint_request_time = timef();
+        }
+        data->repaint_requests++;
     }
 }
 
@@ -850,11 +894,60 @@ static void reader_repaint_if_needed_one_arg(void *unused) {
     reader_repaint_if_needed();
 }
 
+/// Test if there are bytes available for reading on the specified file descriptor.
+static int can_read(int fd) {
+    struct timeval can_read_timeout = {0, 0};
+    fd_set fds;
+
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    return select(fd + 1, &fds, 0, 0, &can_read_timeout) == 1;
+}
+
+static void reader_repaint_when_idle_one_arg(void *owner);
+
+/// Arrange for reader_repaint_when_idle to run at the next turn of the event loop.
+static void reader_schedule_repaint() {
+    if (!data->repaint_scheduled) {
+        data->repaint_scheduled = true;
+        input_common_add_callback(reader_repaint_when_idle_one_arg, data);
+    }
+}
+
+/// Repaint if needed, unless more input is already waiting and the last repaint was less than a
+/// frame ago. In that case the repaint is retried at the next turn of the event loop, so that a
+/// burst of keystrokes is painted once per frame, and the final state as soon as input runs out.
+static void reader_repaint_when_idle() {
+    if (data == NULL || !(data->repaint_needed || data->screen_reset_needed)) return;
+
+    if (can_read(STDIN_FILENO) && timef() - data->last_repaint_time < REPAINT_FRAME_INTERVAL) {
+        reader_schedule_repaint();
+    } else {
+        reader_repaint_if_needed();
+    }
+}
+
+/// The callback for reader_schedule_repaint. If a nested reader was pushed or popped since the
+/// repaint was scheduled, the reader that scheduled it may be gone, so leave it alone; reader_pop
+/// and reader_readline clear repaint_scheduled for the reader that becomes current.
+static void reader_repaint_when_idle_one_arg(void *owner) {
+    if (data == NULL || data != owner) return;
+    data->repaint_scheduled = false;
+    reader_repaint_when_idle();
+}
+
+/// Request a repaint at the next turn of the event loop, rather than right away. Requests made in
+/// the meantime, e.g. by highlighting and autosuggestions finishing together, share that repaint.
+static void reader_repaint_soon() {
+    reader_repaint_needed();
+    reader_schedule_repaint();
+}
+
 void reader_react_to_color_change() {
     if (!data) return;
 
     if (!data->repaint_needed || !data->screen_reset_needed) {
-        data->repaint_needed = true;
+        reader_repaint_needed();
         data->screen_reset_needed = true;
         input_common_add_callback(reader_repaint_if_needed_one_arg, NULL);
     }
@@ -901,6 +994,7 @@ static bool command_ends_paging(wchar_t c, bool focused_on_search_field) {
         case R_BACKWARD_DELETE_CHAR:
         case R_KILL_LINE:
         case R_YANK:
+        case R_BEGIN_PASTE:
         case R_YANK_POP:
         case R_BACKWARD_KILL_LINE:
         case R_KILL_WHOLE_LINE:
@@ -998,11 +1092,38 @@ static bool insert_string(editable_line_t *el, const wcstring &str,
         reader_super_highlight_me_plenty(-1);
     }
 
-    reader_repaint();
+    reader_repaint_needed();
 
     return true;
 }
 
+/// Insert pasted text as a single edit. Unlike insert_string, this does not look for abbreviations
+/// after every separator, and the command line is highlighted once for the whole paste.
+static void insert_paste(editable_line_t *el, const wcstring &text) {
+    // Terminals send carriage returns for the line breaks in pasted text.
+    wcstring str;
+    str.reserve(text.size());
+    for (size_t i = 0; i < text.size(); i++) {
+        wchar_t c = text.at(i);
+        if (c == L'\r') {
+            if (i + 1 < text.size() && text.at(i + 1) == L'\n') continue;
+            c = L'\n';
+        }
+        str.push_back(c);
+    }
+    if (str.empty()) return;
+
+    el->insert_string(str, 0, str.size());
+    update_buff_pos(el, el->position);
+    data->command_line_changed(el);
+
+    if (el == &data->command_line) {
+        data->suppress_autosuggestion = false;
+        reader_super_highlight_me_plenty();
+    }
+    reader_repaint_needed();
+}
+
 /// Insert the character into the command line buffer and print it to the screen using syntax
 /// highlighting, etc.
 static bool insert_char(editable_line_t *el, wchar_t c, bool allow_expand_abbreviations = false) {
@@ -1128,12 +1249,115 @@ static void completion_insert(const wchar_t *val, complete_flags_t flags) {
     reader_set_buffer_maintaining_pager(new_command_line, cursor);
 }
 
+/// Number of history items whose validity is remembered between autosuggestion searches.
+#define AUTOSUGGEST_VERDICT_CACHE_SIZE 2048
+
+/// Whether a history item may be suggested, keyed by the item's text.
+class autosuggest_verdict_node_t : public lru_node_t {
+   public:
+    const bool valid;
+
+    autosuggest_verdict_node_t(const wcstring &key, bool valid_) : lru_node_t(key), valid(valid_) {}
+};
+
+class autosuggest_verdict_cache_t : public lru_cache_t<autosuggest_verdict_node_t> {
+   protected:
+    virtual void node_was_evicted(autosuggest_verdict_node_t *node) { delete node; }
+
+   public:
+    autosuggest_verdict_cache_t()
+        : lru_cache_t<autosuggest_verdict_node_t>(AUTOSUGGEST_VERDICT_CACHE_SIZE) {}
+};
+
+/// The outcome of the last history search for an autosuggestion. Typing usually extends the command
+/// line, and a history item that starts with the longer command line also started with the shorter
+/// one, so a search for the longer one can skip every item the last search rejected. Validating an
+/// item does I/O, so verdicts are also kept for searches that have to start over, e.g. after a
+/// backspace.
+struct autosuggest_search_state_t {
+    mutex_lock_t lock;
+    /// The history that was searched, and its most recent item at the time, to notice new items.
+    const history_t *history;
+    wcstring newest_item;
+    /// The working directory and variables the verdicts depend on.
+    wcstring environment;
+    /// Whether search_string and match_index describe a completed search.
+    bool have_search;
+    wcstring search_string;
+    /// The index of the item that was suggested, or 0 if the search found nothing.
+    size_t match_index;
+    autosuggest_verdict_cache_t verdicts;
+
+    autosuggest_search_state_t() : history(NULL), have_search(false), match_index(0) {}
+};
+static autosuggest_search_state_t s_autosuggest_search;
+
+bool reader_autosuggest_from_history(history_t *history, const wcstring &search_string,
+                                     const wcstring &working_directory,
+                                     const env_vars_snapshot_t &vars, wcstring *out_suggestion) {
+    ASSERT_IS_BACKGROUND_THREAD();
+    autosuggest_search_state_t &state = s_autosuggest_search;
+    scoped_lock locker(state.lock);
+
+    wcstring environment = working_directory;
+    for (const wchar_t *const *key = env_vars_snapshot_t::highlighting_keys; *key != NULL; key++) {
+        const env_var_t val = vars.get(*key);
+        environment.push_back(L'\0');
+        if (!val.missing()) environment.append(val);
+    }
+    const wcstring newest_item = history->item_at_index(1).str();
+    if (history != state.history || newest_item != state.newest_item ||
+        environment != state.environment) {
+        state.verdicts.evict_all_nodes();
+        state.history = history;
+        state.newest_item = newest_item;
+        state.environment = environment;
+        state.have_search = false;
+    }
+
+    file_detection_context_t detector(history);
+    history_search_t searcher(*history, search_string, HISTORY_SEARCH_TYPE_PREFIX);
+    if (state.have_search && string_prefixes_string(state.search_string, search_string)) {
+        // Nothing more recent than the last suggestion was acceptable.
+        if (state.match_index == 0) return false;
+        searcher.skip_to_index(state.match_index);
+    }
+
+    while (searcher.go_backwards()) {
+        const history_item_t item = searcher.current_item();
+        const wcstring &str = item.str();
+        bool valid;
+        const autosuggest_verdict_node_t *verdict = state.verdicts.get_node(str);
+        if (verdict != NULL) {
+            valid = verdict->valid;
+        } else {
+            // Skip items with newlines because they make terrible autosuggestions.
+            valid = str.find(L'\n') == wcstring::npos &&
+                    autosuggest_validate_from_history(item, detector, working_directory, vars);
+            state.verdicts.add_node(new autosuggest_verdict_node_t(str, valid));
+        }
+        if (valid) {
+            state.have_search = true;
+            state.search_string = search_string;
+            state.match_index = searcher.current_index();
+            out_suggestion->assign(str);
+            return true;
+        }
+    }
+
+    // Don't remember a search that was cut short.
+    if (reader_thread_job_is_stale()) return false;
+    state.have_search = true;
+    state.search_string = search_string;
+    state.match_index = 0;
+    return false;
+}
+
 struct autosuggestion_context_t {
     wcstring search_string;
     wcstring autosuggestion;
     size_t cursor_pos;
-    history_search_t searcher;
-    file_detection_context_t detector;
+    history_t *history;
     const wcstring working_directory;
     const env_vars_snapshot_t vars;
     const unsigned int generation_count;
@@ -1141,8 +1365,7 @@ struct autosuggestion_context_t {
     autosuggestion_context_t(history_t *history, const wcstring &term, size_t pos)
         : search_string(term),
           cursor_pos(pos),
-          searcher(*history, term, HISTORY_SEARCH_TYPE_PREFIX),
-          detector(history),
+          history(history),
           working_directory(env_get_pwd_slash()),
           vars(env_vars_snapshot_t::highlighting_keys),
           generation_count(s_generation_count) {}
@@ -1164,17 +1387,9 @@ struct autosuggestion_context_t {
             return 0;
         }
 
-        while (!reader_thread_job_is_stale() && searcher.go_backwards()) {
-            history_item_t item = searcher.current_item();
-
-            // Skip items with newlines because they make terrible autosuggestions.
-            if (item.str().find('\n') != wcstring::npos) continue;
-
-            if (autosuggest_validate_from_history(item, detector, working_directory, vars)) {
-                // The command autosuggestion was handled specially, so we're done.
-                this->autosuggestion = searcher.current_string();
-                return 1;
-            }
+        if (reader_autosuggest_from_history(history, search_string, working_directory, vars,
+                                            &this->autosuggestion)) {
+            return 1;
         }
 
         // Maybe cancel here.
@@ -1225,7 +1440,7 @@ static void autosuggest_completed(autosuggestion_context_t *ctx, int result) {
         // Autosuggestion is active and the search term has not changed, so we're good to go.
         data->autosuggestion = ctx->autosuggestion;
         sanity_check();
-        reader_repaint();
+        reader_repaint_soon();
     }
     delete ctx;
 }
@@ -1266,7 +1481,7 @@ static void accept_autosuggestion(bool full) {
         update_buff_pos(&data->command_line, data->command_line.size());
         data->command_line_changed(&data->command_line);
         reader_super_highlight_me_plenty();
-        reader_repaint();
+        reader_repaint_needed();
     }
 }
 
@@ -1288,6 +1503,33 @@ static void select_completion_in_direction(enum selection_direction_t dir) {
     }
 }
 
+/// Whether we have asked the terminal for bracketed paste.
+static bool bracketed_paste_on = false;
+
+/// Whether the start of a paste runs begin-paste in the current bind mode.
+static bool bracketed_paste_is_bound() {
+    wcstring_list_t cmds;
+    wcstring sets_mode;
+    return input_mapping_get(L"\x1b[200~", input_get_bind_mode(), &cmds, &sets_mode) &&
+           cmds.size() == 1 && cmds.at(0) == L"begin-paste";
+}
+
+/// Ask the terminal to mark the start and end of pasted text, so that a paste arrives as a single
+/// R_BEGIN_PASTE rather than as keystrokes, or tell it to stop doing so before other programs get
+/// the terminal. Terminals that do not know this mode ignore the request.
+bool reader_set_bracketed_paste(bool enable) {
+    const bool was_on = bracketed_paste_on;
+    if (enable && !bracketed_paste_is_bound()) enable = false;
+    if (enable == was_on) return was_on;
+
+    if (!isatty(STDOUT_FILENO)) return was_on;
+    const env_var_t term = env_get_string(L"TERM");
+    if (term.missing() || term == L"dumb") return was_on;
+    writestr(enable ? L"\x1b[?2004h" : L"\x1b[?2004l");
+    bracketed_paste_on = enable;
+    return was_on;
+}
+
 /// Flash the screen. This function changes the color of the current line momentarily and sends a
 /// BEL to maybe flash the screen or emite a sound, depending on how it is configured.
 static void reader_flash() {
@@ -2038,6 +2280,16 @@ void reader_pop() {
 
     data = data->next;
 
+    if (n->screen.update_count > 0) {
+        debug(2, L"%lu screen updates wrote %lu bytes (%lu per update)", n->screen.update_count,
+              n->screen.total_update_bytes, n->screen.total_update_bytes / n->screen.update_count);
+    }
+    if (n->repaint_count > 0) {
+        debug(2, L"%lu repaints for %lu requests, latency %.2f ms average, %.2f ms max",
+              n->repaint_count, n->repaint_requests,
+              n->repaint_latency_total * 1000 / n->repaint_count, n->repaint_latency_max * 1000);
+    }
+
     // Invoke the destructor to balance our new.
     delete n;
 
@@ -2045,6 +2297,8 @@ void reader_pop() {
         reader_interactive_destroy();
     } else {
         end_loop = 0;
+        // Whatever repaint it had scheduled may have been run while the nested reader was current.
+        data->repaint_scheduled = false;
         // history_set_mode( data->app_name.c_str() );
         s_reset(&data->screen, screen_reset_abandon_line);
     }
@@ -2160,7 +2414,7 @@ static void highlight_complete(background_highlight_context_t *ctx, int result)
             data->colors.swap(ctx->colors);
             sanity_check();
             highlight_search();
-            reader_repaint();
+            reader_repaint_soon();
         }
     }
 
@@ -2333,16 +2587,6 @@ static int read_i(void) {
     return 0;
 }
 
-/// Test if there are bytes available for reading on the specified file descriptor.
-static int can_read(int fd) {
-    struct timeval can_read_timeout = {0, 0};
-    fd_set fds;
-
-    FD_ZERO(&fds);
-    FD_SET(fd, &fds);
-    return select(fd + 1, &fds, 0, 0, &can_read_timeout) == 1;
-}
-
 /// Test if the specified character in the specified string is backslashed. pos may be at the end of
 /// the string, which indicates if there is a trailing backslash.
 static bool is_backslashed(const wcstring &str, size_t pos) {
@@ -2371,7 +2615,8 @@ static wchar_t unescaped_quote(const wcstring &str, size_t pos) {
 
 /// Returns true if the last token is a comment.
 static bool text_ends_in_comment(const wcstring &text) {
-    tokenizer_t tok(text.c_str(), TOK_ACCEPT_UNFINISHED | TOK_SHOW_COMMENTS | TOK_SQUASH_ERRORS);
+    tokenizer_t tok(text.c_str(), TOK_ACCEPT_UNFINISHED | TOK_SHOW_COMMENTS | TOK_SQUASH_ERRORS |
+                                      TOK_NO_TEXT);
     tok_t token;
     while (tok.next(&token)) {
         ;  // pass
@@ -2400,6 +2645,9 @@ const wchar_t *reader_readline(int nchars) {
     data->search_buff.clear();
     data->search_mode = NO_SEARCH;
 
+    // A repaint scheduled during the last call may never have run.
+    data->repaint_scheduled = false;
+
     exec_prompt();
 
     reader_super_highlight_me_plenty();
@@ -2413,6 +2661,7 @@ const wchar_t *reader_readline(int nchars) {
         if (errno == ENOTTY) redirect_tty_output();
         wperror(L"tcsetattr");
     }
+    reader_set_bracketed_paste(true);
 
     while (!finished && !data->end_loop) {
         if (0 < nchars && (size_t)nchars <= data->command_line.size()) {
@@ -2535,6 +2784,14 @@ const wchar_t *reader_readline(int nchars) {
                 // The only thing we can cancel right now is paging, which we handled up above.
                 break;
             }
+            case R_BEGIN_PASTE: {
+                // The terminal sends everything up to the end marker as typed text; take it all in
+                // at once, without going through the key bindings.
+                wcstring text;
+                input_common_read_until(L"\x1b[201~", &text);
+                insert_paste(data->active_edit_line(), text);
+                break;
+            }
             case R_FORCE_REPAINT:
             case R_REPAINT: {
                 if (!coalescing_repaints) {
@@ -3262,9 +3519,18 @@ const wchar_t *reader_readline(int nchars) {
 
         last_char = c;
 
-        reader_repaint_if_needed();
+        // The bind mode, or what is bound in it, may have changed; only take pastes when a binding
+        // handles them.
+        reader_set_bracketed_paste(true);
+
+        reader_repaint_when_idle();
     }
 
+    // A repaint may have been put off because more input was pending; make sure the final state of
+    // the command line is on screen before we leave.
+    reader_repaint_if_needed();
+    reader_set_bracketed_paste(false);
+
     writestr(L"\n");
 
     // Ensure we have no pager contents when we exit.
@@ -3301,27 +3567,26 @@ int reader_has_pager_contents() {
     return !data->current_page_rendering.screen_data.empty();
 }
 
-/// Read non-interactively.  Read input from stdin without displaying the prompt, using syntax
-/// highlighting. This is used for reading scripts and init files.
-static int read_ni(int fd, const io_chain_t &io) {
+/// Size of the reads done when reading non-interactively.
+#define READ_NI_CHUNK_SIZE 4096
+
+/// Whether read_ni checks the syntax of the whole script before executing any of it.
+static bool read_whole_scripts = false;
+
+void reader_set_read_whole_scripts(bool flag) { read_whole_scripts = flag; }
+
+/// Read the whole script from \c des, and execute it if it has no syntax errors. Closes \c des.
+static int read_ni_whole(int des, const io_chain_t &io) {
     parser_t &parser = parser_t::principal_parser();
     FILE *in_stream;
-    wchar_t *buff = 0;
     std::vector<char> acc;
-
-    int des = (fd == STDIN_FILENO ? dup(STDIN_FILENO) : fd);
     int res = 0;
 
-    if (des == -1) {
-        wperror(L"dup");
-        return 1;
-    }
-
     in_stream = fdopen(des, "r");
     if (in_stream != 0) {
         while (!feof(in_stream)) {
-            char buff[4096];
-            size_t c = fread(buff, 1, 4096, in_stream);
+            char buff[READ_NI_CHUNK_SIZE];
+            size_t c = fread(buff, 1, READ_NI_CHUNK_SIZE, in_stream);
 
             if (ferror(in_stream)) {
                 if (errno == EINTR) {
@@ -3371,12 +3636,229 @@ static int read_ni(int fd, const io_chain_t &io) {
     } else {
         debug(1, _(L"Error while opening input stream"));
         wperror(L"fdopen");
-        free(buff);
         res = 1;
     }
     return res;
 }
 
+/// Returns the length of the prefix of the first \c len characters of \c buff that ends in a newline
+/// which is not escaped by a backslash, or 0 if there is no such newline.
+template <typename STR>
+static size_t read_ni_complete_lines_length(const STR &buff, size_t len) {
+    size_t newline = len;
+    while (newline > 0 && (newline = buff.rfind('\n', newline - 1)) != STR::npos) {
+        size_t backslashes = 0;
+        while (backslashes < newline && buff.at(newline - backslashes - 1) == '\\') {
+            backslashes++;
+        }
+        if (backslashes % 2 == 0) return newline + 1;
+    }
+    return 0;
+}
+
+/// Returns the offset in \c str of the start of the top level job containing \c offset, or \c offset
+/// itself if no job contains it.
+static size_t read_ni_top_level_job_start(const wcstring &str, size_t offset) {
+    parse_node_tree_t tree;
+    parse_tree_from_string(str, parse_flag_continue_after_error | parse_flag_leave_unterminated,
+                           &tree, NULL);
+    if (tree.empty()) return offset;
+
+    const parse_node_t *job_list = &tree.at(0);
+    while (const parse_node_t *job = tree.next_node_in_node_list(*job_list, symbol_job, &job_list)) {
+        if (job->has_source() && job->source_start + job->source_length >= offset) {
+            return mini(size_t(job->source_start), offset);
+        }
+    }
+    return offset;
+}
+
+/// Returns whether commands run with \c io read their standard input from the same file as \c des.
+static bool read_ni_shares_stdin(int des, const io_chain_t &io) {
+    int stdin_fd = STDIN_FILENO;
+    const shared_ptr<const io_data_t> in = io_chain_get(io, STDIN_FILENO);
+    if (in) {
+        switch (in->io_mode) {
+            case IO_FD: {
+                stdin_fd = static_cast<const io_fd_t *>(in.get())->old_fd;
+                break;
+            }
+            case IO_PIPE: {
+                stdin_fd = static_cast<const io_pipe_t *>(in.get())->pipe_fd[0];
+                break;
+            }
+            default: {
+                return false;  // a file opened by name, or no stdin at all
+            }
+        }
+    }
+
+    struct stat des_buf, stdin_buf;
+    return fstat(des, &des_buf) == 0 && fstat(stdin_fd, &stdin_buf) == 0 &&
+           des_buf.st_dev == stdin_buf.st_dev && des_buf.st_ino == stdin_buf.st_ino;
+}
+
+/// Reads from \c des into \c buff like read(2), but stops after the first newline. This takes a
+/// system call per byte, so it is only used when we can't seek back over what we read too far.
+static ssize_t read_ni_line(int des, char *buff, size_t size) {
+    size_t amt = 0;
+    while (amt < size) {
+        ssize_t got = read(des, buff + amt, 1);
+        if (got == 1) {
+            if (buff[amt++] == '\n') break;
+        } else if (got < 0 && errno == EINTR && amt > 0) {
+            continue;
+        } else {
+            // EOF or an error. Hand back what we have first; the next call will see it again.
+            return amt > 0 ? (ssize_t)amt : got;
+        }
+    }
+    return amt;
+}
+
+/// Read a script from \c des, executing it a piece at a time as soon as the lines read so far form
+/// complete commands. Only the commands that have not been executed yet are held in memory. On a
+/// syntax error, the lines before it are executed and the rest of the script is not. Closes \c des.
+static int read_ni_streaming(int des, const io_chain_t &io) {
+    parser_t &parser = parser_t::principal_parser();
+    std::string pending;
+    int res = 0;
+
+    // If the script is a regular file, we seek back over what we have read but not yet executed, so
+    // commands in the script that read from the same file see the rest of the script, as in other
+    // shells. If it is a pipe or terminal that those commands read from too, we can't seek, so we
+    // read it a line at a time instead, as bash does. Either way a command that reads standard
+    // input starts at the line after it, however the script arrives.
+    struct stat buf;
+    const bool seekable = fstat(des, &buf) == 0 && S_ISREG(buf.st_mode);
+    const bool line_at_a_time = !seekable && read_ni_shares_stdin(des, io);
+
+    // The number of lines executed so far, so errors can be reported with line numbers relative to
+    // the whole script.
+    int line_offset = 0;
+    bool checked_bom = false;
+
+    // When the lines read so far are an incomplete command, such as an unclosed block, we wait
+    // until the input has doubled before trying again, so a long block is parsed only a few times
+    // while it streams in. If the input pauses, we try again right away with the complete lines we
+    // have, since they may have closed the block.
+    size_t next_attempt_length = 0;
+    size_t incomplete_length = 0;
+
+    bool done = false;
+    while (!done) {
+        char buff[READ_NI_CHUNK_SIZE];
+        ssize_t amt = line_at_a_time ? read_ni_line(des, buff, sizeof buff)
+                                     : read(des, buff, sizeof buff);
+        if (amt < 0) {
+            if (errno == EINTR) continue;
+            // If we succeeded in making the fd blocking, keep going.
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && make_fd_blocking(des) == 0) continue;
+
+            // Fatal error. We won't evaluate incomplete commands.
+            debug(1, _(L"Error while reading from file descriptor"));
+            break;
+        }
+        const bool eof = (amt == 0);
+        pending.append(buff, amt);
+        done = eof;
+
+        // Execute as much of what we have read as we can.
+        while (!pending.empty()) {
+            if (shell_is_exiting()) {
+                done = true;
+                break;
+            }
+
+            size_t length =
+                eof ? pending.size() : read_ni_complete_lines_length(pending, pending.size());
+            if (length == 0) break;
+            if (!eof && length < next_attempt_length &&
+                (length == incomplete_length || can_read(des))) {
+                break;
+            }
+
+            wcstring str = str2wcstring(pending.data(), length);
+            if (!checked_bom) {
+                // Swallow a BOM (issue #1518).
+                if (str.at(0) == UTF8_BOM_WCHAR) {
+                    size_t bom_length = wcs2string(str.substr(0, 1)).size();
+                    pending.erase(0, bom_length);
+                    length -= bom_length;
+                    str.erase(0, 1);
+                }
+                checked_bom = true;
+            }
+
+            parse_error_list_t errors;
+            parse_node_tree_t tree;
+            parser_test_error_bits_t err = parse_util_detect_errors(str, &errors, !eof, &tree);
+            if ((err & PARSER_TEST_ERROR) && !errors.empty() &&
+                errors.at(0).source_start != SOURCE_LOCATION_UNKNOWN) {
+                // Execute the lines before the job with the error first, so we stop in the same
+                // place however the script was split up by our reads.
+                size_t error_start = mini(errors.at(0).source_start, str.size());
+                size_t prefix_length =
+                    read_ni_complete_lines_length(str, read_ni_top_level_job_start(str, error_start));
+                if (prefix_length > 0) {
+                    const wcstring prefix(str, 0, prefix_length);
+                    parse_error_list_t prefix_errors;
+                    parse_node_tree_t prefix_tree;
+                    if (!parse_util_detect_errors(prefix, &prefix_errors, false, &prefix_tree)) {
+                        length = wcs2string(prefix).size();
+                        str = prefix;
+                        tree.swap(prefix_tree);
+                        err = 0;
+                    }
+                }
+            }
+
+            if (err & PARSER_TEST_ERROR) {
+                wcstring sb;
+                parser.get_backtrace(str, errors, &sb, line_offset);
+                fwprintf(stderr, L"%ls", sb.c_str());
+                res = 1;
+                done = true;
+                break;
+            } else if (err & PARSER_TEST_INCOMPLETE) {
+                next_attempt_length = 2 * length;
+                incomplete_length = length;
+                break;
+            }
+
+            pending.erase(0, length);
+            next_attempt_length = 0;
+            incomplete_length = 0;
+            if (seekable && !eof && !pending.empty() &&
+                lseek(des, -(off_t)pending.size(), SEEK_CUR) != (off_t)-1) {
+                pending.clear();
+            }
+
+            parser.eval_acquiring_tree(str, io, TOP, moved_ref<parse_node_tree_t>(tree),
+                                       line_offset);
+            line_offset += (int)std::count(str.begin(), str.end(), L'\n');
+        }
+    }
+
+    if (close(des)) {
+        debug(1, _(L"Error while closing input stream"));
+        wperror(L"close");
+        res = 1;
+    }
+    return res;
+}
+
+/// Read non-interactively.  Read input from stdin without displaying the prompt, using syntax
+/// highlighting. This is used for reading scripts and init files.
+static int read_ni(int fd, const io_chain_t &io) {
+    int des = (fd == STDIN_FILENO ? dup(STDIN_FILENO) : fd);
+    if (des == -1) {
+        wperror(L"dup");
+        return 1;
+    }
+    return read_whole_scripts ? read_ni_whole(des, io) : read_ni_streaming(des, io);
+}
+
 int reader_read(int fd, const io_chain_t &io) {
     int res;
 
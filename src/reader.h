@@ -48,6 +48,10 @@ class editable_line_t {
 /// Read commands from \c fd until encountering EOF.
 int reader_read(int fd, const io_chain_t &io);
 
+/// Sets whether non-interactive reads check the syntax of the whole script before executing any of
+/// it. By default, complete commands are executed as soon as they have been read.
+void reader_set_read_whole_scripts(bool flag);
+
 /// Tell the shell that it should exit after the currently running command finishes.
 void reader_exit(int do_exit, int force);
 
@@ -188,6 +192,11 @@ void reader_set_expand_abbreviations(bool flag);
 /// Sets whether the reader should exit on ^C.
 void reader_set_exit_on_interrupt(bool flag);
 
+/// Asks the terminal to bracket pasted text, or to stop doing so. The request is only made if the
+/// start of a paste is bound to begin-paste in the current bind mode; otherwise the markers would
+/// arrive as keystrokes. Returns whether bracketed paste was on before.
+bool reader_set_bracketed_paste(bool enable);
+
 /// Returns true if the shell is exiting, 0 otherwise.
 bool shell_is_exiting();
 
@@ -217,6 +226,14 @@ int reader_has_pager_contents();
 wcstring combine_command_and_autosuggestion(const wcstring &cmdline,
                                             const wcstring &autosuggestion);
 
+/// Search history for an autosuggestion for the given command line, as is done in the background
+/// after every keystroke. Returns true and sets \c out_suggestion if a suggestion was found. The
+/// search resumes from where the previous one stopped when the command line extends the previous
+/// one. Exposed for testing purposes only.
+bool reader_autosuggest_from_history(history_t *history, const wcstring &search_string,
+                                     const wcstring &working_directory,
+                                     const env_vars_snapshot_t &vars, wcstring *out_suggestion);
+
 /// Expand abbreviations at the given cursor position. Exposed for testing purposes only.
 bool reader_expand_abbreviation_in_command(const wcstring &cmdline, size_t cursor_pos,
                                            wcstring *output);
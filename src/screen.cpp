@@ -33,6 +33,7 @@
 #include "common.h"
 #include "fallback.h"  // IWYU pragma: keep
 #include "highlight.h"
+#include "lru.h"
 #include "output.h"
 #include "pager.h"
 #include "screen.h"
@@ -275,7 +276,7 @@ struct prompt_layout_t {
 
 /// Calculate layout information for the given prompt. Does some clever magic to detect common
 /// escape sequences that may be embeded in a prompt, such as color codes.
-static prompt_layout_t calc_prompt_layout(const wchar_t *prompt) {
+static prompt_layout_t compute_prompt_layout(const wchar_t *prompt) {
     size_t current_line_width = 0;
     size_t j;
 
@@ -310,13 +311,54 @@ static prompt_layout_t calc_prompt_layout(const wchar_t *prompt) {
     return prompt_layout;
 }
 
+/// The number of prompt layouts we remember. There's a left and a right prompt, and they may switch
+/// between a few values, such as with a vi mode indicator.
+#define PROMPT_LAYOUT_CACHE_SIZE 16
+
+class prompt_layout_node_t : public lru_node_t {
+   public:
+    prompt_layout_t layout;
+
+    explicit prompt_layout_node_t(const wcstring &prompt) : lru_node_t(prompt), layout() {}
+};
+
+class prompt_layout_cache_t : public lru_cache_t<prompt_layout_node_t> {
+   protected:
+    virtual void node_was_evicted(prompt_layout_node_t *node) { delete node; }
+
+   public:
+    prompt_layout_cache_t() : lru_cache_t<prompt_layout_node_t>(PROMPT_LAYOUT_CACHE_SIZE) {}
+};
+
+/// Laying out a prompt tries every color escape terminfo knows about against each escape sequence
+/// in it, and we do it for both prompts on every repaint, though the prompts rarely change. So
+/// remember layouts by prompt, for as long as the terminal stays the same.
+static prompt_layout_cache_t s_prompt_layout_cache;
+static const void *s_prompt_layout_cache_term = NULL;
+
+/// Like compute_prompt_layout, but reuses the layout of prompts we have seen before.
+static prompt_layout_t calc_prompt_layout(const wcstring &prompt) {
+    if (s_prompt_layout_cache_term != cur_term) {
+        s_prompt_layout_cache.evict_all_nodes();
+        s_prompt_layout_cache_term = cur_term;
+    }
+
+    prompt_layout_node_t *cached = s_prompt_layout_cache.get_node(prompt);
+    if (cached == NULL) {
+        cached = new prompt_layout_node_t(prompt);
+        cached->layout = compute_prompt_layout(prompt.c_str());
+        s_prompt_layout_cache.add_node(cached);
+    }
+    return cached->layout;
+}
+
 static size_t calc_prompt_lines(const wcstring &prompt) {
     // Hack for the common case where there's no newline at all. I don't know if a newline can
     // appear in an escape sequence, so if we detect a newline we have to defer to
     // calc_prompt_width_and_lines.
     size_t result = 1;
     if (prompt.find(L'\n') != wcstring::npos || prompt.find(L'\f') != wcstring::npos) {
-        result = calc_prompt_layout(prompt.c_str()).line_count;
+        result = calc_prompt_layout(prompt).line_count;
     }
     return result;
 }
@@ -570,6 +612,38 @@ static void s_write_str(data_buffer_t *b, const wchar_t *s) {
     writestr(s);
 }
 
+/// Returns whether the character of \p o_line at \p o_idx is already on screen as the character of
+/// \p s_line at \p s_idx, which is assumed to be in the same column. Characters that are or are
+/// followed by zero width characters never count as unchanged, as combining marks have to be
+/// written together with what they combine with.
+static bool line_char_unchanged(const line_t &o_line, size_t o_idx, const line_t &s_line,
+                                size_t s_idx) {
+    if (s_idx >= s_line.size()) return false;
+    wchar_t oc = o_line.char_at(o_idx), sc = s_line.char_at(s_idx);
+    if (oc != sc || o_line.color_at(o_idx) != s_line.color_at(s_idx)) return false;
+    if (fish_wcwidth(oc) < 1) return false;
+    if (o_idx + 1 < o_line.size() && fish_wcwidth(o_line.char_at(o_idx + 1)) < 1) return false;
+    if (s_idx + 1 < s_line.size() && fish_wcwidth(s_line.char_at(s_idx + 1)) < 1) return false;
+    return true;
+}
+
+/// Returns about how many bytes it takes to write the given character.
+static size_t char_output_cost(wchar_t c) {
+    if (c < 0x80) return 1;
+    if (c < 0x800) return 2;
+    if (c < 0x10000) return 3;
+    return 4;
+}
+
+/// Returns about how many bytes it takes to move the cursor right by the given number of columns.
+static size_t cursor_right_cost(int steps) {
+    size_t cost = steps * strlen(cursor_right);
+    if (parm_right_cursor != NULL && parm_right_cursor[0] != '\0') {
+        cost = mini(cost, strlen(tparm(parm_right_cursor, steps)));
+    }
+    return cost;
+}
+
 /// Returns the length of the "shared prefix" of the two lines, which is the run of matching text
 /// and colors. If the prefix ends on a combining character, do not include the previous character
 /// in the prefix.
@@ -731,6 +805,10 @@ static void s_update(screen_t *scr, const wchar_t *left_prompt, const wchar_t *r
         // Note that skip_remaining is a width, not a character count.
         size_t skip_remaining = start_pos;
 
+        // Unchanged characters past the first difference are only skipped if they end before this
+        // width.
+        size_t skip_unchanged_limit = screen_width;
+
         if (!should_clear_screen_this_line) {
             // Compute how much we should skip. At a minimum we skip over the prompt. But also skip
             // over the shared prefix of what we want to output now, and what we output before, to
@@ -752,6 +830,7 @@ static void s_update(screen_t *scr, const wchar_t *left_prompt, const wchar_t *r
                 }
                 if (next_line_will_change) {
                     skip_remaining = mini(skip_remaining, (size_t)(scr->actual_width - 2));
+                    skip_unchanged_limit = scr->actual_width - 2;
                 }
             }
         }
@@ -771,7 +850,11 @@ static void s_update(screen_t *scr, const wchar_t *left_prompt, const wchar_t *r
             if (width > 0) break;
         }
 
-        // Now actually output stuff.
+        // Now actually output stuff. s_idx and s_width track the character of the actual line in
+        // the column we are at, so we can skip runs of characters that are already on screen, as
+        // when only the color of the character under the cursor changed.
+        size_t s_idx = 0;
+        int s_width = 0;
         for (; j < o_line.size(); j++) {
             // If we are about to output into the last column, clear the screen first. If we clear
             // the screen after we output into the last column, it can erase the last character due
@@ -784,6 +867,34 @@ static void s_update(screen_t *scr, const wchar_t *left_prompt, const wchar_t *r
                 has_cleared_screen = true;
             }
 
+            while (s_idx < s_line.size() && s_width < current_width) {
+                s_width += fish_wcwidth_min_0(s_line.char_at(s_idx++));
+            }
+            if (!has_cleared_screen && !should_clear_screen_this_line && s_width == current_width) {
+                // Measure the run of unchanged characters starting here.
+                size_t run_end = j, run_idx = s_idx;
+                int run_width = 0;
+                size_t run_cost = 0;
+                while (run_end < o_line.size() &&
+                       line_char_unchanged(o_line, run_end, s_line, run_idx)) {
+                    int width = fish_wcwidth_min_0(o_line.char_at(run_end));
+                    if ((size_t)(current_width + run_width + width) > skip_unchanged_limit) break;
+                    run_width += width;
+                    run_cost += char_output_cost(o_line.char_at(run_end));
+                    run_end++;
+                    run_idx++;
+                }
+
+                // Skip the run if nothing after it changes, or if moving past it is cheaper than
+                // writing it out again.
+                if (run_end > j &&
+                    (run_end == o_line.size() || run_cost > cursor_right_cost(run_width))) {
+                    current_width += run_width;
+                    j = run_end - 1;
+                    continue;
+                }
+            }
+
             perform_any_impending_soft_wrap(scr, current_width, (int)i);
             s_move(scr, &output, current_width, (int)i);
             s_set_color(scr, &output, o_line.color_at(j));
@@ -820,8 +931,14 @@ static void s_update(screen_t *scr, const wchar_t *left_prompt, const wchar_t *r
             s_write_mbs(&output, clr_eol);
         }
 
-        // Output any rprompt if this is the first line.
-        if (i == 0 && right_prompt_width > 0) {  //!OCLINT(Use early exit/continue)
+        // Clearing the first line also erases the right prompt.
+        if (i == 0 && (clear_remainder || has_cleared_screen)) {
+            scr->actual_right_prompt.clear();
+        }
+
+        // Output any rprompt if this is the first line, unless it's already there.
+        if (i == 0 && right_prompt_width > 0 &&  //!OCLINT(Use early exit/continue)
+            scr->actual_right_prompt != right_prompt) {
             s_move(scr, &output, (int)(screen_width - right_prompt_width), (int)i);
             s_set_color(scr, &output, 0xffffffff);
             s_write_str(&output, right_prompt);
@@ -839,6 +956,7 @@ static void s_update(screen_t *scr, const wchar_t *left_prompt, const wchar_t *r
                    scr->actual.cursor.y);
             s_write_str(&output, L"\r");
             scr->actual.cursor.x = 0;
+            scr->actual_right_prompt = right_prompt;
         }
     }
 
@@ -858,6 +976,11 @@ static void s_update(screen_t *scr, const wchar_t *left_prompt, const wchar_t *r
         write_loop(STDOUT_FILENO, &output.at(0), output.size());
     }
 
+    scr->last_update_bytes = output.size();
+    scr->total_update_bytes += output.size();
+    scr->update_count++;
+    debug(5, L"Screen update wrote %lu bytes", (unsigned long)output.size());
+
     // We have now synced our actual screen against our desired screen. Note that this is a big
     // assignment!
     scr->actual = scr->desired;
@@ -907,8 +1030,8 @@ static screen_layout_t compute_layout(screen_t *s, size_t screen_width,
     const wchar_t *right_prompt = right_prompt_str.c_str();
     const wchar_t *autosuggestion = autosuggestion_str.c_str();
 
-    prompt_layout_t left_prompt_layout = calc_prompt_layout(left_prompt);
-    prompt_layout_t right_prompt_layout = calc_prompt_layout(right_prompt);
+    prompt_layout_t left_prompt_layout = calc_prompt_layout(left_prompt_str);
+    prompt_layout_t right_prompt_layout = calc_prompt_layout(right_prompt_str);
 
     size_t left_prompt_width = left_prompt_layout.last_line_width;
     size_t right_prompt_width = right_prompt_layout.last_line_width;
@@ -1181,6 +1304,7 @@ void s_reset(screen_t *s, screen_reset_mode_t mode) {
     }
 
     if (repaint_prompt) s->actual_left_prompt.clear();
+    s->actual_right_prompt.clear();
     s->actual.resize(0);
     s->need_clear_lines = true;
     s->need_clear_screen = s->need_clear_screen || clear_to_eos;
@@ -1268,6 +1392,7 @@ screen_t::screen_t()
     : desired(),
       actual(),
       actual_left_prompt(),
+      actual_right_prompt(),
       last_right_prompt_width(),
       actual_width(SCREEN_WIDTH_UNINITIALIZED),
       soft_wrap_location(INVALID_LOCATION),
@@ -1275,6 +1400,9 @@ screen_t::screen_t()
       need_clear_lines(false),
       need_clear_screen(false),
       actual_lines_before_reset(0),
+      last_update_bytes(0),
+      total_update_bytes(0),
+      update_count(0),
       prev_buff_1(),
       prev_buff_2(),
       post_buff_1(),
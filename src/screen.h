@@ -114,6 +114,8 @@ class screen_t {
     screen_data_t actual;
     /// A string containing the prompt which was last printed to the screen.
     wcstring actual_left_prompt;
+    /// The right prompt that is on screen, or empty if it has been cleared.
+    wcstring actual_right_prompt;
     /// Last right prompt width.
     size_t last_right_prompt_width;
     /// The actual width of the screen at the time of the last screen write.
@@ -133,6 +135,11 @@ class screen_t {
     /// is used when resizing the window larger: if the cursor jumps to the line above, we need to
     /// remember to clear the subsequent lines.
     size_t actual_lines_before_reset;
+    /// How many bytes the last screen update wrote to the terminal, how many all of them wrote,
+    /// and how many updates there were.
+    size_t last_update_bytes;
+    unsigned long total_update_bytes;
+    unsigned long update_count;
     /// These status buffers are used to check if any output has occurred other than from fish's
     /// main loop, in which case we need to redraw.
     struct stat prev_buff_1, prev_buff_2, post_buff_1, post_buff_2;
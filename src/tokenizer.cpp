@@ -52,11 +52,13 @@ tokenizer_t::tokenizer_t(const wchar_t *b, tok_flags_t flags)
     : buff(b),
       orig_buff(b),
       last_type(TOK_NONE),
+      last_text_length(0),
       last_pos(0),
       has_next(false),
       accept_unfinished(false),
       show_comments(false),
       show_blank_lines(false),
+      no_text(false),
       error(TOK_ERROR_NONE),
       global_error_offset(-1),
       squash_errors(false),
@@ -67,6 +69,7 @@ tokenizer_t::tokenizer_t(const wchar_t *b, tok_flags_t flags)
     this->show_comments = static_cast<bool>(flags & TOK_SHOW_COMMENTS);
     this->squash_errors = static_cast<bool>(flags & TOK_SQUASH_ERRORS);
     this->show_blank_lines = static_cast<bool>(flags & TOK_SHOW_BLANK_LINES);
+    this->no_text = static_cast<bool>(flags & TOK_NO_TEXT);
 
     this->has_next = (*b != L'\0');
     this->tok_next();
@@ -80,13 +83,22 @@ bool tokenizer_t::next(struct tok_t *result) {
 
     const size_t current_pos = this->buff - this->orig_buff;
 
-    // We want to copy our last_token into result->text. If we just do this naively via =, we are
-    // liable to trigger std::string's CoW implementation: result->text's storage will be
-    // deallocated and instead will acquire a reference to last_token's storage. But last_token will
-    // be overwritten soon, which will trigger a new allocation and a copy. So our attempt to re-use
-    // result->text's storage will have failed. To ensure that doesn't happen, use assign() with
-    // wchar_t.
-    result->text.assign(this->last_token.data(), this->last_token.size());
+    // Strings and comments are copied straight out of the source, unless the caller doesn't want
+    // them. Otherwise we want to copy our last_token into result->text. If we just do this naively
+    // via =, we are liable to trigger std::string's CoW implementation: result->text's storage will
+    // be deallocated and instead will acquire a reference to last_token's storage. But last_token
+    // will be overwritten soon, which will trigger a new allocation and a copy. So our attempt to
+    // re-use result->text's storage will have failed. To ensure that doesn't happen, use assign()
+    // with wchar_t.
+    if (this->last_type == TOK_STRING || this->last_type == TOK_COMMENT) {
+        if (this->no_text) {
+            result->text.clear();
+        } else {
+            result->text.assign(this->orig_buff + this->last_pos, this->last_text_length);
+        }
+    } else {
+        result->text.assign(this->last_token.data(), this->last_token.size());
+    }
 
     result->type = this->last_type;
     result->offset = this->last_pos;
@@ -133,14 +145,34 @@ static bool tok_is_string_character(wchar_t c, bool is_first) {
     }
 }
 
-/// Quick test to catch the most common 'non-magical' characters, makes read_string slightly faster
-/// by adding a fast path for the most common characters. This is obviously not a suitable
-/// replacement for iswalpha.
-static int myal(wchar_t c) { return (c >= L'a' && c <= L'z') || (c >= L'A' && c <= L'Z'); }
+/// ASCII characters that read_string never treats specially, in any mode: everything printable
+/// except separators, quotes, escapes, brackets, parentheses and the conditional separator ^.
+static const bool tok_plain_characters[128] = {
+    // Control characters.
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    // Space ! " # $ % & ' ( ) * + , - . /
+    0, 1, 0, 1, 1, 1, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1,
+    // 0-9 : ; < = > ?
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 1, 0, 1,
+    // @ A-O
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    // P-Z [ \ ] ^ _
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1,
+    // ` a-o
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    // p-z { | } ~ DEL
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 0};
+
+/// Quick test to catch the most common 'non-magical' characters, makes read_string faster by
+/// letting it skip over runs of them. This is obviously not a suitable replacement for
+/// tok_is_string_character.
+static inline bool tok_is_plain_character(wchar_t c) {
+    return static_cast<unsigned long>(c) < 128 && tok_plain_characters[c];
+}
 
 /// Read the next token as a string.
 void tokenizer_t::read_string() {
-    long len;
     int do_loop = 1;
     size_t paran_count = 0;
     // Up to 96 open parens, before we give up on good error reporting.
@@ -160,140 +192,146 @@ void tokenizer_t::read_string() {
     } mode = mode_regular_text;
 
     while (1) {
-        if (!myal(*this->buff)) {
-            if (*this->buff == L'\\') {
-                const wchar_t *error_location = this->buff;
+        // Most of a typical token is ordinary characters, so skip over those in a tight loop.
+        if (tok_is_plain_character(*this->buff)) {
+            do {
                 this->buff++;
-                if (*this->buff == L'\0') {
-                    if ((!this->accept_unfinished)) {
-                        TOK_CALL_ERROR(this, TOK_UNTERMINATED_ESCAPE, UNTERMINATED_ESCAPE_ERROR,
-                                       error_location);
-                        return;
-                    }
-                    // Since we are about to increment tok->buff, decrement it first so the
-                    // increment doesn't go past the end of the buffer. See issue #389.
-                    this->buff--;
-                    do_loop = 0;
-                }
+            } while (tok_is_plain_character(*this->buff));
+            is_first = false;
+        }
 
-                this->buff++;
-                continue;
+        if (*this->buff == L'\\') {
+            const wchar_t *error_location = this->buff;
+            this->buff++;
+            if (*this->buff == L'\0') {
+                if ((!this->accept_unfinished)) {
+                    TOK_CALL_ERROR(this, TOK_UNTERMINATED_ESCAPE, UNTERMINATED_ESCAPE_ERROR,
+                                   error_location);
+                    return;
+                }
+                // Since we are about to increment tok->buff, decrement it first so the increment
+                // doesn't go past the end of the buffer. See issue #389.
+                this->buff--;
+                do_loop = 0;
             }
 
-            switch (mode) {
-                case mode_regular_text: {
-                    switch (*this->buff) {
-                        case L'(': {
-                            paran_count = 1;
-                            paran_offsets[0] = this->buff - this->orig_buff;
-                            mode = mode_subshell;
-                            break;
-                        }
-                        case L'[': {
-                            if (this->buff != start) {
-                                mode = mode_array_brackets;
-                                offset_of_bracket = this->buff - this->orig_buff;
-                            }
-                            break;
+            this->buff++;
+            continue;
+        }
+
+        switch (mode) {
+            case mode_regular_text: {
+                switch (*this->buff) {
+                    case L'(': {
+                        paran_count = 1;
+                        paran_offsets[0] = this->buff - this->orig_buff;
+                        mode = mode_subshell;
+                        break;
+                    }
+                    case L'[': {
+                        if (this->buff != start) {
+                            mode = mode_array_brackets;
+                            offset_of_bracket = this->buff - this->orig_buff;
                         }
-                        case L'\'':
-                        case L'"': {
-                            const wchar_t *end = quote_end(this->buff);
-                            if (end) {
-                                this->buff = end;
-                            } else {
-                                const wchar_t *error_loc = this->buff;
-                                this->buff += wcslen(this->buff);
-
-                                if (!this->accept_unfinished) {
-                                    TOK_CALL_ERROR(this, TOK_UNTERMINATED_QUOTE, QUOTE_ERROR,
-                                                   error_loc);
-                                    return;
-                                }
-                                do_loop = 0;
+                        break;
+                    }
+                    case L'\'':
+                    case L'"': {
+                        const wchar_t *end = quote_end(this->buff);
+                        if (end) {
+                            this->buff = end;
+                        } else {
+                            const wchar_t *error_loc = this->buff;
+                            this->buff += wcslen(this->buff);
+
+                            if (!this->accept_unfinished) {
+                                TOK_CALL_ERROR(this, TOK_UNTERMINATED_QUOTE, QUOTE_ERROR,
+                                               error_loc);
+                                return;
                             }
-                            break;
+                            do_loop = 0;
                         }
-                        default: {
-                            if (!tok_is_string_character(*(this->buff), is_first)) {
-                                do_loop = 0;
-                            }
-                            break;
+                        break;
+                    }
+                    default: {
+                        if (!tok_is_string_character(*(this->buff), is_first)) {
+                            do_loop = 0;
                         }
+                        break;
                     }
-                    break;
                 }
+                break;
+            }
 
-                case mode_array_brackets_and_subshell:
-                case mode_subshell: {
-                    switch (*this->buff) {
-                        case L'\'':
-                        case L'\"': {
-                            const wchar_t *end = quote_end(this->buff);
-                            if (end) {
-                                this->buff = end;
-                            } else {
-                                const wchar_t *error_loc = this->buff;
-                                this->buff += wcslen(this->buff);
-                                if ((!this->accept_unfinished)) {
-                                    TOK_CALL_ERROR(this, TOK_UNTERMINATED_QUOTE, QUOTE_ERROR,
-                                                   error_loc);
-                                    return;
-                                }
-                                do_loop = 0;
-                            }
-                            break;
-                        }
-                        case L'(': {
-                            if (paran_count < paran_offsets_max) {
-                                paran_offsets[paran_count] = this->buff - this->orig_buff;
-                            }
-                            paran_count++;
-                            break;
-                        }
-                        case L')': {
-                            assert(paran_count > 0);
-                            paran_count--;
-                            if (paran_count == 0) {
-                                mode =
-                                    (mode == mode_array_brackets_and_subshell ? mode_array_brackets
-                                                                              : mode_regular_text);
+            case mode_array_brackets_and_subshell:
+            case mode_subshell: {
+                switch (*this->buff) {
+                    case L'\'':
+                    case L'\"': {
+                        const wchar_t *end = quote_end(this->buff);
+                        if (end) {
+                            this->buff = end;
+                        } else {
+                            const wchar_t *error_loc = this->buff;
+                            this->buff += wcslen(this->buff);
+                            if ((!this->accept_unfinished)) {
+                                TOK_CALL_ERROR(this, TOK_UNTERMINATED_QUOTE, QUOTE_ERROR,
+                                               error_loc);
+                                return;
                             }
-                            break;
-                        }
-                        case L'\0': {
                             do_loop = 0;
-                            break;
                         }
-                        default: {
-                            break;  // ignore other chars
+                        break;
+                    }
+                    case L'(': {
+                        if (paran_count < paran_offsets_max) {
+                            paran_offsets[paran_count] = this->buff - this->orig_buff;
+                        }
+                        paran_count++;
+                        break;
+                    }
+                    case L')': {
+                        assert(paran_count > 0);
+                        paran_count--;
+                        if (paran_count == 0) {
+                            mode =
+                                (mode == mode_array_brackets_and_subshell ? mode_array_brackets
+                                                                          : mode_regular_text);
                         }
+                        break;
+                    }
+                    case L'\0': {
+                        do_loop = 0;
+                        break;
+                    }
+                    default: {
+                        break;  // ignore other chars
                     }
-                    break;
                 }
+                break;
+            }
 
-                case mode_array_brackets: {
-                    switch (*this->buff) {
-                        case L'(': {
-                            paran_count = 1;
-                            paran_offsets[0] = this->buff - this->orig_buff;
-                            mode = mode_array_brackets_and_subshell;
-                            break;
-                        }
-                        case L']': {
-                            mode = mode_regular_text;
-                            break;
-                        }
-                        case L'\0': {
-                            do_loop = 0;
-                            break;
-                        }
-                        default: {
-                            break;  // ignore other chars
-                        }
+            case mode_array_brackets: {
+                switch (*this->buff) {
+                    case L'(': {
+                        paran_count = 1;
+                        paran_offsets[0] = this->buff - this->orig_buff;
+                        mode = mode_array_brackets_and_subshell;
+                        break;
+                    }
+                    case L']': {
+                        mode = mode_regular_text;
+                        break;
+                    }
+                    case L'\0': {
+                        do_loop = 0;
+                        break;
+                    }
+                    default: {
+                        break;  // ignore other chars
                     }
-                    break;
                 }
+                break;
             }
         }
 
@@ -331,9 +369,7 @@ void tokenizer_t::read_string() {
         return;
     }
 
-    len = this->buff - start;
-
-    this->last_token.assign(start, len);
+    this->last_text_length = this->buff - start;
     this->last_type = TOK_STRING;
 }
 
@@ -342,8 +378,7 @@ void tokenizer_t::read_comment() {
     const wchar_t *start = this->buff;
     while (*(this->buff) != L'\n' && *(this->buff) != L'\0') this->buff++;
 
-    size_t len = this->buff - start;
-    this->last_token.assign(start, len);
+    this->last_text_length = this->buff - start;
     this->last_type = TOK_COMMENT;
 }
 
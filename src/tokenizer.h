@@ -48,10 +48,16 @@ enum tokenizer_error {
 /// the tokenizer to return each of them as a separate END.
 #define TOK_SHOW_BLANK_LINES 8
 
+/// Flag telling the tokenizer not to copy the text of strings and comments into tok_t::text. Their
+/// text is the source range given by offset and length, so callers that only need to look at it
+/// can read it in place. Error messages are still returned as text.
+#define TOK_NO_TEXT 16
+
 typedef unsigned int tok_flags_t;
 
 struct tok_t {
-    // The text of the token, or an error message for type error.
+    // The text of the token, or an error message for type error. Empty for strings and comments if
+    // TOK_NO_TEXT is set.
     wcstring text;
     // The type of the token.
     token_type type;
@@ -78,8 +84,12 @@ class tokenizer_t {
     const wchar_t *buff;
     /// A copy of the original string.
     const wchar_t *orig_buff;
-    /// The last token.
+    /// The text of the last token, for tokens whose text is not simply their source (errors and
+    /// redirections).
     wcstring last_token;
+    /// Length of the text of the last token, for strings and comments. Their text starts at
+    /// last_pos.
+    size_t last_text_length;
     /// Type of last token.
     enum token_type last_type;
     /// Offset of last token.
@@ -92,6 +102,8 @@ class tokenizer_t {
     bool show_comments;
     /// Whether all blank lines are returned.
     bool show_blank_lines;
+    /// Whether the text of strings and comments is left out of returned tokens.
+    bool no_text;
     /// Last error.
     tokenizer_error error;
     /// Last error offset, in "global" coordinates (relative to orig_buff).